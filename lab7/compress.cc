@@ -0,0 +1,148 @@
+// block compression implementation.
+
+#include "compress.h"
+#include <string.h>
+#include <stdint.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+// Read 4 bytes as a 32-bit word.
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Hash a 32-bit word to an index of the match table.
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Append the continuation bytes of a length field.
+static void put_length(std::string &out, size_t len)
+{
+    while (len >= 255) {
+        out.push_back((char)255);
+        len -= 255;
+    }
+    out.push_back((char)len);
+}
+
+// Append a sequence of literals followed by a match. A match_len of 0 means no match (the last sequence).
+static void put_sequence(std::string &out, const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    unsigned char token = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+
+    out.push_back((char)token);
+    if (lit_len >= 15)
+        put_length(out, lit_len - 15);
+    out.append((const char*)lit, lit_len);
+
+    if (!match_len)
+        return;
+
+    out.push_back((char)(offset & 0xff));
+    out.push_back((char)(offset >> 8));
+    if (ml >= 15)
+        put_length(out, ml - 15);
+}
+
+std::string lz_compress(const std::string &in)
+{
+    const unsigned char *src = (const unsigned char*)in.data();
+    size_t n = in.size();
+    size_t anchor = 0, pos = 0;
+    int table[1 << LZ_HASH_BITS];
+    std::string out;
+
+    memset(table, -1, sizeof(table));
+    out.reserve(n / 2 + 16);
+
+    while (pos + LZ_MIN_MATCH <= n) {
+        uint32_t v = read32(src + pos);
+        uint32_t h = lz_hash(v);
+        int ref = table[h];
+
+        table[h] = pos;
+
+        if (ref >= 0 && pos - ref <= LZ_MAX_OFFSET && read32(src + ref) == v) {
+            size_t len = LZ_MIN_MATCH;
+            while (pos + len < n && src[ref + len] == src[pos + len])
+                ++len;
+
+            put_sequence(out, src + anchor, pos - anchor, pos - ref, len);
+            pos += len;
+            anchor = pos;
+        } else {
+            ++pos;
+        }
+    }
+
+    put_sequence(out, src + anchor, n - anchor, 0, 0);
+    return out;
+}
+
+// Read the continuation bytes of a length field. Return false if in ends first.
+static bool get_length(const unsigned char *in, size_t n, size_t &ip, size_t &len)
+{
+    unsigned char b;
+
+    do {
+        if (ip >= n)
+            return false;
+        b = in[ip++];
+        len += b;
+    } while (b == 255);
+
+    return true;
+}
+
+bool lz_decompress(const std::string &in, std::string &out, unsigned int size)
+{
+    const unsigned char *src = (const unsigned char*)in.data();
+    size_t n = in.size();
+    size_t ip = 0, op = 0;
+
+    out.resize(size);
+    char *dst = size ? &out[0] : NULL;
+
+    while (ip < n) {
+        unsigned char token = src[ip++];
+
+        // Copy literals.
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !get_length(src, n, ip, lit_len))
+            return false;
+        if (ip + lit_len > n || op + lit_len > size)
+            return false;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == n) // The last sequence.
+            break;
+
+        // Copy the match, which may overlap the bytes being produced.
+        if (ip + 2 > n)
+            return false;
+        size_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(src, n, ip, match_len))
+            return false;
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || op + match_len > size)
+            return false;
+        for (size_t i = 0; i < match_len; ++i, ++op)
+            dst[op] = dst[op - offset];
+    }
+
+    return op == size;
+}
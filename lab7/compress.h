@@ -0,0 +1,18 @@
+// block compression interface.
+
+#ifndef compress_h
+#define compress_h
+
+#include <string>
+
+/* A fast LZ77 compressor in the style of LZ4.
+ * The compressed data is a sequence of |token|literal length...|literals|offset|match length...|,
+ * where the high 4 bits of the token give the number of literals and the low 4 bits the match length minus 4.
+ * A field of 15 is continued in the following bytes, each adding up to 255. The last sequence has no match.
+ */
+std::string lz_compress(const std::string &in);
+
+// Decompress data made by lz_compress(). Return false if in is damaged or does not decompress to size bytes.
+bool lz_decompress(const std::string &in, std::string &out, unsigned int size);
+
+#endif
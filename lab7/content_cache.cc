@@ -0,0 +1,161 @@
+// decoded extent content cache implementation.
+
+#include "content_cache.h"
+#include "slock.h"
+
+content_cache::content_cache(size_t budget)
+{
+    shard_budget = budget / CONTENT_CACHE_SHARDS;
+
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        shard &s = shards[i];
+        VERIFY(pthread_mutex_init(&s.mutex, NULL) == 0);
+        s.bytes = 0;
+        s.hits = s.misses = s.insertions = s.evictions = s.invalidations = 0;
+    }
+}
+
+content_cache::~content_cache()
+{
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i)
+        VERIFY(pthread_mutex_destroy(&shards[i].mutex) == 0);
+}
+
+// Drop an entry from a shard. The caller should hold the lock of the shard.
+void content_cache::erase_p(shard &s, std::map<extent_protocol::extentid_t, std::list<entry>::iterator>::iterator it)
+{
+    s.bytes -= it->second->content.size();
+    s.lru.erase(it->second);
+    s.index.erase(it);
+}
+
+/* Get the content of version of eid, and the value set by insert() or checked() if asked.
+ * Return false if it is not cached or larger than max_size. */
+bool content_cache::lookup(extent_protocol::extentid_t eid, unsigned long long version, std::string &content,
+        size_t max_size, unsigned long long *checked)
+{
+    shard &s = shard_of(eid);
+    ScopedLock ml(&s.mutex);
+
+    std::map<extent_protocol::extentid_t, std::list<entry>::iterator>::iterator it = s.index.find(eid);
+    if (it == s.index.end() || it->second->version != version) {
+        if (it != s.index.end() && it->second->version < version) // Outdated, it will never be used again.
+            erase_p(s, it);
+        s.misses++;
+        return false;
+    }
+
+    if (it->second->content.size() > max_size) {
+        s.misses++;
+        return false;
+    }
+
+    // Move the entry to the front of the LRU list.
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    content = it->second->content;
+    if (checked)
+        *checked = it->second->checked;
+    s.hits++;
+    return true;
+}
+
+// Cache the content of version of eid, evicting the least recently used entries to stay within budget.
+void content_cache::insert(extent_protocol::extentid_t eid, unsigned long long version, const std::string &content,
+        unsigned long long checked)
+{
+    shard &s = shard_of(eid);
+
+    if (content.size() > shard_budget) // Too large to be cached.
+        return;
+
+    ScopedLock ml(&s.mutex);
+
+    std::map<extent_protocol::extentid_t, std::list<entry>::iterator>::iterator it = s.index.find(eid);
+    if (it != s.index.end()) {
+        if (it->second->version > version) // A newer version is already cached.
+            return;
+        erase_p(s, it);
+    }
+
+    while (s.bytes + content.size() > shard_budget && !s.lru.empty()) {
+        s.index.erase(s.lru.back().eid);
+        s.bytes -= s.lru.back().content.size();
+        s.lru.pop_back();
+        s.evictions++;
+    }
+
+    entry e;
+    e.eid = eid;
+    e.version = version;
+    e.content = content;
+    e.checked = checked;
+    s.lru.push_front(e);
+    s.index[eid] = s.lru.begin();
+    s.bytes += content.size();
+    s.insertions++;
+}
+
+void content_cache::checked(extent_protocol::extentid_t eid, unsigned long long version, unsigned long long checked)
+{
+    shard &s = shard_of(eid);
+    ScopedLock ml(&s.mutex);
+
+    std::map<extent_protocol::extentid_t, std::list<entry>::iterator>::iterator it = s.index.find(eid);
+    if (it != s.index.end() && it->second->version == version)
+        it->second->checked = checked;
+}
+
+// Drop the cached content of eid, if any.
+void content_cache::erase(extent_protocol::extentid_t eid)
+{
+    shard &s = shard_of(eid);
+    ScopedLock ml(&s.mutex);
+
+    std::map<extent_protocol::extentid_t, std::list<entry>::iterator>::iterator it = s.index.find(eid);
+    if (it != s.index.end()) {
+        erase_p(s, it);
+        s.invalidations++;
+    }
+}
+
+// Drop everything, e.g. when the whole disk is replaced by a version control operation.
+void content_cache::clear()
+{
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        shard &s = shards[i];
+        ScopedLock ml(&s.mutex);
+
+        s.invalidations += s.index.size();
+        s.lru.clear();
+        s.index.clear();
+        s.bytes = 0;
+    }
+}
+
+// Add the counters of the cache to stats.
+void content_cache::get_stats(std::map<std::string, unsigned long long> &stats)
+{
+    unsigned long long hits = 0, misses = 0, insertions = 0, evictions = 0, invalidations = 0, bytes = 0, entries = 0;
+
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; ++i) {
+        shard &s = shards[i];
+        ScopedLock ml(&s.mutex);
+
+        hits += s.hits;
+        misses += s.misses;
+        insertions += s.insertions;
+        evictions += s.evictions;
+        invalidations += s.invalidations;
+        bytes += s.bytes;
+        entries += s.index.size();
+    }
+
+    stats["content_cache_hits"] = hits;
+    stats["content_cache_misses"] = misses;
+    stats["content_cache_hit_rate_percent"] = hits + misses ? hits * 100 / (hits + misses) : 0;
+    stats["content_cache_insertions"] = insertions;
+    stats["content_cache_evictions"] = evictions;
+    stats["content_cache_invalidations"] = invalidations;
+    stats["content_cache_bytes"] = bytes;
+    stats["content_cache_entries"] = entries;
+}
@@ -0,0 +1,58 @@
+// decoded extent content cache.
+
+#ifndef content_cache_h
+#define content_cache_h
+
+#include <string>
+#include <map>
+#include <list>
+#include <pthread.h>
+#include "extent_protocol.h"
+
+#define CONTENT_CACHE_SIZE (4 * 1024 * 1024) // Total bytes of content kept in the cache.
+#define CONTENT_CACHE_SHARDS 8 // Number of independently locked parts of the cache.
+
+/* A bounded cache of decoded extent contents, keyed by (extent id, version).
+ * The owner gives every modification of an extent a new version, so a content decoded before
+ * a modification can never be returned for a lookup made after it.
+ * Extents are spread over shards by id, each shard has its own lock, LRU list and share of the budget.
+ */
+class content_cache {
+private:
+    struct entry {
+        extent_protocol::extentid_t eid;
+        unsigned long long version;
+        std::string content;
+        unsigned long long checked; // Given by the owner, see checked().
+    };
+
+    struct shard {
+        pthread_mutex_t mutex;
+        std::list<entry> lru; // Most recently used first.
+        std::map<extent_protocol::extentid_t, std::list<entry>::iterator> index;
+        size_t bytes;
+        unsigned long long hits, misses, insertions, evictions, invalidations;
+    };
+
+    shard shards[CONTENT_CACHE_SHARDS];
+    size_t shard_budget;
+
+    shard &shard_of(extent_protocol::extentid_t eid) { return shards[eid % CONTENT_CACHE_SHARDS]; }
+    void erase_p(shard &s, std::map<extent_protocol::extentid_t, std::list<entry>::iterator>::iterator it);
+
+public:
+    content_cache(size_t budget = CONTENT_CACHE_SIZE);
+    ~content_cache();
+
+    bool lookup(extent_protocol::extentid_t eid, unsigned long long version, std::string &content,
+            size_t max_size = (size_t)-1, unsigned long long *checked = NULL);
+    void insert(extent_protocol::extentid_t eid, unsigned long long version, const std::string &content,
+            unsigned long long checked = 0);
+    // Set the value kept with the cached content of version of eid, e.g. when the owner last checked it.
+    void checked(extent_protocol::extentid_t eid, unsigned long long version, unsigned long long checked);
+    void erase(extent_protocol::extentid_t eid);
+    void clear();
+    void get_stats(std::map<std::string, unsigned long long> &stats);
+};
+
+#endif
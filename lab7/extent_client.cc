@@ -1,7 +1,10 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "slock.h"
+#include "handle.h"
 #include <sstream>
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
 #include <unistd.h>
@@ -15,21 +18,558 @@ extent_client::extent_client(std::string dst)
     if (cl->bind() != 0) {
         printf("extent_client: bind failed\n");
     }
+
+    // The server recalls the leases of this client through it, see recall().
+    rsrpc = new rpcs(callback_port(id));
+    rsrpc->reg(rextent_protocol::recall, this, &extent_client::recall);
+
+    VERIFY(pthread_mutex_init(&cache_mutex, NULL) == 0);
+    VERIFY(pthread_cond_init(&flush_cond, NULL) == 0);
+    cache_hits = cache_misses = cache_writes = cache_flushes = 0;
+    attr_hits = attr_misses = leases_recalled = 0;
+
+    wb_dirty = 0;
+    wb_limit_flushes = 0;
+
+    VERIFY(pthread_cond_init(&ra_cond, NULL) == 0);
+    ra_stop = false;
+    ra_clock = ra_epoch = 0;
+    ra_bytes = 0;
+    ra_hits = ra_misses = ra_prefetched_bytes = ra_dir_hits = 0;
+    VERIFY(pthread_create(&ra_thread, NULL, prefetch_main, this) == 0);
 }
 
 extent_client::~extent_client()
 {
+    {
+        ScopedLock ml(&cache_mutex);
+        ra_stop = true;
+        VERIFY(pthread_cond_signal(&ra_cond) == 0);
+    }
+    VERIFY(pthread_join(ra_thread, NULL) == 0);
+    VERIFY(pthread_cond_destroy(&ra_cond) == 0);
+
+    flush_all();
+
+    delete rsrpc;
+    VERIFY(pthread_cond_destroy(&flush_cond) == 0);
+    VERIFY(pthread_mutex_destroy(&cache_mutex) == 0);
     delete cl;
 }
 
-// a demo to show how to use RPC
+// Write back an extent, and return the error if it cannot be.
+extent_protocol::status extent_client::sync(extent_protocol::extentid_t eid)
+{
+    return flush(eid);
+}
+
+/* Write back all dirty contents once more than WB_MAX_DIRTY bytes are dirty,
+ * so writers cannot fill the cache faster than it is written back. */
+void extent_client::limit_dirty()
+{
+    {
+        ScopedLock ml(&cache_mutex);
+        if (wb_dirty <= WB_MAX_DIRTY)
+            return;
+        wb_limit_flushes++;
+    }
+    flush_all();
+}
+
+/* Count the dirty bytes of a cached content again after it is changed or written back.
+ * The caller should hold cache_mutex. */
+void extent_client::count_dirty_p(cached_extent *e)
+{
+    wb_dirty -= e->dirty_bytes;
+    e->dirty_bytes = e->dirty ? e->data.size() : 0;
+    wb_dirty += e->dirty_bytes;
+}
+
+/* Return the cache entry of an extent, NULL if its lock is not cached or it is a directory.
+ * The caller should hold cache_mutex. */
+extent_client::cached_extent* extent_client::cached_p(extent_protocol::extentid_t eid)
+{
+    if (held.find(eid) == held.end())
+        return NULL;
+    cached_extent *e = &cache[eid];
+    return e->is_dir ? NULL : e;
+}
+
+/* Cache the content of a file or symlink whose lock is cached, so that it can be changed in the cache.
+ * Return false if it cannot be. */
+bool extent_client::load(extent_protocol::extentid_t eid)
+{
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (!e || !e->has_attr)
+            return false;
+        if (e->has_data)
+            return true;
+    }
+
+    std::string buf;
+    if (fetch(eid, buf) != extent_protocol::OK)
+        return false;
+
+    ScopedLock ml(&cache_mutex);
+    cached_extent *e = cached_p(eid);
+    if (!e)
+        return false;
+    if (!e->has_data) {
+        e->data = buf;
+        e->has_data = true;
+    }
+    return true;
+}
+
+/* Update the cached attributes after the cached content is changed.
+ * The caller should hold cache_mutex. */
+void extent_client::modified_p(cached_extent *e)
+{
+    e->dirty = true;
+    count_dirty_p(e);
+    cache_writes++;
+    if (e->has_attr) {
+        e->a.size = e->data.size();
+        e->a.mtime = e->a.ctime = time(NULL);
+    }
+}
+
+/* Write back the cached content of an extent. Write-backs of one extent never overlap,
+ * so an older content cannot be stored after a newer one. */
+extent_protocol::status extent_client::flush(extent_protocol::extentid_t eid)
+{
+    std::string data;
+
+    {
+        ScopedLock ml(&cache_mutex);
+        std::map<extent_protocol::extentid_t, cached_extent>::iterator it;
+        while ((it = cache.find(eid)) != cache.end() && it->second.flushing)
+            VERIFY(pthread_cond_wait(&flush_cond, &cache_mutex) == 0);
+        if (it == cache.end() || !it->second.dirty)
+            return extent_protocol::OK;
+        data = it->second.data;
+        it->second.dirty = false;
+        it->second.flushing = true;
+        count_dirty_p(&it->second);
+        cache_flushes++;
+    }
+
+    extent_protocol::status ret = store(eid, data);
+    if (ret != extent_protocol::OK)
+        printf("extent_client: write back of %llu failed\n", eid);
+
+    ScopedLock ml(&cache_mutex);
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(eid);
+    if (it != cache.end()) {
+        it->second.flushing = false;
+        // Written again by the next flush, unless changed meanwhile, which made it dirty already.
+        if (ret != extent_protocol::OK) {
+            it->second.dirty = true;
+            count_dirty_p(&it->second);
+        }
+    }
+    VERIFY(pthread_cond_broadcast(&flush_cond) == 0);
+    return ret;
+}
+
+// Write back all modified cached contents.
+void extent_client::flush_all()
+{
+    std::vector<extent_protocol::extentid_t> dirty;
+
+    {
+        ScopedLock ml(&cache_mutex);
+        for (std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.begin(); it != cache.end(); ++it)
+            if (it->second.dirty)
+                dirty.push_back(it->first);
+    }
+
+    for (size_t i = 0; i < dirty.size(); ++i)
+        flush(dirty[i]);
+}
+
+/* Drop the cached attributes and content of an extent, and its prefetched data.
+ * The caller should hold cache_mutex. */
+void extent_client::forget_p(extent_protocol::extentid_t eid)
+{
+    uncache_p(eid);
+    forget_leased_p(eid);
+}
+
+/* Drop the cache entry of an extent, with its dirty bytes.
+ * The caller should hold cache_mutex. */
+void extent_client::uncache_p(extent_protocol::extentid_t eid)
+{
+    std::map<extent_protocol::extentid_t, cached_extent>::iterator it = cache.find(eid);
+    if (it == cache.end())
+        return;
+    wb_dirty -= it->second.dirty_bytes;
+    cache.erase(it);
+}
+
+/* Drop what is known about an extent from its leases: the leased attributes and the prefetched data.
+ * The caller should hold cache_mutex. */
+void extent_client::forget_leased_p(extent_protocol::extentid_t eid)
+{
+    leases.erase(eid);
+
+    std::map<extent_protocol::extentid_t, std::map<unsigned int, ra_segment> >::iterator it = ra_segments.find(eid);
+    if (it != ra_segments.end()) {
+        for (std::map<unsigned int, ra_segment>::iterator s = it->second.begin(); s != it->second.end(); ++s)
+            ra_bytes -= s->second.data.size();
+        ra_segments.erase(it);
+    }
+    ra_streams.erase(eid);
+    ra_dirs.erase(eid);
+    ra_gens[eid] = ++ra_clock; // Prefetches running now are not used.
+}
+
+/* Drop what is known from all leases, as forget_leased_p() does for one extent.
+ * The caller should hold cache_mutex. */
+void extent_client::forget_all_leased_p()
+{
+    leases.clear();
+    ra_streams.clear();
+    ra_segments.clear();
+    ra_fifo.clear();
+    ra_dirs.clear();
+    ra_bytes = 0;
+    ra_epoch = ++ra_clock;
+    ra_gens.clear();
+}
+
+// Drop the cached attributes and content of an extent changed at the server.
+void extent_client::invalidate(extent_protocol::extentid_t eid)
+{
+    ScopedLock ml(&cache_mutex);
+    forget_p(eid);
+}
+
+// Drop everything cached, e.g. when version control operations replace the whole file system.
+void extent_client::invalidate_all()
+{
+    ScopedLock ml(&cache_mutex);
+    cache.clear();
+    wb_dirty = 0;
+    forget_all_leased_p();
+}
+
+/* The generation of an extent, which changes whenever it is forgotten.
+ * The caller should hold cache_mutex. */
+unsigned long long extent_client::gen_p(extent_protocol::extentid_t eid)
+{
+    std::map<extent_protocol::extentid_t, unsigned long long>::iterator it = ra_gens.find(eid);
+    return it != ra_gens.end() && it->second > ra_epoch ? it->second : ra_epoch;
+}
+
+/* Get a read of an extent from the prefetched data if it holds all of it.
+ * The caller should hold cache_mutex. */
+bool extent_client::readahead_hit_p(extent_protocol::extentid_t eid, unsigned int off, unsigned int len,
+        std::string &buf)
+{
+    std::map<extent_protocol::extentid_t, std::map<unsigned int, ra_segment> >::iterator it = ra_segments.find(eid);
+    if (it == ra_segments.end())
+        return false;
+
+    std::map<unsigned int, ra_segment>::iterator s = it->second.upper_bound(off);
+    if (s == it->second.begin())
+        return false;
+    --s;
+
+    const ra_segment &seg = s->second;
+    unsigned int start = s->first, end = start + seg.data.size();
+    if (lease_clock_ms() >= seg.expiry) {
+        ra_bytes -= seg.data.size();
+        it->second.erase(s);
+        return false;
+    }
+    if (off + len > end && !(seg.eof && off <= end))
+        return false;
+
+    buf = seg.data.substr(off - start, len);
+    return true;
+}
+
+/* Follow the reads of an extent: a read of len bytes at off that got n bytes.
+ * When it continues the previous one, grow the window, and prefetch the window after it if not yet.
+ * The caller should hold cache_mutex. */
+void extent_client::readahead_p(extent_protocol::extentid_t eid, unsigned int off, unsigned int len, unsigned int n)
+{
+    ra_stream &s = ra_streams[eid];
+
+    if (off != s.next) { // Not sequential.
+        s.window = 0;
+        s.end = 0;
+    } else {
+        s.window = s.window ? std::min(s.window * 2, (unsigned int)RA_MAX_WINDOW) : RA_MIN_WINDOW;
+    }
+    s.next = off + n;
+
+    if (!s.window || n < len) // Not sequential, or at the end of the extent.
+        return;
+
+    unsigned int start = std::max(s.end, s.next);
+    if (start - s.next >= s.window / 2) // Enough is prefetched, prefetch more later in one go.
+        return;
+
+    s.end = s.next + s.window;
+    queue_prefetch_p(eid, false, start, s.end - start);
+}
+
+// The caller should hold cache_mutex.
+void extent_client::queue_prefetch_p(extent_protocol::extentid_t eid, bool dir, unsigned int off, unsigned int len)
+{
+    prefetch_job job;
+    job.eid = eid;
+    job.dir = dir;
+    job.off = off;
+    job.len = len;
+    job.gen = gen_p(eid);
+    ra_queue.push_back(job);
+    VERIFY(pthread_cond_signal(&ra_cond) == 0);
+}
+
+/* Prefetch the data of the queued jobs. The attributes of the extent are leased first,
+ * and the data read after that is valid until the lease expires, or the server recalls it, see recall(). */
+void* extent_client::prefetch_main(void *arg)
+{
+    extent_client *ec = (extent_client*)arg;
+    ScopedLock ml(&ec->cache_mutex);
+
+    while (true) {
+        while (!ec->ra_stop && ec->ra_queue.empty())
+            VERIFY(pthread_cond_wait(&ec->ra_cond, &ec->cache_mutex) == 0);
+        if (ec->ra_stop)
+            break;
+
+        prefetch_job job = ec->ra_queue.front();
+        ec->ra_queue.pop_front();
+        unsigned long long since = ec->ra_clock;
+
+        VERIFY(pthread_mutex_unlock(&ec->cache_mutex) == 0);
+
+        extent_protocol::leased_attr l;
+        std::string data;
+        std::vector<extent_protocol::dirent_plus> list;
+        unsigned long long now = lease_clock_ms();
+
+        extent_protocol::status ret = ec->cl->call(extent_protocol::getattr_lease, job.eid, ec->id, l);
+        if (ret == extent_protocol::OK && l.lease_ms) {
+            if (job.dir)
+                ret = ec->cl->call(extent_protocol::dir_list_plus, job.eid, ec->id, list);
+            else
+                ret = ec->cl->call(extent_protocol::read, job.eid, job.off, job.len, data);
+        }
+
+        VERIFY(pthread_mutex_lock(&ec->cache_mutex) == 0);
+
+        if (ret != extent_protocol::OK || !l.lease_ms || ec->gen_p(job.eid) != job.gen)
+            continue;
+
+        if (job.dir) {
+            ec->lease_entries_p(list, now, since);
+            ra_dir &d = ec->ra_dirs[job.eid];
+            d.list.swap(list);
+            d.expiry = now + l.lease_ms;
+            continue;
+        }
+
+        ra_segment &seg = ec->ra_segments[job.eid][job.off];
+        ec->ra_bytes += data.size() - seg.data.size();
+        seg.data.swap(data);
+        seg.eof = seg.data.size() < job.len;
+        seg.expiry = now + l.lease_ms;
+        ec->ra_prefetched_bytes += seg.data.size();
+        ec->ra_fifo.push_back(std::make_pair(job.eid, job.off));
+
+        // Drop the oldest segments beyond the limit.
+        while (ec->ra_bytes > RA_MAX_BYTES && !ec->ra_fifo.empty()) {
+            std::pair<extent_protocol::extentid_t, unsigned int> old = ec->ra_fifo.front();
+            ec->ra_fifo.pop_front();
+            std::map<extent_protocol::extentid_t, std::map<unsigned int, ra_segment> >::iterator it =
+                ec->ra_segments.find(old.first);
+            if (it == ec->ra_segments.end() || !it->second.count(old.second))
+                continue;
+            ec->ra_bytes -= it->second[old.second].data.size();
+            it->second.erase(old.second);
+            if (it->second.empty())
+                ec->ra_segments.erase(it);
+        }
+    }
+
+    return NULL;
+}
+
+/* Get the attributes of an extent from the cache of held extents or a valid lease. Return false if neither has them.
+ * The caller should hold cache_mutex. */
+bool extent_client::local_attr_p(extent_protocol::extentid_t eid, extent_protocol::attr &attr)
+{
+    cached_extent *e = cached_p(eid);
+    if (e) {
+        if (e->has_attr)
+            attr = e->a;
+        return e->has_attr;
+    }
+
+    std::map<extent_protocol::extentid_t, leased_attr>::iterator it = leases.find(eid);
+    if (it == leases.end() || lease_clock_ms() >= it->second.expiry)
+        return false;
+    attr = it->second.a;
+    return true;
+}
+
+/* Keep the leased attributes of directory entries listed by a request sent at start, when ra_clock was since.
+ * Entries held by this client may be newer here, and entries whose leases were recalled since may be outdated,
+ * their attributes are not kept. The caller should hold cache_mutex. */
+void extent_client::lease_entries_p(const std::vector<extent_protocol::dirent_plus> &list,
+        unsigned long long start, unsigned long long since)
+{
+    for (size_t i = 0; i < list.size(); ++i) {
+        const extent_protocol::dirent_plus &d = list[i];
+        if (!d.lease_ms || gen_p(d.inum) > since || cached_p(d.inum))
+            continue;
+        leases[d.inum].a = d.a;
+        leases[d.inum].expiry = start + d.lease_ms;
+    }
+}
+
+/* Called by the server before another change of eid, or of everything if eid is 0, is made.
+ * What is known from the leases is dropped, cached extents are held and stay. */
+rextent_protocol::status extent_client::recall(extent_protocol::extentid_t eid, int &)
+{
+    ScopedLock ml(&cache_mutex);
+    if (eid)
+        forget_leased_p(eid);
+    else
+        forget_all_leased_p();
+    leases_recalled++;
+    return rextent_protocol::OK;
+}
+
+void extent_client::doacquire(lock_protocol::lockid_t lid)
+{
+    ScopedLock ml(&cache_mutex);
+    held.insert(lid);
+}
+
+/* Write back the extent covered by the lock, and drop it, as other clients may change it once the lock is given back.
+ * Return IOERR if the cached content could not be written back, it then stays dirty and the lock is kept. */
+lock_protocol::status extent_client::dorelease(lock_protocol::lockid_t lid)
+{
+    bool dirty;
+
+    {
+        ScopedLock ml(&cache_mutex);
+        dirty = cache.count(lid) && (cache[lid].dirty || cache[lid].flushing);
+    }
+
+    if (sync(lid) != extent_protocol::OK)
+        return lock_protocol::IOERR;
+
+    ScopedLock ml(&cache_mutex);
+    if (dirty) // Written back, what else is known about it is outdated.
+        forget_p(lid);
+    else
+        uncache_p(lid);
+    held.erase(lid);
+    return lock_protocol::OK;
+}
+
+void extent_client::get_cache_stats(std::map<std::string, unsigned long long> &stats)
+{
+    ScopedLock ml(&cache_mutex);
+    stats["client_cache_hits"] = cache_hits;
+    stats["client_cache_misses"] = cache_misses;
+    stats["client_cache_writes"] = cache_writes;
+    stats["client_cache_flushes"] = cache_flushes;
+    stats["client_attr_hits"] = attr_hits;
+    stats["client_attr_misses"] = attr_misses;
+    stats["client_leases_recalled"] = leases_recalled;
+    stats["client_ra_hits"] = ra_hits;
+    stats["client_ra_misses"] = ra_misses;
+    stats["client_ra_prefetched_bytes"] = ra_prefetched_bytes;
+    stats["client_ra_bytes"] = ra_bytes;
+    stats["client_ra_dir_hits"] = ra_dir_hits;
+    stats["client_wb_limit_flushes"] = wb_limit_flushes;
+    stats["client_wb_dirty_bytes"] = wb_dirty;
+}
+
+// Get the attributes of an extent, from the cache of held extents or the leased attributes if possible.
 extent_protocol::status extent_client::getattr(extent_protocol::extentid_t eid, extent_protocol::attr &attr)
 {
     extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    unsigned long long now = lease_clock_ms();
+    unsigned long long gen;
+
+    {
+        ScopedLock ml(&cache_mutex);
+        gen = gen_p(eid);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_attr) {
+            attr = e->a;
+            cache_hits++;
+            attr_hits++;
+            return ret;
+        }
+        if (e)
+            cache_misses++;
+
+        // Held extents may be modified in the cache, their leased attributes are not used.
+        std::map<extent_protocol::extentid_t, leased_attr>::iterator it = leases.find(eid);
+        if (!e && it != leases.end()) {
+            if (now < it->second.expiry) {
+                attr = it->second.a;
+                attr_hits++;
+                return ret;
+            }
+            leases.erase(it);
+        }
+        attr_misses++;
+    }
+
+    // The lease starts before the request is sent, so it expires here no later than at the server.
+    extent_protocol::leased_attr l;
+    ret = cl->call(extent_protocol::getattr_lease, eid, id, l);
+    attr = l.a;
+
+    if (ret == extent_protocol::OK) {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        // Not if another thread has changed the extent since, its change may not be in the reply.
+        if (!e && l.lease_ms && gen_p(eid) == gen) {
+            leases[eid].a = attr;
+            leases[eid].expiry = now + l.lease_ms;
+        }
+        if (e && attr.type == extent_protocol::T_DIR) {
+            e->is_dir = true;
+        } else if (e && !e->has_attr && attr.type) { // Not if it is free, it may be created by others.
+            if (e->has_data) // Modified since, but not yet written back.
+                attr.size = e->data.size();
+            e->a = attr;
+            e->has_attr = true;
+        }
+    }
     return ret;
 }
 
+/* A lease is never renewed in place, a new one expires later. So the expiry identifies the lease,
+ * and something known while it lasts stays valid as long as the same expiry is returned. */
+unsigned long long extent_client::lease_expiry(extent_protocol::extentid_t eid)
+{
+    ScopedLock ml(&cache_mutex);
+
+    // Held extents may be modified in the cache, their leased attributes are not used.
+    if (cached_p(eid))
+        return 0;
+
+    std::map<extent_protocol::extentid_t, leased_attr>::iterator it = leases.find(eid);
+    if (it != leases.end() && lease_clock_ms() < it->second.expiry)
+        return it->second.expiry;
+    return 0;
+}
+
 extent_protocol::status extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
 {
     extent_protocol::status ret = extent_protocol::OK;
@@ -42,16 +582,115 @@ extent_protocol::status extent_client::get(extent_protocol::extentid_t eid, std:
 {
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab3 code goes here
-    ret = cl->call(extent_protocol::get, eid, buf);
+
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_data) {
+            buf = e->data;
+            cache_hits++;
+            return ret;
+        }
+        if (e)
+            cache_misses++;
+    }
+
+    ret = fetch(eid, buf);
+
+    if (ret == extent_protocol::OK) {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_attr && !e->has_data) {
+            e->data = buf;
+            e->has_data = true;
+        }
+    }
+    return ret;
+}
+
+/* Get the whole content of an extent from the server. It is streamed so that no request carries more than
+ * STREAM_CHUNK_SIZE bytes, and all chunks come from the version of the extent when the stream was opened. */
+extent_protocol::status extent_client::fetch(extent_protocol::extentid_t eid, std::string &buf)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+    std::string chunk;
+    uint32_t sid, seq = 0;
+    unsigned int size;
+
+    buf.clear();
+
+    if ((ret = cl->call(extent_protocol::stream_open, eid, (uint32_t)extent_protocol::STREAM_READ,
+                    0u, sid)) != extent_protocol::OK)
+        return ret;
+
+    // The server drops the stream after the last chunk.
+    do {
+        if ((ret = cl->call(extent_protocol::stream_read, sid, seq++, chunk)) != extent_protocol::OK) {
+            cl->call(extent_protocol::stream_close, sid, size);
+            break;
+        }
+        buf += chunk;
+    } while (chunk.size() == STREAM_CHUNK_SIZE);
+
     return ret;
 }
 
+/* Replace the whole content of an extent. It is written back later if the extent is known to exist and is cached,
+ * and stored at once otherwise. */
 extent_protocol::status extent_client::put(extent_protocol::extentid_t eid, std::string buf)
 {
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab3 code goes here
+
+    limit_dirty();
+
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && (e->has_attr || e->has_data)) {
+            if (buf.size() > MAXFILE * BLOCK_DATA_SIZE)
+                return extent_protocol::IOERR;
+            e->data = buf;
+            e->has_data = true;
+            modified_p(e);
+            return ret;
+        }
+    }
+
+    ret = store(eid, buf);
+    invalidate(eid);
+    return ret;
+}
+
+/* Replace the whole content of an extent at the server. Large contents are streamed in chunks,
+ * which the server encodes and writes as they arrive, and installs at once when the stream is closed. */
+extent_protocol::status extent_client::store(extent_protocol::extentid_t eid, const std::string &buf)
+{
+    extent_protocol::status ret = extent_protocol::OK;
     int unused;
-    ret = cl->call(extent_protocol::put, eid, buf, unused);
+    uint32_t sid, seq = 0;
+    unsigned int size;
+
+    if (buf.size() <= STREAM_CHUNK_SIZE) {
+        ret = cl->call(extent_protocol::put, eid, buf, unused);
+        return ret;
+    }
+
+    if ((ret = cl->call(extent_protocol::stream_open, eid, (uint32_t)extent_protocol::STREAM_WRITE,
+                    0u, sid)) != extent_protocol::OK)
+        return ret;
+
+    for (size_t off = 0; off < buf.size(); off += STREAM_CHUNK_SIZE) {
+        if ((ret = cl->call(extent_protocol::stream_write, sid, seq++, buf.substr(off, STREAM_CHUNK_SIZE),
+                        unused)) != extent_protocol::OK)
+            break;
+    }
+
+    // A failed stream is dropped, the extent keeps its old content.
+    if (ret == extent_protocol::OK)
+        ret = cl->call(extent_protocol::stream_close, sid, size);
+    else
+        cl->call(extent_protocol::stream_abort, sid, unused);
     return ret;
 }
 
@@ -60,15 +699,336 @@ extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid)
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab3 code goes here
     int unused;
+    invalidate(eid); // Modifications not written back are dropped with the extent.
     ret = cl->call(extent_protocol::remove, eid, unused);
     return ret;
 }
 
+extent_protocol::status extent_client::read(extent_protocol::extentid_t eid, unsigned int off, unsigned int len,
+        std::string &buf)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_data) {
+            buf = off < e->data.size() ? e->data.substr(off, len) : "";
+            cache_hits++;
+            return ret;
+        }
+
+        if (readahead_hit_p(eid, off, len, buf)) {
+            ra_hits++;
+            readahead_p(eid, off, len, buf.size());
+            return ret;
+        }
+        ra_misses++;
+    }
+
+    ret = cl->call(extent_protocol::read, eid, off, len, buf);
+
+    if (ret == extent_protocol::OK) {
+        ScopedLock ml(&cache_mutex);
+        readahead_p(eid, off, len, buf.size());
+    }
+    return ret;
+}
+
+extent_protocol::status extent_client::write(extent_protocol::extentid_t eid, unsigned int off, const std::string &buf)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    limit_dirty();
+    load(eid); // Changed in the cache if its lock is cached.
+
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_data) { // Holes are filled with '\0's, as at the server.
+            if (off + buf.size() > MAXFILE * BLOCK_DATA_SIZE) // It could not be written back.
+                return extent_protocol::IOERR;
+            if (e->data.size() < off + buf.size())
+                e->data.resize(off + buf.size());
+            e->data.replace(off, buf.size(), buf);
+            modified_p(e);
+            return ret;
+        }
+    }
+
+    int unused;
+    ret = cl->call(extent_protocol::write, eid, off, buf, unused);
+    invalidate(eid);
+    return ret;
+}
+
+extent_protocol::status extent_client::truncate(extent_protocol::extentid_t eid, unsigned int size)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    limit_dirty();
+    load(eid); // Changed in the cache if its lock is cached.
+
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_data) {
+            if (size > MAXFILE * BLOCK_DATA_SIZE)
+                return extent_protocol::IOERR;
+            e->data.resize(size);
+            modified_p(e);
+            return ret;
+        }
+    }
+
+    int unused;
+    ret = cl->call(extent_protocol::truncate, eid, size, unused);
+    invalidate(eid);
+    return ret;
+}
+
+extent_protocol::status extent_client::append(extent_protocol::extentid_t eid, const std::string &buf,
+        unsigned int &size)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    limit_dirty();
+    load(eid); // Changed in the cache if its lock is cached.
+
+    {
+        ScopedLock ml(&cache_mutex);
+        cached_extent *e = cached_p(eid);
+        if (e && e->has_data) {
+            if (e->data.size() + buf.size() > MAXFILE * BLOCK_DATA_SIZE)
+                return extent_protocol::IOERR;
+            e->data += buf;
+            size = e->data.size();
+            modified_p(e);
+            return ret;
+        }
+    }
+
+    ret = cl->call(extent_protocol::append, eid, buf, size);
+    invalidate(eid);
+    return ret;
+}
+
+// Send a sequence of ops in one round trip. Each op has its own status in results.
+extent_protocol::status extent_client::compound(const std::vector<extent_protocol::op> &ops,
+        std::vector<extent_protocol::op_result> &results)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    for (size_t i = 0; i < ops.size(); ++i)
+        if (ops[i].eid)
+            flush(ops[i].eid);
+
+    results.clear();
+    ret = cl->call(extent_protocol::compound, ops, results);
+
+    for (size_t i = 0; i < ops.size(); ++i)
+        invalidate(ops[i].eid);
+    for (size_t i = 0; i < results.size(); ++i)
+        invalidate(results[i].eid);
+
+    if (ret == extent_protocol::OK && results.size() != ops.size())
+        ret = extent_protocol::RPCERR;
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_lookup(extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &inum)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    flush(dir);
+    ret = cl->call(extent_protocol::dir_lookup, dir, name, inum);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_lookup_lease(extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &inum, unsigned long long &expiry)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+    extent_protocol::dirent_plus d;
+    unsigned long long gen;
+
+    expiry = 0;
+    flush(dir);
+
+    {
+        ScopedLock ml(&cache_mutex);
+        gen = gen_p(dir);
+    }
+
+    // The lease starts before the request is sent, so it expires here no later than at the server.
+    unsigned long long now = lease_clock_ms();
+    ret = cl->call(extent_protocol::dir_lookup_lease, dir, name, id, d);
+    inum = d.inum;
+
+    if (d.lease_ms) {
+        ScopedLock ml(&cache_mutex);
+        // As in getattr(), not if the directory is held or has been changed by another thread since.
+        if (!cached_p(dir) && gen_p(dir) == gen) {
+            leases[dir].a = d.a;
+            leases[dir].expiry = expiry = now + d.lease_ms;
+        }
+    }
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_add_entry(extent_protocol::extentid_t dir, const std::string &name,
+        uint32_t type, extent_protocol::extentid_t &inum)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    flush(dir);
+    ret = cl->call(extent_protocol::dir_add_entry, dir, name, type, inum);
+    invalidate(dir);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_remove_entry(extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &inum)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    flush(dir);
+    ret = cl->call(extent_protocol::dir_remove_entry, dir, name, inum);
+    invalidate(dir);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_list(extent_protocol::extentid_t dir,
+        std::vector<extent_protocol::dirent> &list)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    list.clear();
+
+    {
+        ScopedLock ml(&cache_mutex);
+        std::map<extent_protocol::extentid_t, ra_dir>::iterator it = ra_dirs.find(dir);
+        if (it != ra_dirs.end() && lease_clock_ms() < it->second.expiry) {
+            extent_protocol::dirent de;
+            for (size_t i = 0; i < it->second.list.size(); ++i) {
+                de.name = it->second.list[i].name;
+                de.inum = it->second.list[i].inum;
+                list.push_back(de);
+            }
+            ra_dir_hits++;
+            return ret;
+        }
+    }
+
+    flush(dir);
+    ret = cl->call(extent_protocol::dir_list, dir, list);
+    return ret;
+}
+
+extent_protocol::status extent_client::dir_list_plus(extent_protocol::extentid_t dir,
+        std::vector<extent_protocol::dirent_plus> &list)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    list.clear();
+
+    {
+        ScopedLock ml(&cache_mutex);
+        std::map<extent_protocol::extentid_t, ra_dir>::iterator it = ra_dirs.find(dir);
+        if (it != ra_dirs.end() && lease_clock_ms() < it->second.expiry) {
+            // The prefetched attributes are only used while they are still leased, or held.
+            list = it->second.list;
+            size_t i;
+            for (i = 0; i < list.size() && local_attr_p(list[i].inum, list[i].a); ++i)
+                ;
+            if (i == list.size()) {
+                ra_dir_hits++;
+                return ret;
+            }
+            list.clear();
+        }
+    }
+
+    flush(dir);
+
+    // The leases start before the request is sent, so they expire here no later than at the server.
+    unsigned long long now = lease_clock_ms();
+    unsigned long long since;
+    {
+        ScopedLock ml(&cache_mutex);
+        since = ra_clock;
+    }
+    ret = cl->call(extent_protocol::dir_list_plus, dir, id, list);
+    if (ret != extent_protocol::OK)
+        return ret;
+
+    std::vector<size_t> newer;
+    {
+        ScopedLock ml(&cache_mutex);
+        lease_entries_p(list, now, since);
+        for (size_t i = 0; i < list.size(); ++i)
+            if (cached_p(list[i].inum))
+                newer.push_back(i);
+    }
+
+    // Entries changed by this client and not yet written back.
+    for (size_t i = 0; i < newer.size() && ret == extent_protocol::OK; ++i)
+        ret = getattr(list[newer[i]].inum, list[newer[i]].a);
+    return ret;
+}
+
+// Prefetch the entries of a directory about to be listed.
+void extent_client::prefetch_dir(extent_protocol::extentid_t dir)
+{
+    ScopedLock ml(&cache_mutex);
+    queue_prefetch_p(dir, true, 0, 0);
+}
+
+extent_protocol::status extent_client::clone(extent_protocol::extentid_t eid, extent_protocol::extentid_t &newid)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    flush(eid);
+    ret = cl->call(extent_protocol::clone, eid, newid);
+    return ret;
+}
+
+extent_protocol::status extent_client::copy_range(extent_protocol::extentid_t src, unsigned int src_off,
+        extent_protocol::extentid_t dst, unsigned int dst_off, unsigned int len, unsigned int &copied)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    flush(src);
+    flush(dst);
+    ret = cl->call(extent_protocol::copy_range, src, src_off, dst, dst_off, len, copied);
+    invalidate(dst);
+    return ret;
+}
+
+extent_protocol::status extent_client::stats(std::map<std::string, unsigned long long> &stats)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    ret = cl->call(extent_protocol::stats, 0, stats);
+    return ret;
+}
+
+extent_protocol::status extent_client::replace_disk(int disk)
+{
+    extent_protocol::status ret = extent_protocol::OK;
+
+    int unused;
+    ret = cl->call(extent_protocol::replace_disk, disk, unused);
+    return ret;
+}
+
 extent_protocol::status extent_client::commit()
 {
     extent_protocol::status ret = extent_protocol::OK;
 
     int unused;
+    flush_all();
     ret = cl->call(extent_protocol::commit, 0, unused);
     return ret;
 }
@@ -78,7 +1038,9 @@ extent_protocol::status extent_client::undo()
     extent_protocol::status ret = extent_protocol::OK;
 
     int unused;
+    flush_all();
     ret = cl->call(extent_protocol::undo, 0, unused);
+    invalidate_all();
     return ret;
 }
 
@@ -87,6 +1049,8 @@ extent_protocol::status extent_client::redo()
     extent_protocol::status ret = extent_protocol::OK;
 
     int unused;
+    flush_all();
     ret = cl->call(extent_protocol::redo, 0, unused);
+    invalidate_all();
     return ret;
 }
@@ -4,12 +4,127 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "extent_server.h"
+#include "lock_client.h"
 
-class extent_client {
+/* Files and symlinks whose locks are cached by this client, see lock_client, are cached too, and written back
+ * when their locks are given back to the lock server, or synced. No other client can change an extent while
+ * this client has its lock, so the cache stays coherent. Directories are changed at the extent server by
+ * directory operations without their locks, and are never cached. Writes to a cached content are applied
+ * to the cache only. A content that cannot be written back stays dirty, and its lock is kept until it is.
+ * Operations the cache cannot serve write back the cache first, and drop the extents they change.
+ *
+ * Attributes of other extents are cached while the server leases them, see extent_server::getattr_lease().
+ * The server recalls the leases on an extent before it is changed, see recall(), so no change waits for them.
+ *
+ * Writes the cache cannot take are sent to the server at once. A writer finding more than WB_MAX_DIRTY bytes
+ * dirty in the cache writes them all back first.
+ *
+ * Reads continuing the previous read of an extent grow its readahead window, from RA_MIN_WINDOW up to
+ * RA_MAX_WINDOW bytes, and the window after the read is prefetched in the background. Directories are
+ * prefetched when opened, with the attributes of their entries. Prefetched data is only used while the attributes of its extent are leased,
+ * so it is never outdated. At most RA_MAX_BYTES of prefetched data are kept.
+ */
+#define WB_MAX_DIRTY (4 << 20)
+#define RA_MIN_WINDOW (16 << 10)
+#define RA_MAX_WINDOW (256 << 10)
+#define RA_MAX_BYTES (4 << 20)
+
+class extent_client : public lock_release_user {
 private:
     rpcc *cl;
+    rpcs *rsrpc; // Called back by the server.
+    std::string id; // The address of rsrpc, identifies this client to the server.
+
+    struct cached_extent {
+        bool has_attr, has_data, dirty;
+        bool flushing; // Being written back.
+        bool is_dir; // Never cached, see above.
+        extent_protocol::attr a;
+        std::string data;
+        size_t dirty_bytes; // Counted in wb_dirty.
+
+        cached_extent(): has_attr(false), has_data(false), dirty(false), flushing(false), is_dir(false),
+            dirty_bytes(0) {}
+    };
+    pthread_mutex_t cache_mutex;
+    pthread_cond_t flush_cond; // A write-back is done.
+    std::set<extent_protocol::extentid_t> held; // Extents whose locks are cached.
+    std::map<extent_protocol::extentid_t, cached_extent> cache;
+    unsigned long long cache_hits, cache_misses, cache_writes, cache_flushes;
+    size_t wb_dirty; // Dirty bytes in the cache.
+    unsigned long long wb_limit_flushes;
+
+    struct leased_attr {
+        extent_protocol::attr a;
+        unsigned long long expiry; // In lease_clock_ms().
+    };
+    std::map<extent_protocol::extentid_t, leased_attr> leases;
+    unsigned long long attr_hits, attr_misses, leases_recalled;
+    cached_extent *cached_p(extent_protocol::extentid_t eid);
+    bool load(extent_protocol::extentid_t eid);
+    void modified_p(cached_extent *e);
+    void count_dirty_p(cached_extent *e);
+    void limit_dirty();
+    extent_protocol::status flush(extent_protocol::extentid_t eid);
+    void flush_all();
+    void forget_p(extent_protocol::extentid_t eid);
+    void uncache_p(extent_protocol::extentid_t eid);
+    void forget_leased_p(extent_protocol::extentid_t eid);
+    void forget_all_leased_p();
+    void invalidate(extent_protocol::extentid_t eid);
+    void invalidate_all();
+
+    extent_protocol::status fetch(extent_protocol::extentid_t eid, std::string &buf);
+    extent_protocol::status store(extent_protocol::extentid_t eid, const std::string &buf);
+
+    struct ra_stream {
+        unsigned int next; // Where a sequential read continues.
+        unsigned int window;
+        unsigned int end; // Where the prefetched data ends.
+    };
+    struct ra_segment {
+        std::string data;
+        bool eof; // The data ends at the end of the extent.
+        unsigned long long expiry; // In lease_clock_ms().
+    };
+    struct ra_dir {
+        std::vector<extent_protocol::dirent_plus> list;
+        unsigned long long expiry;
+    };
+    struct prefetch_job {
+        extent_protocol::extentid_t eid;
+        bool dir;
+        unsigned int off, len;
+        unsigned long long gen; // The generation of the extent when the job was queued.
+    };
+    pthread_cond_t ra_cond;
+    pthread_t ra_thread;
+    bool ra_stop;
+    std::deque<prefetch_job> ra_queue;
+    std::map<extent_protocol::extentid_t, ra_stream> ra_streams;
+    std::map<extent_protocol::extentid_t, std::map<unsigned int, ra_segment> > ra_segments;
+    std::deque<std::pair<extent_protocol::extentid_t, unsigned int> > ra_fifo; // Segments in the order they came.
+    std::map<extent_protocol::extentid_t, ra_dir> ra_dirs;
+    unsigned long long ra_clock; // Counts forgets, generations below are taken from it.
+    std::map<extent_protocol::extentid_t, unsigned long long> ra_gens; // Changed whenever an extent is forgotten.
+    unsigned long long ra_epoch; // Changed when everything is forgotten.
+    size_t ra_bytes;
+    unsigned long long ra_hits, ra_misses, ra_prefetched_bytes, ra_dir_hits;
+    unsigned long long gen_p(extent_protocol::extentid_t eid);
+    bool readahead_hit_p(extent_protocol::extentid_t eid, unsigned int off, unsigned int len, std::string &buf);
+    void readahead_p(extent_protocol::extentid_t eid, unsigned int off, unsigned int len, unsigned int n);
+    void queue_prefetch_p(extent_protocol::extentid_t eid, bool dir, unsigned int off, unsigned int len);
+    bool local_attr_p(extent_protocol::extentid_t eid, extent_protocol::attr &attr);
+    void lease_entries_p(const std::vector<extent_protocol::dirent_plus> &list, unsigned long long start,
+            unsigned long long since);
+    static void *prefetch_main(void *arg);
 
 public:
     extent_client(std::string dst);
@@ -20,9 +135,48 @@ public:
     extent_protocol::status getattr(extent_protocol::extentid_t eid, extent_protocol::attr &a);
     extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
+    extent_protocol::status read(extent_protocol::extentid_t eid, unsigned int off, unsigned int len, std::string &buf);
+    extent_protocol::status write(extent_protocol::extentid_t eid, unsigned int off, const std::string &buf);
+    extent_protocol::status truncate(extent_protocol::extentid_t eid, unsigned int size);
+    extent_protocol::status append(extent_protocol::extentid_t eid, const std::string &buf, unsigned int &size);
+    extent_protocol::status compound(const std::vector<extent_protocol::op> &ops,
+            std::vector<extent_protocol::op_result> &results);
+    extent_protocol::status dir_lookup(extent_protocol::extentid_t dir, const std::string &name,
+            extent_protocol::extentid_t &inum);
+    // Look up name in dir and lease the attributes of dir, see lease_expiry(). expiry is 0 if not leased.
+    extent_protocol::status dir_lookup_lease(extent_protocol::extentid_t dir, const std::string &name,
+            extent_protocol::extentid_t &inum, unsigned long long &expiry);
+    extent_protocol::status dir_add_entry(extent_protocol::extentid_t dir, const std::string &name, uint32_t type,
+            extent_protocol::extentid_t &inum);
+    extent_protocol::status dir_remove_entry(extent_protocol::extentid_t dir, const std::string &name,
+            extent_protocol::extentid_t &inum);
+    extent_protocol::status dir_list(extent_protocol::extentid_t dir, std::vector<extent_protocol::dirent> &list);
+    // List a directory with the attributes of its entries, which are leased for later getattr calls.
+    extent_protocol::status dir_list_plus(extent_protocol::extentid_t dir,
+            std::vector<extent_protocol::dirent_plus> &list);
+    void prefetch_dir(extent_protocol::extentid_t dir);
+    extent_protocol::status clone(extent_protocol::extentid_t eid, extent_protocol::extentid_t &newid);
+    extent_protocol::status copy_range(extent_protocol::extentid_t src, unsigned int src_off,
+            extent_protocol::extentid_t dst, unsigned int dst_off, unsigned int len, unsigned int &copied);
+    extent_protocol::status stats(std::map<std::string, unsigned long long> &stats);
+    extent_protocol::status replace_disk(int disk);
     extent_protocol::status commit();
     extent_protocol::status undo();
     extent_protocol::status redo();
+
+    // When the lease on the attributes of eid expires, in lease_clock_ms(), or 0 if they are not leased.
+    unsigned long long lease_expiry(extent_protocol::extentid_t eid);
+
+    // Write back an extent, and return the error if it cannot be.
+    extent_protocol::status sync(extent_protocol::extentid_t eid);
+
+    // Counters of the cache.
+    void get_cache_stats(std::map<std::string, unsigned long long> &stats);
+
+    rextent_protocol::status recall(extent_protocol::extentid_t eid, int &);
+
+    void doacquire(lock_protocol::lockid_t lid);
+    lock_protocol::status dorelease(lock_protocol::lockid_t lid);
 };
 
 #endif
@@ -4,12 +4,24 @@
 #define extent_protocol_h
 
 #include "rpc.h"
+#include <time.h>
+
+#define STREAM_CHUNK_SIZE 8192 // Maximum data bytes transferred by a stream_read or stream_write.
+#define ATTR_LEASE_MS 100 // Time for which attributes are leased to clients, see extent_server::getattr_lease().
+
+// Milliseconds of a monotonic clock, used to time leases.
+inline unsigned long long lease_clock_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
 
 class extent_protocol {
 public:
     typedef int status;
     typedef unsigned long long extentid_t;
-    enum xxstatus { OK, RPCERR, NOENT, IOERR };
+    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
     enum rpc_numbers {
         put = 0x6001,
         get,
@@ -18,7 +30,28 @@ public:
         create,
         commit,
         undo,
-        redo
+        redo,
+        read,
+        write,
+        truncate,
+        append,
+        compound,
+        dir_lookup,
+        dir_add_entry,
+        dir_remove_entry,
+        dir_list,
+        stats,
+        stream_open,
+        stream_read,
+        stream_write,
+        stream_close,
+        clone,
+        copy_range,
+        replace_disk,
+        getattr_lease,
+        dir_list_plus,
+        stream_abort,
+        dir_lookup_lease
     };
 
     enum types {
@@ -27,6 +60,11 @@ public:
         T_SYMLINK
     };
 
+    enum stream_modes {
+        STREAM_READ = 1,
+        STREAM_WRITE
+    };
+
     struct attr {
         uint32_t type;
         unsigned int atime;
@@ -34,6 +72,67 @@ public:
         unsigned int ctime;
         unsigned int size;
     };
+
+    // Attributes leased for lease_ms milliseconds from when they were requested, none if 0.
+    struct leased_attr {
+        attr a;
+        unsigned int lease_ms;
+    };
+
+    // Flags of an op in a compound request.
+    enum op_flags {
+        OP_CHAIN = 1 // Skip the op if the previous one failed. An eid of 0 means the extent of the previous op.
+    };
+
+    // An op in a compound request, tagged by the rpc number of the operation (create, put, get,
+    // getattr, remove, dir_lookup, dir_add_entry or dir_remove_entry). Only the fields used by the op are transferred.
+    struct op {
+        uint32_t opcode;
+        uint32_t flags;
+        extentid_t eid; // The directory for dir_* ops.
+        uint32_t type; // create, dir_add_entry
+        std::string buf; // put, the initial content for dir_add_entry
+        std::string name; // dir_*
+
+        op(): opcode(0), flags(0), eid(0), type(0) {}
+        op(uint32_t c, extentid_t e, uint32_t f = 0): opcode(c), flags(f), eid(e), type(0) {}
+    };
+
+    // Result of an op in a compound request.
+    struct op_result {
+        status ret;
+        extentid_t eid; // The extent the op worked on, the new one for create, or the entry's one for dir_* ops.
+        attr a; // Attributes before the op, except for create.
+        std::string buf; // get
+
+        op_result(): ret(OK), eid(0) {
+            memset(&a, 0, sizeof(a));
+        }
+    };
+
+    // A directory entry.
+    struct dirent {
+        std::string name;
+        extentid_t inum;
+    };
+
+    // A directory entry with the attributes of its extent, leased as leased_attr.
+    struct dirent_plus {
+        std::string name;
+        extentid_t inum;
+        attr a;
+        unsigned int lease_ms;
+    };
+};
+
+// Calls from the extent server back to its clients.
+class rextent_protocol {
+public:
+    enum xxstatus { OK, RPCERR };
+    typedef int status;
+    enum rpc_numbers {
+        recall = 0x9001 // Stop using the leased attributes of an extent, of all extents if it is 0.
+    };
 };
 
 inline unmarshall & operator >> (unmarshall &u, extent_protocol::attr &a)
@@ -56,4 +155,98 @@ inline marshall & operator << (marshall &m, extent_protocol::attr a)
     return m;
 }
 
+inline unmarshall & operator >> (unmarshall &u, extent_protocol::leased_attr &l)
+{
+    u >> l.a;
+    u >> l.lease_ms;
+    return u;
+}
+
+inline marshall & operator << (marshall &m, const extent_protocol::leased_attr &l)
+{
+    m << l.a;
+    m << l.lease_ms;
+    return m;
+}
+
+inline unmarshall & operator >> (unmarshall &u, extent_protocol::op &o)
+{
+    u >> o.opcode;
+    u >> o.flags;
+    u >> o.eid;
+    if (o.opcode == extent_protocol::create || o.opcode == extent_protocol::dir_add_entry)
+        u >> o.type;
+    if (o.opcode == extent_protocol::put || o.opcode == extent_protocol::dir_add_entry)
+        u >> o.buf;
+    if (o.opcode == extent_protocol::dir_lookup || o.opcode == extent_protocol::dir_add_entry
+            || o.opcode == extent_protocol::dir_remove_entry)
+        u >> o.name;
+    return u;
+}
+
+inline marshall & operator << (marshall &m, const extent_protocol::op &o)
+{
+    m << o.opcode;
+    m << o.flags;
+    m << o.eid;
+    if (o.opcode == extent_protocol::create || o.opcode == extent_protocol::dir_add_entry)
+        m << o.type;
+    if (o.opcode == extent_protocol::put || o.opcode == extent_protocol::dir_add_entry)
+        m << o.buf;
+    if (o.opcode == extent_protocol::dir_lookup || o.opcode == extent_protocol::dir_add_entry
+            || o.opcode == extent_protocol::dir_remove_entry)
+        m << o.name;
+    return m;
+}
+
+inline unmarshall & operator >> (unmarshall &u, extent_protocol::op_result &r)
+{
+    u >> r.ret;
+    u >> r.eid;
+    u >> r.a;
+    u >> r.buf;
+    return u;
+}
+
+inline marshall & operator << (marshall &m, const extent_protocol::op_result &r)
+{
+    m << r.ret;
+    m << r.eid;
+    m << r.a;
+    m << r.buf;
+    return m;
+}
+
+inline unmarshall & operator >> (unmarshall &u, extent_protocol::dirent &d)
+{
+    u >> d.name;
+    u >> d.inum;
+    return u;
+}
+
+inline marshall & operator << (marshall &m, const extent_protocol::dirent &d)
+{
+    m << d.name;
+    m << d.inum;
+    return m;
+}
+
+inline unmarshall & operator >> (unmarshall &u, extent_protocol::dirent_plus &d)
+{
+    u >> d.name;
+    u >> d.inum;
+    u >> d.a;
+    u >> d.lease_ms;
+    return u;
+}
+
+inline marshall & operator << (marshall &m, const extent_protocol::dirent_plus &d)
+{
+    m << d.name;
+    m << d.inum;
+    m << d.a;
+    m << d.lease_ms;
+    return m;
+}
+
 #endif
@@ -1,6 +1,8 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "slock.h"
+#include "handle.h"
 #include <sstream>
 #include <fstream>
 #include <stdio.h>
@@ -99,6 +101,19 @@ extent_server::extent_server()
     Sem_init(&wmutex, 0, 1);
     Sem_init(&readtry, 0, 1);
     Sem_init(&resource, 0, 1);
+    for (int i = 0; i < DIR_LOCKS; ++i)
+        VERIFY(pthread_mutex_init(&dir_locks[i], NULL) == 0);
+    VERIFY(pthread_mutex_init(&version_mutex, NULL) == 0);
+    version_counter = 0;
+    VERIFY(pthread_mutex_init(&flight_mutex, NULL) == 0);
+    get_requests = get_coalesced = getattr_requests = getattr_coalesced = 0;
+    VERIFY(pthread_mutex_init(&stat_mutex, NULL) == 0);
+    read_requests = read_bytes = read_bytes_copied = content_refreshes = 0;
+    VERIFY(pthread_mutex_init(&stream_mutex, NULL) == 0);
+    next_sid = 1;
+    VERIFY(pthread_mutex_init(&lease_mutex, NULL) == 0);
+    all_modified = 0;
+    leases_granted = leases_recalled = lease_waits = lease_wait_ms = 0;
 
     // Make sure the version control log file is present and valid.
     std::fstream fc(vc_logfile, std::ios_base::app);
@@ -131,21 +146,319 @@ extent_server::~extent_server()
     Sem_destroy(&wmutex);
     Sem_destroy(&readtry);
     Sem_destroy(&resource);
+    for (int i = 0; i < DIR_LOCKS; ++i)
+        VERIFY(pthread_mutex_destroy(&dir_locks[i]) == 0);
+    VERIFY(pthread_mutex_destroy(&version_mutex) == 0);
+    VERIFY(pthread_mutex_destroy(&flight_mutex) == 0);
+    VERIFY(pthread_mutex_destroy(&stat_mutex) == 0);
+    VERIFY(pthread_mutex_destroy(&stream_mutex) == 0);
+    VERIFY(pthread_mutex_destroy(&lease_mutex) == 0);
 
     delete im;
 }
 
+// Get the current version of an extent. Extents not modified since the disk was loaded are at version 0.
+unsigned long long extent_server::version_p(extent_protocol::extentid_t id)
+{
+    ScopedLock ml(&version_mutex);
+
+    std::map<extent_protocol::extentid_t, unsigned long long>::iterator it = versions.find(id);
+    return it == versions.end() ? 0 : it->second;
+}
+
+/* The leases taken back from clients by the request of this thread, which recalls them in recall_leases()
+ * after it has left the reader or writer section. */
+static __thread std::vector<revoked_lease> *revoked = NULL;
+
+static std::vector<revoked_lease> &revoked_p()
+{
+    if (!revoked)
+        revoked = new std::vector<revoked_lease>;
+    return *revoked;
+}
+
+/* Give an extent a new version after it has been modified on disk, and drop its cached content.
+ * The request has to call recall_leases() before it returns. */
+unsigned long long extent_server::modified_p(extent_protocol::extentid_t id)
+{
+    unsigned long long v;
+
+    {
+        ScopedLock ml(&version_mutex);
+        v = versions[id] = ++version_counter;
+    }
+
+    cache.erase(id);
+    lease_modified_p(id);
+    return v;
+}
+
+// Record a modification of an extent, and take back the leases granted on it before.
+void extent_server::lease_modified_p(extent_protocol::extentid_t id)
+{
+    unsigned long long now = lease_clock_ms();
+
+    ScopedLock ml(&lease_mutex);
+    last_modified[id] = now;
+    std::map<extent_protocol::extentid_t, std::map<std::string, unsigned long long> >::iterator it =
+        lease_expiry.find(id);
+    if (it == lease_expiry.end())
+        return;
+    for (std::map<std::string, unsigned long long>::iterator c = it->second.begin(); c != it->second.end(); ++c)
+        if (c->second > now)
+            revoked_p().push_back(revoked_lease(id, c->first, c->second));
+    lease_expiry.erase(it);
+}
+
+// Record a modification of all extents, and take back all leases, with one recall for every client.
+void extent_server::all_leases_modified_p()
+{
+    unsigned long long now = lease_clock_ms();
+    std::map<std::string, unsigned long long> clients;
+
+    ScopedLock ml(&lease_mutex);
+    all_modified = now;
+    for (std::map<extent_protocol::extentid_t, std::map<std::string, unsigned long long> >::iterator it =
+            lease_expiry.begin(); it != lease_expiry.end(); ++it)
+        for (std::map<std::string, unsigned long long>::iterator c = it->second.begin(); c != it->second.end(); ++c)
+            if (c->second > now && clients[c->first] < c->second)
+                clients[c->first] = c->second;
+    for (std::map<std::string, unsigned long long>::iterator c = clients.begin(); c != clients.end(); ++c)
+        revoked_p().push_back(revoked_lease(0, c->first, c->second));
+    lease_expiry.clear();
+    last_modified.clear();
+}
+
+/* Recall the leases taken back by the request of this thread from their clients, so no client uses outdated
+ * attributes once it returns. A client that does not answer is waited for until its lease expires.
+ * Called holding no lock, other requests go on meanwhile. */
+void extent_server::recall_leases()
+{
+    if (!revoked || revoked->empty())
+        return;
+
+    std::vector<revoked_lease> leases;
+    leases.swap(*revoked);
+
+    unsigned long long deadline = 0, recalled = 0;
+    for (size_t i = 0; i < leases.size(); ++i) {
+        unsigned long long now = lease_clock_ms();
+        if (leases[i].expiry <= now)
+            continue;
+
+        int unused;
+        handle h(leases[i].client);
+        rpcc *cl = h.safebind();
+        if (cl && cl->call(rextent_protocol::recall, leases[i].eid, unused,
+                    rpcc::to(leases[i].expiry - now)) == rextent_protocol::OK) {
+            recalled++;
+            continue;
+        }
+        printf("extent_server: recall of %llu from %s failed\n", leases[i].eid, leases[i].client.c_str());
+        if (cl)
+            h.failed();
+        if (deadline < leases[i].expiry)
+            deadline = leases[i].expiry;
+    }
+
+    unsigned long long now = lease_clock_ms();
+    {
+        ScopedLock ml(&lease_mutex);
+        leases_recalled += recalled;
+        if (deadline > now) {
+            lease_waits++;
+            lease_wait_ms += deadline - now;
+        }
+    }
+    if (deadline > now)
+        usleep((deadline - now) * 1000);
+}
+
+/* Get the cached content of version v of an extent, if it is at most max_size bytes.
+ * Add the bytes copied to copied. */
+bool extent_server::cached_content_p(extent_protocol::extentid_t id, unsigned long long v, size_t max_size,
+        std::string &buf, unsigned long long &copied)
+{
+    unsigned long long checked;
+
+    if (!cache.lookup(id, v, buf, max_size, &checked))
+        return false;
+
+    /* Errors have been found on disk since the content was read, so the blocks of the extent may have some too.
+     * The cached content is correct, write it back to fix them as read_file does. */
+    unsigned long long corrected = im->corrected_count();
+    if (checked != corrected) {
+        im->refresh_file(id, buf);
+        cache.checked(id, v, corrected);
+        ScopedLock ml(&stat_mutex);
+        content_refreshes++;
+    }
+    copied += buf.size();
+    return true;
+}
+
+/* Read the whole content of an extent, from the cache if possible. Add the bytes copied to copied.
+ * The version is taken before reading the disk, so a concurrent modification makes the cached content outdated.
+ */
+void extent_server::read_content_p(extent_protocol::extentid_t id, std::string &buf, unsigned long long &copied)
+{
+    unsigned long long v = version_p(id), corrected = im->corrected_count();
+
+    if (cached_content_p(id, v, (size_t)-1, buf, copied))
+        return;
+
+    im->read_file(id, buf);
+    cache.insert(id, v, buf, corrected);
+    copied += buf.size();
+}
+
+// Record a read request returning bytes, of which copied bytes were copied in memory.
+void extent_server::count_read(unsigned long long bytes, unsigned long long copied)
+{
+    ScopedLock ml(&stat_mutex);
+
+    read_requests++;
+    read_bytes += bytes;
+    read_bytes_copied += copied;
+}
+
+// The key of a request of opcode on the current version of id.
+extent_server::flight_key extent_server::flight_key_of(uint32_t opcode, extent_protocol::extentid_t id)
+{
+    return flight_key(opcode, std::make_pair(id, version_p(id)));
+}
+
+/* Join the in-flight request of key and wait for its result, or become the leader.
+ * Return true if joined, in which case the result is in f and the caller should call flight_leave(f).
+ * Otherwise the caller should execute the request, store the result in f and call flight_finish().
+ */
+bool extent_server::flight_join(const flight_key &key, flight *&f)
+{
+    ScopedLock ml(&flight_mutex);
+
+    if (key.first == extent_protocol::get)
+        get_requests++;
+    else
+        getattr_requests++;
+
+    std::map<flight_key, flight*>::iterator it = flights.find(key);
+    if (it != flights.end()) {
+        if (key.first == extent_protocol::get)
+            get_coalesced++;
+        else
+            getattr_coalesced++;
+
+        f = it->second;
+        f->refs++;
+        while (!f->done)
+            VERIFY(pthread_cond_wait(&f->cond, &flight_mutex) == 0);
+        return true;
+    }
+
+    f = new flight;
+    VERIFY(pthread_cond_init(&f->cond, NULL) == 0);
+    f->done = false;
+    f->refs = 1;
+    flights[key] = f;
+    return false;
+}
+
+// Publish the result of a leader to the waiting requests.
+void extent_server::flight_finish(flight *f, const flight_key &key)
+{
+    {
+        ScopedLock ml(&flight_mutex);
+        flights.erase(key);
+        f->done = true;
+        VERIFY(pthread_cond_broadcast(&f->cond) == 0);
+    }
+
+    flight_leave(f);
+}
+
+// Drop a reference to a finished flight.
+void extent_server::flight_leave(flight *f)
+{
+    bool last;
+
+    {
+        ScopedLock ml(&flight_mutex);
+        last = --f->refs == 0;
+    }
+
+    if (last) {
+        VERIFY(pthread_cond_destroy(&f->cond) == 0);
+        delete f;
+    }
+}
+
+/* Following are the inode operations without concurrency control.
+ * Callers should have entered the reader section, so that these can be combined in a compound request.
+ */
+
+int extent_server::create_p(uint32_t type, extent_protocol::extentid_t &id)
+{
+    if (!(id = im->alloc_inode(type)))
+        return extent_protocol::IOERR; // No inode left.
+    modified_p(id);
+    im->uncommitted = true; // New inode created, mark file system as uncommitted.
+    return extent_protocol::OK;
+}
+
+void extent_server::put_p(extent_protocol::extentid_t id, const std::string &buf)
+{
+    const char *cbuf = buf.c_str();
+    int size = buf.size();
+    im->write_file(id, cbuf, size);
+    modified_p(id);
+    im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+}
+
+void extent_server::get_p(extent_protocol::extentid_t id, std::string &buf, unsigned long long &copied)
+{
+    read_content_p(id, buf, copied);
+}
+
+void extent_server::getattr_p(extent_protocol::extentid_t id, extent_protocol::attr &a)
+{
+    extent_protocol::attr attr;
+    memset(&attr, 0, sizeof(attr));
+    im->getattr(id, attr);
+    a = attr;
+}
+
+void extent_server::remove_p(extent_protocol::extentid_t id)
+{
+    im->remove_file(id);
+    modified_p(id);
+    im->uncommitted = true; // An inode removed, mark file system as uncommitted.
+
+    /* Forget the version of the removed extent, so the map only holds live extents. Its read streams
+     * are failed first, since a number created again starts from version 0. */
+    {
+        ScopedLock ml(&stream_mutex);
+        for (std::map<uint32_t, stream>::iterator it = streams.begin(); it != streams.end(); ++it)
+            if (it->second.eid == id && it->second.mode == extent_protocol::STREAM_READ)
+                it->second.version = (unsigned long long)-1;
+    }
+    ScopedLock ml(&version_mutex);
+    versions.erase(id);
+}
+
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
     // alloc a new inode and return inum
     printf("extent_server: create inode\n");
 
     reader_prologue();
-
-    id = im->alloc_inode(type);
-    im->uncommitted = true; // New inode created, mark file system as uncommitted.
-
+    int r = create_p(type, id);
     reader_epilogue();
+    recall_leases();
+
+    if (r != extent_protocol::OK) {
+        printf("extent_server: create inode returns %d\n", r);
+        return r;
+    }
 
     printf("extent_server: create inode success\n");
 
@@ -157,42 +470,49 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
     printf("extent_server: put %lld\n", id);
 
     reader_prologue();
-
     id &= 0x7fffffff;
-
-    const char *cbuf = buf.c_str();
-    int size = buf.size();
-    im->write_file(id, cbuf, size);
-    im->uncommitted = true; // Inode modified, mark file system as uncommitted.
-
+    put_p(id, buf);
     reader_epilogue();
+    recall_leases();
 
     printf("extent_server: put %lld success\n", id);
 
     return extent_protocol::OK;
 }
 
+/* Get the whole content of the extent of a get key, coalesced with the identical requests in flight.
+ * Add the bytes copied to copied. The caller should be in the reader section. */
+void extent_server::get_coalesced_p(const flight_key &key, std::string &buf, unsigned long long &copied)
+{
+    flight *f;
+
+    if (flight_join(key, f)) {
+        buf = f->buf;
+        flight_leave(f);
+    } else {
+        get_p(key.second.first, buf, copied);
+        f->buf = buf;
+        flight_finish(f, key);
+    }
+    copied += buf.size(); // Between the leader and the flight.
+}
+
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
     printf("extent_server: get %lld\n", id);
 
-    reader_prologue();
+    unsigned long long copied = 0;
 
+    reader_prologue();
     id &= 0x7fffffff;
 
-    int size = 0;
-    char *cbuf = NULL;
-
-    im->read_file(id, &cbuf, &size);
-    if (size == 0)
-        buf = "";
-    else {
-        buf.assign(cbuf, size);
-        free(cbuf);
-    }
+    get_coalesced_p(flight_key_of(extent_protocol::get, id), buf, copied);
 
     reader_epilogue();
 
+    // The RPC library copies buf once more into the reply.
+    count_read(buf.size(), copied + buf.size());
+
     printf("extent_server: get %lld success\n", id);
 
     return extent_protocol::OK;
@@ -202,14 +522,20 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 {
     printf("extent_server: getattr %lld\n", id);
 
-    reader_prologue();
+    flight *f;
 
+    reader_prologue();
     id &= 0x7fffffff;
 
-    extent_protocol::attr attr;
-    memset(&attr, 0, sizeof(attr));
-    im->getattr(id, attr);
-    a = attr;
+    flight_key key = flight_key_of(extent_protocol::getattr, id);
+    if (flight_join(key, f)) {
+        a = f->a;
+        flight_leave(f);
+    } else {
+        getattr_p(id, a);
+        f->a = a;
+        flight_finish(f, key);
+    }
 
     reader_epilogue();
 
@@ -218,19 +544,847 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
     return extent_protocol::OK;
 }
 
+/* Lease the attributes of an extent, which the caller has just read, to a client. Return the length of the lease,
+ * 0 if not leased. A modification either happened before the attributes were read, or recalls the lease. */
+unsigned int extent_server::grant_lease(extent_protocol::extentid_t id, const std::string &client)
+{
+    unsigned long long now = lease_clock_ms();
+
+    ScopedLock ml(&lease_mutex);
+    std::map<extent_protocol::extentid_t, unsigned long long>::iterator it = last_modified.find(id);
+    unsigned long long modified = it != last_modified.end() && it->second > all_modified ? it->second : all_modified;
+    if (modified && now - modified < ATTR_LEASE_MS) // Recently modified, may be modified again soon.
+        return 0;
+
+    lease_expiry[id][client] = now + ATTR_LEASE_MS;
+    leases_granted++;
+
+    return ATTR_LEASE_MS;
+}
+
+// Get the attributes of an extent with a lease for client.
+int extent_server::getattr_lease(extent_protocol::extentid_t id, std::string client, extent_protocol::leased_attr &l)
+{
+    int r = getattr(id, l.a);
+    l.lease_ms = grant_lease(id & 0x7fffffff, client);
+    return r;
+}
+
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
     printf("extent_server: remove %lld\n", id);
 
+    reader_prologue();
+    id &= 0x7fffffff;
+    remove_p(id);
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: remove %lld success\n", id);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::read(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &buf)
+{
+    printf("extent_server: read %lld [%u, +%u)\n", id, off, len);
+
+    unsigned long long copied = 0;
+
     reader_prologue();
 
     id &= 0x7fffffff;
-    im->remove_file(id);
-    im->uncommitted = true; // An inode removed, mark file system as uncommitted.
+
+    // Reads of a whole extent, as done by extent_client::get, are served from and fill the content cache.
+    unsigned long long v = version_p(id), corrected = im->corrected_count();
+    if (off != 0 || !cached_content_p(id, v, len, buf, copied)) {
+        im->read_file_range(id, off, len, buf);
+        if (off == 0 && buf.size() < len) {
+            cache.insert(id, v, buf, corrected);
+            copied += buf.size();
+        }
+    }
 
     reader_epilogue();
 
-    printf("extent_server: remove %lld success\n", id);
+    // The RPC library copies buf into the reply.
+    count_read(buf.size(), copied + buf.size());
+
+    printf("extent_server: read %lld success\n", id);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::write(extent_protocol::extentid_t id, unsigned int off, std::string buf, int &)
+{
+    printf("extent_server: write %lld [%u, +%zu)\n", id, off, buf.size());
+
+    reader_prologue();
+
+    id &= 0x7fffffff;
+    im->write_file_range(id, off, buf.data(), buf.size());
+    modified_p(id);
+    im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: write %lld success\n", id);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, unsigned int size, int &)
+{
+    printf("extent_server: truncate %lld to %u\n", id, size);
+
+    reader_prologue();
+
+    id &= 0x7fffffff;
+    im->truncate_file(id, size);
+    modified_p(id);
+    im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: truncate %lld success\n", id);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::append(extent_protocol::extentid_t id, std::string buf, unsigned int &size)
+{
+    printf("extent_server: append %lld +%zu\n", id, buf.size());
+
+    reader_prologue();
+
+    id &= 0x7fffffff;
+    size = im->append_file(id, buf.data(), buf.size());
+    modified_p(id);
+    im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: append %lld success, size is %u\n", id, size);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::compound(std::vector<extent_protocol::op> ops, std::vector<extent_protocol::op_result> &results)
+{
+    printf("extent_server: compound of %zu ops\n", ops.size());
+
+    extent_protocol::status last = extent_protocol::OK;
+    extent_protocol::extentid_t last_eid = 0;
+    unsigned long long copied = 0;
+
+    results.clear();
+    results.resize(ops.size());
+
+    // All the ops are executed in a single reader section, so no version control operation can interleave.
+    reader_prologue();
+
+    for (size_t i = 0; i < ops.size(); ++i) {
+        const extent_protocol::op &o = ops[i];
+        extent_protocol::op_result &res = results[i];
+        extent_protocol::extentid_t id = o.eid;
+
+        if (o.flags & extent_protocol::OP_CHAIN) {
+            if (last != extent_protocol::OK) { // The op depends on a failed one, skip it.
+                res.ret = last;
+                continue;
+            }
+            if (id == 0) // Work on the extent produced by the previous op.
+                id = last_eid;
+        }
+
+        id &= 0x7fffffff;
+        res.ret = extent_protocol::OK;
+        res.eid = id;
+
+        // Ops other than create work on an existing inode.
+        if (o.opcode != extent_protocol::create) {
+            getattr_p(id, res.a);
+            if (!res.a.type)
+                res.ret = extent_protocol::NOENT;
+        }
+
+        if (res.ret == extent_protocol::OK) {
+            switch (o.opcode) {
+                case extent_protocol::dir_lookup:
+                    res.ret = dir_lookup_p(id, o.name, res.eid);
+                    break;
+                case extent_protocol::dir_add_entry:
+                    res.ret = dir_add_entry_p(id, o.name, o.type, o.buf, res.eid);
+                    break;
+                case extent_protocol::dir_remove_entry:
+                    res.ret = dir_remove_entry_p(id, o.name, res.eid);
+                    break;
+                case extent_protocol::create:
+                    res.ret = create_p(o.type, res.eid);
+                    break;
+                case extent_protocol::put:
+                    put_p(id, o.buf);
+                    break;
+                case extent_protocol::get:
+                    copied = 0;
+                    get_p(id, res.buf, copied);
+                    count_read(res.buf.size(), copied + res.buf.size()); // The RPC library copies it into the reply.
+                    break;
+                case extent_protocol::getattr: // Attributes have already been fetched.
+                    break;
+                case extent_protocol::remove:
+                    remove_p(id);
+                    break;
+                default:
+                    res.ret = extent_protocol::RPCERR;
+            }
+        }
+
+        last = res.ret;
+        last_eid = res.eid;
+    }
+
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: compound success\n");
+
+    return extent_protocol::OK;
+}
+
+bool extent_server::dir_name_valid(const std::string &name)
+{
+    // The length of a name is stored in one byte.
+    return !name.empty() && name.length() <= 255;
+}
+
+// Read the whole content of a directory. Return IOERR if dir is not a directory.
+int extent_server::dir_read_p(extent_protocol::extentid_t dir, std::string &content)
+{
+    int r;
+
+    if ((r = dir_check_p(dir)) != extent_protocol::OK)
+        return r;
+
+    unsigned long long copied = 0;
+    read_content_p(dir, content, copied);
+    return extent_protocol::OK;
+}
+
+// Return IOERR if dir is not a directory.
+int extent_server::dir_check_p(extent_protocol::extentid_t dir)
+{
+    extent_protocol::attr a;
+
+    getattr_p(dir, a);
+    return a.type == extent_protocol::T_DIR ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+// Give dir a new version and mark the file system uncommitted if d has written it.
+void extent_server::dir_modified_p(extent_protocol::extentid_t dir, const hashed_dir &d)
+{
+    if (d.changed()) {
+        modified_p(dir);
+        im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+    }
+}
+
+int extent_server::dir_lookup_p(extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &inum)
+{
+    int r;
+
+    if (!dir_name_valid(name))
+        return extent_protocol::NOENT;
+
+    ScopedLock ml(dir_lock(dir));
+
+    if ((r = dir_check_p(dir)) != extent_protocol::OK)
+        return r;
+
+    hashed_dir d(im, dir);
+    return d.lookup(name, inum) ? extent_protocol::OK : extent_protocol::NOENT;
+}
+
+/* Allocate a new inode of type holding content and link it into dir as name, unless name already exists.
+ * The content is written before the entry is inserted, so the name never refers to an incomplete inode. */
+int extent_server::dir_add_entry_p(extent_protocol::extentid_t dir, const std::string &name, uint32_t type,
+        const std::string &content, extent_protocol::extentid_t &inum)
+{
+    int r;
+
+    if (!dir_name_valid(name))
+        return extent_protocol::IOERR;
+
+    ScopedLock ml(dir_lock(dir));
+
+    if ((r = dir_check_p(dir)) != extent_protocol::OK)
+        return r;
+
+    hashed_dir d(im, dir);
+    if ((r = d.can_insert(name)) == extent_protocol::OK && (r = create_p(type, inum)) == extent_protocol::OK) {
+        if (!content.empty())
+            put_p(inum, content);
+        d.insert(name, inum);
+    }
+    dir_modified_p(dir, d);
+
+    return r;
+}
+
+// Unlink name from dir. The inode it refers to is not freed.
+int extent_server::dir_remove_entry_p(extent_protocol::extentid_t dir, const std::string &name,
+        extent_protocol::extentid_t &inum)
+{
+    int r;
+
+    if (!dir_name_valid(name))
+        return extent_protocol::NOENT;
+
+    ScopedLock ml(dir_lock(dir));
+
+    if ((r = dir_check_p(dir)) != extent_protocol::OK)
+        return r;
+
+    hashed_dir d(im, dir);
+    r = d.remove(name, inum);
+    dir_modified_p(dir, d);
+
+    return r;
+}
+
+int extent_server::dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &inum)
+{
+    printf("extent_server: dir_lookup %s in %lld\n", name.c_str(), dir);
+
+    int r;
+
+    reader_prologue();
+    dir &= 0x7fffffff;
+    r = dir_lookup_p(dir, name, inum);
+    reader_epilogue();
+
+    printf("extent_server: dir_lookup %s in %lld returns %d\n", name.c_str(), dir, r);
+
+    return r;
+}
+
+/* Look up name in dir, and lease the attributes of dir to client, so the result holds while the lease lasts.
+ * The reply is the entry, with an inum of 0 if not found, and the attributes of dir. */
+int extent_server::dir_lookup_lease(extent_protocol::extentid_t dir, std::string name, std::string client,
+        extent_protocol::dirent_plus &d)
+{
+    printf("extent_server: dir_lookup_lease %s in %lld\n", name.c_str(), dir);
+
+    int r;
+
+    d.name = name;
+    d.inum = 0;
+    d.lease_ms = 0;
+
+    reader_prologue();
+    dir &= 0x7fffffff;
+    getattr_p(dir, d.a);
+    if (d.a.type == extent_protocol::T_DIR) // Leased before the lookup, which a later change then recalls.
+        d.lease_ms = grant_lease(dir, client);
+    r = dir_lookup_p(dir, name, d.inum);
+    reader_epilogue();
+
+    if (r != extent_protocol::OK)
+        d.inum = 0;
+
+    printf("extent_server: dir_lookup_lease %s in %lld returns %d\n", name.c_str(), dir, r);
+
+    return r;
+}
+
+int extent_server::dir_add_entry(extent_protocol::extentid_t dir, std::string name, uint32_t type,
+        extent_protocol::extentid_t &inum)
+{
+    printf("extent_server: dir_add_entry %s in %lld\n", name.c_str(), dir);
+
+    int r;
+
+    reader_prologue();
+    dir &= 0x7fffffff;
+    r = dir_add_entry_p(dir, name, type, "", inum);
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: dir_add_entry %s in %lld returns %d\n", name.c_str(), dir, r);
+
+    return r;
+}
+
+int extent_server::dir_remove_entry(extent_protocol::extentid_t dir, std::string name,
+        extent_protocol::extentid_t &inum)
+{
+    printf("extent_server: dir_remove_entry %s in %lld\n", name.c_str(), dir);
+
+    int r;
+
+    reader_prologue();
+    dir &= 0x7fffffff;
+    r = dir_remove_entry_p(dir, name, inum);
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: dir_remove_entry %s in %lld returns %d\n", name.c_str(), dir, r);
+
+    return r;
+}
+
+int extent_server::dir_list(extent_protocol::extentid_t dir, std::vector<extent_protocol::dirent> &list)
+{
+    printf("extent_server: dir_list %lld\n", dir);
+
+    std::string content;
+    int r;
+
+    reader_prologue();
+    dir &= 0x7fffffff;
+    {
+        ScopedLock ml(dir_lock(dir));
+        r = dir_read_p(dir, content);
+    }
+    reader_epilogue();
+
+    hashed_dir::list(content, list);
+
+    printf("extent_server: dir_list %lld returns %d with %zu entries\n", dir, r, list.size());
+
+    return r;
+}
+
+// List a directory with the attributes of its entries, leased to client as by getattr_lease().
+int extent_server::dir_list_plus(extent_protocol::extentid_t dir, std::string client,
+        std::vector<extent_protocol::dirent_plus> &list)
+{
+    printf("extent_server: dir_list_plus %lld\n", dir);
+
+    std::string content;
+    std::vector<extent_protocol::dirent> entries;
+    int r;
+
+    list.clear();
+
+    reader_prologue();
+    dir &= 0x7fffffff;
+    {
+        ScopedLock ml(dir_lock(dir));
+        r = dir_read_p(dir, content);
+    }
+    hashed_dir::list(content, entries);
+
+    list.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        list[i].name = entries[i].name;
+        list[i].inum = entries[i].inum;
+        getattr_p(entries[i].inum & 0x7fffffff, list[i].a);
+        list[i].lease_ms = list[i].a.type ? grant_lease(entries[i].inum & 0x7fffffff, client) : 0;
+    }
+    reader_epilogue();
+
+    printf("extent_server: dir_list_plus %lld returns %d with %zu entries\n", dir, r, list.size());
+
+    return r;
+}
+
+int extent_server::clone(extent_protocol::extentid_t id, extent_protocol::extentid_t &newid)
+{
+    printf("extent_server: clone %lld\n", id);
+
+    reader_prologue();
+
+    id &= 0x7fffffff;
+    newid = im->clone_file(id);
+    if (newid) {
+        modified_p(newid);
+        im->uncommitted = true; // New inode created, mark file system as uncommitted.
+    }
+
+    reader_epilogue();
+    recall_leases();
+
+    if (!newid)
+        return extent_protocol::NOENT;
+
+    printf("extent_server: clone %lld success, new extent %lld\n", id, newid);
+
+    return extent_protocol::OK;
+}
+
+// Copy len bytes from src at src_off to dst at dst_off, at most STREAM_CHUNK_SIZE bytes at a time.
+int extent_server::copy_range(extent_protocol::extentid_t src, unsigned int src_off,
+        extent_protocol::extentid_t dst, unsigned int dst_off, unsigned int len, unsigned int &copied)
+{
+    printf("extent_server: copy_range %lld [%u, +%u) to %lld at %u\n", src, src_off, len, dst, dst_off);
+
+    extent_protocol::attr a, da;
+    std::string buf;
+    int r = extent_protocol::OK;
+
+    copied = 0;
+
+    reader_prologue();
+
+    src &= 0x7fffffff;
+    dst &= 0x7fffffff;
+
+    getattr_p(src, a);
+    da.type = 0;
+    if (a.type)
+        getattr_p(dst, da);
+
+    if (!da.type) {
+        r = extent_protocol::NOENT;
+    } else {
+        // Only the data up to the end of src is copied.
+        if (src_off >= a.size)
+            len = 0;
+        else if (len > a.size - src_off)
+            len = a.size - src_off;
+
+        // A copy to a later offset of the same extent goes from the end, so no data is overwritten before it is read.
+        bool backwards = src == dst && dst_off > src_off;
+
+        while (copied < len) {
+            unsigned int n = len - copied > STREAM_CHUNK_SIZE ? STREAM_CHUNK_SIZE : len - copied;
+            unsigned int pos = backwards ? len - copied - n : copied;
+
+            im->read_file_range(src, src_off + pos, n, buf);
+            if (buf.size() != n) // Truncated meanwhile.
+                break;
+
+            im->write_file_range(dst, dst_off + pos, buf.data(), n);
+            copied += n;
+        }
+
+        if (copied) {
+            modified_p(dst);
+            im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+        }
+    }
+
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: copy_range returns %d, %u bytes copied\n", r, copied);
+
+    return r;
+}
+
+int extent_server::stream_open(extent_protocol::extentid_t id, uint32_t mode, unsigned int off, uint32_t &sid)
+{
+    printf("extent_server: stream_open %lld mode %u at %u\n", id, mode, off);
+
+    extent_protocol::attr a;
+    stream s;
+    int r = extent_protocol::OK;
+
+    if (mode != extent_protocol::STREAM_READ && mode != extent_protocol::STREAM_WRITE)
+        return extent_protocol::RPCERR;
+
+    reader_prologue();
+    id &= 0x7fffffff;
+    s.eid = id;
+    s.mode = mode;
+    s.seq = 0;
+    s.off = off;
+    s.version = version_p(id);
+    s.staged = 0;
+    getattr_p(id, a);
+    s.whole = mode == extent_protocol::STREAM_READ && off == 0 && a.size <= STREAM_CHUNK_SIZE;
+
+    if (a.type && mode == extent_protocol::STREAM_WRITE) {
+        // The data before off is kept, the clone shares its blocks.
+        if (off) {
+            s.staged = im->clone_file(id);
+            im->truncate_file(s.staged, off);
+        } else {
+            s.staged = im->alloc_inode(a.type);
+        }
+    }
+
+    // The stream is registered in the reader section, so an undo or redo either drops it or comes before it.
+    if (!a.type) {
+        r = extent_protocol::NOENT;
+    } else if (mode == extent_protocol::STREAM_WRITE && !s.staged) {
+        r = extent_protocol::IOERR; // No inode left for staging.
+    } else {
+        std::vector<stream> dropped;
+
+        {
+            ScopedLock ml(&stream_mutex);
+            s.used = lease_clock_ms();
+
+            // Only streams abandoned by clients, idle for STREAM_IDLE_MS, are dropped to make room.
+            for (std::map<uint32_t, stream>::iterator it = streams.begin();
+                    it != streams.end() && streams.size() >= MAX_STREAMS; )
+                if (s.used - it->second.used >= STREAM_IDLE_MS) {
+                    dropped.push_back(it->second);
+                    streams.erase(it++);
+                } else {
+                    ++it;
+                }
+
+            if (streams.size() >= MAX_STREAMS) {
+                r = extent_protocol::IOERR;
+                dropped.push_back(s);
+            } else {
+                sid = next_sid++;
+                streams[sid] = s;
+            }
+        }
+
+        drop_streams_p(dropped);
+    }
+
+    reader_epilogue();
+
+    if (r != extent_protocol::OK) {
+        printf("extent_server: stream_open %lld returns %d\n", id, r);
+        return r;
+    }
+
+    printf("extent_server: stream_open %lld success, stream %u\n", id, sid);
+
+    return extent_protocol::OK;
+}
+
+/* Check that seq is the next chunk of stream sid opened in mode and get the stream.
+ * The caller should be in the reader section. */
+int extent_server::stream_next(uint32_t sid, uint32_t seq, uint32_t mode, stream &s)
+{
+    ScopedLock ml(&stream_mutex);
+
+    std::map<uint32_t, stream>::iterator it = streams.find(sid);
+    if (it == streams.end())
+        return extent_protocol::NOENT;
+
+    if (it->second.mode != mode || it->second.seq != seq)
+        return extent_protocol::IOERR;
+
+    it->second.used = lease_clock_ms();
+    s = it->second;
+    return extent_protocol::OK;
+}
+
+// Free the staging inodes of streams that are dropped. The caller should be in the reader section.
+void extent_server::drop_streams_p(const std::vector<stream> &dropped)
+{
+    for (size_t i = 0; i < dropped.size(); ++i)
+        if (dropped[i].staged)
+            im->remove_file(dropped[i].staged);
+}
+
+int extent_server::stream_read(uint32_t sid, uint32_t seq, std::string &buf)
+{
+    printf("extent_server: stream_read %u chunk %u\n", sid, seq);
+
+    stream s;
+    int r;
+    unsigned long long copied = 0;
+
+    reader_prologue();
+
+    if ((r = stream_next(sid, seq, extent_protocol::STREAM_READ, s)) == extent_protocol::OK) {
+        if (s.whole && seq == 0) // The only chunk, the same request as a get of this version.
+            get_coalesced_p(flight_key(extent_protocol::get, std::make_pair(s.eid, s.version)), buf, copied);
+        else if (version_p(s.eid) == s.version)
+            im->read_file_range(s.eid, s.off, STREAM_CHUNK_SIZE, buf);
+
+        if (version_p(s.eid) != s.version) { // Modified since the stream was opened.
+            r = extent_protocol::IOERR;
+        } else {
+            ScopedLock ml(&stream_mutex);
+
+            // A read stream is dropped after its last chunk, it needs not be closed.
+            if (buf.size() < STREAM_CHUNK_SIZE)
+                streams.erase(sid);
+            else if (streams.count(sid)) {
+                streams[sid].seq++;
+                streams[sid].off += buf.size();
+            }
+        }
+    }
+
+    reader_epilogue();
+
+    if (r == extent_protocol::OK)
+        count_read(buf.size(), copied + buf.size()); // The RPC library copies buf into the reply.
+
+    printf("extent_server: stream_read %u chunk %u returns %d\n", sid, seq, r);
+
+    return r;
+}
+
+int extent_server::stream_write(uint32_t sid, uint32_t seq, std::string buf, int &)
+{
+    printf("extent_server: stream_write %u chunk %u +%zu\n", sid, seq, buf.size());
+
+    stream s;
+    int r;
+
+    if (buf.size() > STREAM_CHUNK_SIZE)
+        return extent_protocol::RPCERR;
+
+    reader_prologue();
+
+    if ((r = stream_next(sid, seq, extent_protocol::STREAM_WRITE, s)) == extent_protocol::OK) {
+        // Encode and write the chunk right away, only one chunk is held in memory. The extent is not changed yet.
+        im->write_file_range(s.staged, s.off, buf.data(), buf.size());
+
+        ScopedLock ml(&stream_mutex);
+        if (streams.count(sid)) {
+            streams[sid].seq++;
+            streams[sid].off += buf.size();
+        }
+    }
+
+    reader_epilogue();
+    recall_leases();
+
+    printf("extent_server: stream_write %u chunk %u returns %d\n", sid, seq, r);
+
+    return r;
+}
+
+int extent_server::stream_close(uint32_t sid, unsigned int &size)
+{
+    printf("extent_server: stream_close %u\n", sid);
+
+    stream s;
+    int r = extent_protocol::OK;
+
+    reader_prologue();
+
+    {
+        ScopedLock ml(&stream_mutex);
+
+        std::map<uint32_t, stream>::iterator it = streams.find(sid);
+        if (it == streams.end()) {
+            reader_epilogue();
+            return extent_protocol::NOENT;
+        }
+
+        s = it->second;
+        streams.erase(it);
+    }
+
+    // The staged data replaces the whole extent.
+    if (s.mode == extent_protocol::STREAM_WRITE) {
+#if COMPRESS
+        im->compress_file(s.staged); // The chunks were written as is.
+#endif
+        if (im->replace_file(s.eid, s.staged)) {
+            modified_p(s.eid);
+            im->uncommitted = true; // Inode modified, mark file system as uncommitted.
+        } else {
+            r = extent_protocol::NOENT; // Removed while it was written.
+        }
+    }
+    size = s.off;
+
+    reader_epilogue();
+    recall_leases();
+
+    if (r != extent_protocol::OK) {
+        printf("extent_server: stream_close %u returns %d\n", sid, r);
+        return r;
+    }
+
+    printf("extent_server: stream_close %u success, %u bytes\n", sid, size);
+
+    return extent_protocol::OK;
+}
+
+// Drop a stream without changing its extent.
+int extent_server::stream_abort(uint32_t sid, int &)
+{
+    printf("extent_server: stream_abort %u\n", sid);
+
+    std::vector<stream> dropped;
+
+    reader_prologue();
+
+    {
+        ScopedLock ml(&stream_mutex);
+
+        std::map<uint32_t, stream>::iterator it = streams.find(sid);
+        if (it != streams.end()) {
+            dropped.push_back(it->second);
+            streams.erase(it);
+        }
+    }
+
+    drop_streams_p(dropped);
+
+    reader_epilogue();
+
+    if (dropped.empty())
+        return extent_protocol::NOENT;
+
+    printf("extent_server: stream_abort %u success\n", sid);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::stats(uint32_t, std::map<std::string, unsigned long long> &stats)
+{
+    printf("extent_server: stats\n");
+
+    stats.clear();
+    cache.get_stats(stats);
+    im->get_stats(stats);
+
+    {
+        ScopedLock ml(&flight_mutex);
+        stats["get_requests"] = get_requests;
+        stats["get_coalesced"] = get_coalesced;
+        stats["getattr_requests"] = getattr_requests;
+        stats["getattr_coalesced"] = getattr_coalesced;
+    }
+
+    {
+        ScopedLock ml(&stat_mutex);
+        stats["read_requests"] = read_requests;
+        stats["read_bytes"] = read_bytes;
+        stats["read_bytes_copied"] = read_bytes_copied;
+        stats["read_bytes_copied_per_read"] = read_requests ? read_bytes_copied / read_requests : 0;
+        stats["content_refreshes"] = content_refreshes;
+    }
+
+    {
+        ScopedLock ml(&lease_mutex);
+        stats["attr_leases_granted"] = leases_granted;
+        stats["attr_leases_recalled"] = leases_recalled;
+        stats["attr_lease_waits"] = lease_waits;
+        stats["attr_lease_wait_ms"] = lease_wait_ms;
+    }
+
+    return extent_protocol::OK;
+}
+
+int extent_server::replace_disk(int disk, int &)
+{
+    printf("extent_server: replace_disk %d\n", disk);
+
+    bool ok;
+
+    /* The content stays the same, the lost blocks are rebuilt before they are accessed.
+     * No operation runs while the blocks are marked lost, as it may have checked them already. */
+    writer_prologue();
+    ok = im->replace_disk(disk);
+    writer_epilogue();
+
+    if (!ok) {
+        printf("extent_server: replace_disk failed\n");
+        return extent_protocol::IOERR;
+    }
 
     return extent_protocol::OK;
 }
@@ -286,9 +1440,20 @@ int extent_server::undo(uint32_t, int &)
 
     fin.close();
 
+    // The disk may have been replaced, forget all cached contents and open streams. Staging inodes are gone with it.
+    cache.clear();
+    versions.clear();
+    {
+        ScopedLock ml(&stream_mutex);
+        streams.clear();
+    }
+    im->rebuild_block_refs();
+    all_leases_modified_p();
+
     cv = im->current_version;
 
     writer_epilogue();
+    recall_leases();
 
     printf("extent_server: undo success, current version is %d\n", cv);
 
@@ -316,9 +1481,20 @@ int extent_server::redo(uint32_t, int &)
 
     fin.close();
 
+    // The disk may have been replaced, forget all cached contents and open streams. Staging inodes are gone with it.
+    cache.clear();
+    versions.clear();
+    {
+        ScopedLock ml(&stream_mutex);
+        streams.clear();
+    }
+    im->rebuild_block_refs();
+    all_leases_modified_p();
+
     cv = im->current_version;
 
     writer_epilogue();
+    recall_leases();
 
     printf("extent_server: redo success, current version is %d\n", cv);
 
@@ -7,8 +7,24 @@
 #include <map>
 #include <vector>
 #include <semaphore.h>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
+#include "content_cache.h"
+#include "hashed_dir.h"
+
+#define MAX_STREAMS 64 // Maximum number of streams open at the same time.
+#define STREAM_IDLE_MS 30000 // Time after which an unused stream may be dropped to open another one.
+#define DIR_LOCKS 64 // Locks serializing directory operations, shared by directories with the same inum modulo this.
+
+// A lease taken back by a modification, to be recalled from its client, see extent_server::recall_leases().
+struct revoked_lease {
+    extent_protocol::extentid_t eid; // 0 for all the leases of the client.
+    std::string client;
+    unsigned long long expiry;
+    revoked_lease(extent_protocol::extentid_t eid, const std::string &client, unsigned long long expiry):
+        eid(eid), client(client), expiry(expiry) {}
+};
 
 class extent_server {
 protected:
@@ -38,6 +54,112 @@ protected:
     void writer_prologue();
     void writer_epilogue();
 
+    /* Decoded contents of extents are cached. Every modification of an extent gives it a new version
+     * from a global counter, so contents decoded concurrently with a modification are never used.
+     * Versions and cache are reset when version control operations replace the disk.
+     */
+    content_cache cache;
+    pthread_mutex_t version_mutex;
+    unsigned long long version_counter;
+    std::map<extent_protocol::extentid_t, unsigned long long> versions;
+    unsigned long long version_p(extent_protocol::extentid_t id);
+    unsigned long long modified_p(extent_protocol::extentid_t id);
+    bool cached_content_p(extent_protocol::extentid_t id, unsigned long long v, size_t max_size,
+            std::string &buf, unsigned long long &copied);
+    void read_content_p(extent_protocol::extentid_t id, std::string &buf, unsigned long long &copied);
+
+    /* Attributes are leased to clients, which use them without asking until the lease expires.
+     * Only extents not modified for ATTR_LEASE_MS are leased, so extents being written are not.
+     * A modification recalls the leases of its extent from their clients before it returns, so no client
+     * uses outdated attributes after that. Version control operations recall all leases.
+     * The recalls are made after the request has released all its locks. A client that cannot be called back
+     * is waited for until its lease expires.
+     */
+    pthread_mutex_t lease_mutex;
+    // When the lease of every client holding one on an extent expires, in lease_clock_ms(), by client address.
+    std::map<extent_protocol::extentid_t, std::map<std::string, unsigned long long> > lease_expiry;
+    std::map<extent_protocol::extentid_t, unsigned long long> last_modified; // In lease_clock_ms().
+    unsigned long long all_modified;
+    unsigned long long leases_granted, leases_recalled, lease_waits, lease_wait_ms;
+    void lease_modified_p(extent_protocol::extentid_t id);
+    void all_leases_modified_p();
+    void recall_leases();
+    unsigned int grant_lease(extent_protocol::extentid_t id, const std::string &client);
+
+    /* Data returned by get and read is decoded straight from the disk blocks into the reply.
+     * Bytes copied after that (cache, coalesced requests, and the RPC reply buffer) are counted,
+     * and so are the cached contents written back after errors were corrected on disk.
+     */
+    pthread_mutex_t stat_mutex;
+    unsigned long long read_requests, read_bytes, read_bytes_copied, content_refreshes;
+    void count_read(unsigned long long bytes, unsigned long long copied);
+
+    /* Identical get and getattr requests on the same version of an extent are coalesced:
+     * the first one (the leader) executes, and the others arriving before it finishes wait for its result.
+     */
+    struct flight {
+        pthread_cond_t cond;
+        bool done;
+        int refs; // The leader and the waiting requests.
+        std::string buf;
+        extent_protocol::attr a;
+    };
+    typedef std::pair<uint32_t, std::pair<extent_protocol::extentid_t, unsigned long long> > flight_key;
+    pthread_mutex_t flight_mutex;
+    std::map<flight_key, flight*> flights;
+    unsigned long long get_requests, get_coalesced, getattr_requests, getattr_coalesced;
+    flight_key flight_key_of(uint32_t opcode, extent_protocol::extentid_t id);
+    bool flight_join(const flight_key &key, flight *&f);
+    void flight_finish(flight *f, const flight_key &key);
+    void flight_leave(flight *f);
+    void get_coalesced_p(const flight_key &key, std::string &buf, unsigned long long &copied);
+
+    /* Streams transfer an extent in chunks of at most STREAM_CHUNK_SIZE bytes, sent in sequence.
+     * A write stream encodes and writes every chunk as it arrives to a staging inode, which starts with the
+     * data before the offset of the stream. Closing the stream replaces the data of the extent with it in one step,
+     * so no one sees a partly written extent. Aborting the stream drops the staging inode.
+     * A read stream fails once the extent is modified by others. Streams are dropped by undo and redo.
+     * Opening a stream fails while MAX_STREAMS streams are in use.
+     * A read stream ends after its last chunk. A stream of a single chunk is read as a get, coalesced with others.
+     */
+    struct stream {
+        extent_protocol::extentid_t eid;
+        uint32_t mode;
+        uint32_t seq; // Sequence number of the next chunk.
+        unsigned int off; // Offset of the next chunk.
+        unsigned long long version; // Version of the extent when a read stream was opened.
+        unsigned long long used; // When the stream was last used, in lease_clock_ms().
+        extent_protocol::extentid_t staged; // The staging inode of a write stream.
+        bool whole; // A read stream of the whole extent in one chunk.
+    };
+    pthread_mutex_t stream_mutex;
+    uint32_t next_sid;
+    std::map<uint32_t, stream> streams;
+    int stream_next(uint32_t sid, uint32_t seq, uint32_t mode, stream &s);
+    void drop_streams_p(const std::vector<stream> &dropped);
+
+    int create_p(uint32_t type, extent_protocol::extentid_t &id);
+    void put_p(extent_protocol::extentid_t id, const std::string &buf);
+    void get_p(extent_protocol::extentid_t id, std::string &buf, unsigned long long &copied);
+    void getattr_p(extent_protocol::extentid_t id, extent_protocol::attr &a);
+    void remove_p(extent_protocol::extentid_t id);
+
+    /* Directories are stored as hash tables, see hashed_dir.
+     * Directory operations are executed at the server, so that clients never have to transfer or parse
+     * a whole directory to change it. Operations on the same directory are serialized by its dir_lock().
+     */
+    pthread_mutex_t dir_locks[DIR_LOCKS];
+    pthread_mutex_t *dir_lock(extent_protocol::extentid_t dir) { return &dir_locks[dir % DIR_LOCKS]; }
+    static bool dir_name_valid(const std::string &name);
+    int dir_read_p(extent_protocol::extentid_t dir, std::string &content);
+    int dir_check_p(extent_protocol::extentid_t dir);
+    void dir_modified_p(extent_protocol::extentid_t dir, const hashed_dir &d);
+    int dir_lookup_p(extent_protocol::extentid_t dir, const std::string &name, extent_protocol::extentid_t &inum);
+    int dir_add_entry_p(extent_protocol::extentid_t dir, const std::string &name, uint32_t type,
+            const std::string &content, extent_protocol::extentid_t &inum);
+    int dir_remove_entry_p(extent_protocol::extentid_t dir, const std::string &name,
+            extent_protocol::extentid_t &inum);
+
 public:
     extent_server();
     ~extent_server();
@@ -46,8 +168,45 @@ public:
     int put(extent_protocol::extentid_t id, std::string, int &);
     int get(extent_protocol::extentid_t id, std::string &);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
+    int getattr_lease(extent_protocol::extentid_t id, std::string client, extent_protocol::leased_attr &);
     int remove(extent_protocol::extentid_t id, int &);
 
+    // Byte-range operations
+    int read(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &);
+    int write(extent_protocol::extentid_t id, unsigned int off, std::string, int &);
+    int truncate(extent_protocol::extentid_t id, unsigned int size, int &);
+    int append(extent_protocol::extentid_t id, std::string, unsigned int &);
+
+    // Run a sequence of inode operations in one request.
+    int compound(std::vector<extent_protocol::op>, std::vector<extent_protocol::op_result> &);
+
+    // Directory operations
+    int dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &);
+    int dir_add_entry(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::extentid_t &);
+    int dir_remove_entry(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &);
+    int dir_list(extent_protocol::extentid_t dir, std::vector<extent_protocol::dirent> &);
+    int dir_list_plus(extent_protocol::extentid_t dir, std::string client, std::vector<extent_protocol::dirent_plus> &);
+    int dir_lookup_lease(extent_protocol::extentid_t dir, std::string name, std::string client,
+            extent_protocol::dirent_plus &);
+
+    // Copy operations. A clone shares the data blocks with the original until either one is written.
+    int clone(extent_protocol::extentid_t id, extent_protocol::extentid_t &);
+    int copy_range(extent_protocol::extentid_t src, unsigned int src_off,
+            extent_protocol::extentid_t dst, unsigned int dst_off, unsigned int len, unsigned int &);
+
+    // Streaming operations
+    int stream_open(extent_protocol::extentid_t id, uint32_t mode, unsigned int off, uint32_t &sid);
+    int stream_read(uint32_t sid, uint32_t seq, std::string &buf);
+    int stream_write(uint32_t sid, uint32_t seq, std::string buf, int &);
+    int stream_close(uint32_t sid, unsigned int &size);
+    int stream_abort(uint32_t sid, int &);
+
+    // Get the counters of the server.
+    int stats(uint32_t, std::map<std::string, unsigned long long> &);
+
+    // Replace a disk with an empty one and rebuild it from the parity, the disks after the data disks are the parity.
+    int replace_disk(int disk, int &);
+
     // Version Control Operations
     // The two parameters are not used. They only serve to satisfy the requirement of the RPC library.
     int commit(uint32_t, int &);
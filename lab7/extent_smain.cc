@@ -34,6 +34,27 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::commit, &ls, &extent_server::commit);
   server.reg(extent_protocol::undo, &ls, &extent_server::undo);
   server.reg(extent_protocol::redo, &ls, &extent_server::redo);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
+  server.reg(extent_protocol::write, &ls, &extent_server::write);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::append, &ls, &extent_server::append);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_add_entry, &ls, &extent_server::dir_add_entry);
+  server.reg(extent_protocol::dir_remove_entry, &ls, &extent_server::dir_remove_entry);
+  server.reg(extent_protocol::dir_list, &ls, &extent_server::dir_list);
+  server.reg(extent_protocol::stats, &ls, &extent_server::stats);
+  server.reg(extent_protocol::stream_open, &ls, &extent_server::stream_open);
+  server.reg(extent_protocol::stream_read, &ls, &extent_server::stream_read);
+  server.reg(extent_protocol::stream_write, &ls, &extent_server::stream_write);
+  server.reg(extent_protocol::stream_close, &ls, &extent_server::stream_close);
+  server.reg(extent_protocol::stream_abort, &ls, &extent_server::stream_abort);
+  server.reg(extent_protocol::clone, &ls, &extent_server::clone);
+  server.reg(extent_protocol::copy_range, &ls, &extent_server::copy_range);
+  server.reg(extent_protocol::replace_disk, &ls, &extent_server::replace_disk);
+  server.reg(extent_protocol::getattr_lease, &ls, &extent_server::getattr_lease);
+  server.reg(extent_protocol::dir_list_plus, &ls, &extent_server::dir_list_plus);
+  server.reg(extent_protocol::dir_lookup_lease, &ls, &extent_server::dir_lookup_lease);
 
   while(1)
     sleep(1000);
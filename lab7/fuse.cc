@@ -16,9 +16,16 @@
 #include <unistd.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include "lang/verify.h"
 #include "yfs_client.h"
 
+// Threads handling FUSE requests, unless YFS_FUSE_WORKERS is set. A worker whose lock is held
+// elsewhere waits in its lock_client for a retry, not in a thread of the lock server, so the number
+// of workers of all clients together is not bounded by the servers' RPC threads.
+#define FUSE_DEFAULT_WORKERS 4
+#define FUSE_MAX_WORKERS 64
+
 int myid;
 yfs_client *yfs;
 
@@ -34,69 +41,15 @@ int id() {
 // fuse functions (such as lookup) need to return attributes
 // as well as other information, so getattr() gets called a lot.
 //
-// YFS fakes most of the attributes. It does provide more or
-// less correct values for the access/modify/change times
-// (atime, mtime, and ctime), and correct values for file sizes.
+// YFS fakes most of the attributes, see yfs_client::stat(). It
+// does provide more or less correct values for the access/modify/
+// change times (atime, mtime, and ctime), and correct values for
+// file sizes.
 //
 yfs_client::status getattr(yfs_client::inum inum, struct stat &st)
 {
-    yfs_client::status ret;
-
-    bzero(&st, sizeof(st));
-
-    st.st_ino = inum;
-
-    printf("getattr %016llx %d\n", inum, yfs->isfile(inum));
-
-    if (yfs->isfile(inum)) {
-        yfs_client::fileinfo info;
-
-        ret = yfs->getfile(inum, info);
-        if (ret != yfs_client::OK)
-            return ret;
-
-        st.st_mode = S_IFREG | 0666;
-        st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        st.st_size = info.size;
-
-        printf("   getattr -> %llu\n", info.size);
-    } else if (yfs->isdir(inum)) {
-        yfs_client::dirinfo info;
-
-        ret = yfs->getdir(inum, info);
-        if (ret != yfs_client::OK)
-            return ret;
-
-        st.st_mode = S_IFDIR | 0777;
-        st.st_nlink = 2;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-
-        printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
-    } else if (yfs->issymlink(inum)) {
-        yfs_client::fileinfo info;
-
-        ret = yfs->getsymlink(inum, info);
-        if (ret != yfs_client::OK)
-            return ret;
-
-        st.st_mode = S_IFLNK | 0777;
-        st.st_nlink = 1;
-        st.st_atime = info.atime;
-        st.st_mtime = info.mtime;
-        st.st_ctime = info.ctime;
-        st.st_size = info.size;
-
-        printf("   getattr -> %llu\n", info.size);
-    } else { // Invalid inode or unimplemented file type.
-        return yfs_client::NOENT;
-    }
-
-    return yfs_client::OK;
+    // One extent RPC at most, see yfs_client::stat().
+    return yfs->stat(inum, st);
 }
 
 //
@@ -325,13 +278,14 @@ struct dirbuf {
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+// The entry carries the type of the file from st, the other attributes are not passed by this FUSE version.
+void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino, const struct stat *st)
 {
     struct stat stbuf;
     size_t oldsize = b->size;
     b->size += fuse_dirent_size(strlen(name));
     b->p = (char *) realloc(b->p, b->size);
-    memset(&stbuf, 0, sizeof(stbuf));
+    memcpy(&stbuf, st, sizeof(stbuf));
     stbuf.st_ino = ino;
     fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
 }
@@ -353,7 +307,11 @@ int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize, off_t off
 // You can ignore @size and @off (except that you must pass
 // them to reply_buf_limited).
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// Call dirbuf_add(&b, name, inum, st) for each entry in the directory.
+//
+// The attributes of the entries come in the same round trip, and are
+// kept by yfs_client, so the getattr() calls of "ls -l" that follow
+// send no RPCs.
 //
 void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
@@ -362,17 +320,17 @@ void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 
     printf("fuseserver_readdir\n");
 
-    if (!yfs->isdir(inum)) {
-        fuse_reply_err(req, ENOTDIR);
+    std::list<yfs_client::direntplus> entries;
+    yfs_client::status ret;
+    if ((ret = yfs->readdirplus(inum, entries)) != yfs_client::OK) {
+        fuse_reply_err(req, ret == yfs_client::NOENT ? ENOENT : ret == yfs_client::NOTDIR ? ENOTDIR : EIO);
         return;
     }
 
     memset(&b, 0, sizeof(b));
 
-    std::list<yfs_client::dirent> entries;
-    yfs->readdir(inum, entries);
-    for (std::list<yfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+    for (std::list<yfs_client::direntplus>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum, &it->st);
     }
 
     reply_buf_limited(req, b.p, b.size, off, size);
@@ -385,6 +343,13 @@ void fuseserver_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
     fuse_reply_open(req, fi);
 }
 
+// The directory is listed next, so its entries are fetched while the kernel asks for its attributes.
+void fuseserver_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    yfs->opendir(ino);
+    fuse_reply_open(req, fi);
+}
+
 //
 // Create a new directory with name @name in parent directory @parent.
 // Leave new directory's inum in e.ino and attributes in e.attr.
@@ -492,8 +457,119 @@ void fuseserver_readlink(fuse_req_t req, fuse_ino_t ino)
         fuse_reply_readlink(req, target.c_str());
 }
 
+//
+// Make the writes to file @ino durable at the extent server.
+// Writes are cached by the extent client while it holds the lock
+// of the file, and reach the server at the latest when it is revoked.
+//
+void fuseserver_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    if (yfs->fsync(ino) != yfs_client::OK)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_err(req, 0);
+}
+
+//
+// Called on every close of a file descriptor of @ino. The cached
+// writes are written back, so that close reports the errors of the
+// writes through it.
+//
+void fuseserver_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (yfs->fsync(ino) != yfs_client::OK)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_err(req, 0);
+}
+
+//
+// Called when the last reference to an open file @ino is gone.
+//
+void fuseserver_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (yfs->fsync(ino) != yfs_client::OK)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_err(req, 0);
+}
+
 struct fuse_lowlevel_ops fuseserver_oper;
 
+struct fuse_worker_arg {
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    int err;
+};
+
+//
+// Receive requests from the kernel and handle them, as
+// fuse_session_loop() does. Several of these run at once, so
+// requests of different processes overlap their RPCs; yfs_client
+// and the extent and lock clients serialize what they share.
+//
+void *fuseserver_worker(void *a)
+{
+    fuse_worker_arg *arg = (fuse_worker_arg *)a;
+    size_t bufsize = fuse_chan_bufsize(arg->ch);
+    char *buf = (char *)malloc(bufsize);
+
+    arg->err = 0;
+    if (!buf) {
+        fprintf(stderr, "fuse: failed to allocate read buffer\n");
+        arg->err = -1;
+        fuse_session_exit(arg->se);
+        return NULL;
+    }
+
+    while (!fuse_session_exited(arg->se)) {
+        int res = fuse_chan_receive(arg->ch, buf, bufsize);
+        if (res == 0) // Interrupted, or unmounted.
+            continue;
+        if (res < 0) {
+            arg->err = -1;
+            break;
+        }
+        fuse_session_process(arg->se, buf, res, arg->ch);
+    }
+
+    // Stop the others too, they get an error from the channel once it is gone.
+    fuse_session_exit(arg->se);
+    free(buf);
+    return NULL;
+}
+
+// Handle requests with nworkers threads until the session ends.
+int fuseserver_loop(struct fuse_session *se, struct fuse_chan *ch, int nworkers)
+{
+    pthread_t th[FUSE_MAX_WORKERS];
+    fuse_worker_arg args[FUSE_MAX_WORKERS];
+    sigset_t set, old;
+    int err = 0;
+
+    // The signal handlers call into yfs_client, so they must not interrupt a worker holding its mutexes.
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    VERIFY(pthread_sigmask(SIG_BLOCK, &set, &old) == 0);
+
+    for (int i = 0; i < nworkers; i++) {
+        args[i].se = se;
+        args[i].ch = ch;
+        VERIFY(pthread_create(&th[i], NULL, fuseserver_worker, &args[i]) == 0);
+    }
+
+    VERIFY(pthread_sigmask(SIG_SETMASK, &old, NULL) == 0);
+
+    for (int i = 0; i < nworkers; i++) {
+        VERIFY(pthread_join(th[i], NULL) == 0);
+        if (args[i].err)
+            err = args[i].err;
+    }
+    return err;
+}
+
 void sig_handler(int signum) {
     switch (signum) {
         case SIGINT:
@@ -553,6 +629,7 @@ int main(int argc, char *argv[])
     fuseserver_oper.create     = fuseserver_create;
     fuseserver_oper.mknod      = fuseserver_mknod;
     fuseserver_oper.open       = fuseserver_open;
+    fuseserver_oper.opendir    = fuseserver_opendir;
     fuseserver_oper.read       = fuseserver_read;
     fuseserver_oper.write      = fuseserver_write;
     fuseserver_oper.setattr    = fuseserver_setattr;
@@ -560,6 +637,9 @@ int main(int argc, char *argv[])
     fuseserver_oper.mkdir      = fuseserver_mkdir;
     fuseserver_oper.symlink    = fuseserver_symlink;
     fuseserver_oper.readlink   = fuseserver_readlink;
+    fuseserver_oper.fsync      = fuseserver_fsync;
+    fuseserver_oper.flush      = fuseserver_flush;
+    fuseserver_oper.release    = fuseserver_release;
     /** Your code here for Lab.
      * you may want to add
      * routines here to implement symbolic link,
@@ -614,12 +694,30 @@ int main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+
+    // Requests are handled by several threads, so that a request waiting for RPCs does not hold up the others.
+    int nworkers = FUSE_DEFAULT_WORKERS;
+    char *workers_env = getenv("YFS_FUSE_WORKERS");
+    if (workers_env != NULL) {
+        char *end;
+        errno = 0;
+        long n = strtol(workers_env, &end, 10);
+        if (errno != 0 || end == workers_env || *end != '\0' || n < 1 || n > FUSE_MAX_WORKERS) {
+            fprintf(stderr, "YFS_FUSE_WORKERS must be a number from 1 to %d, not \"%s\"\n",
+                    FUSE_MAX_WORKERS, workers_env);
+            exit(1);
+        }
+        nworkers = n;
+    }
+    printf("fuse: %d workers\n", nworkers);
+
+    err = fuseserver_loop(se, ch, nworkers);
 
     fuse_session_destroy(se);
     close(fd);
     fuse_unmount(mountpoint);
 
+    delete yfs; // Gives back the cached locks, with the data they cover.
+
     return err ? 1 : 0;
 }
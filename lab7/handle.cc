@@ -0,0 +1,91 @@
+// RPC clients of other nodes, by address.
+
+#include "handle.h"
+#include "slock.h"
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sstream>
+
+static pthread_mutex_t handle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, rpcc*> handles; // Bound clients by address.
+
+rpcc *handle::safebind()
+{
+    {
+        ScopedLock ml(&handle_mutex);
+        std::map<std::string, rpcc*>::iterator it = handles.find(dst);
+        if (it != handles.end())
+            return it->second;
+    }
+
+    // Bind without the mutex, so a node that does not answer does not hold up the calls to others.
+    sockaddr_in dstsock;
+    make_sockaddr(dst.c_str(), &dstsock);
+    rpcc *cl = new rpcc(dstsock);
+    if (cl->bind(rpcc::to(HANDLE_BIND_MS)) < 0) {
+        printf("handle: cannot bind to %s\n", dst.c_str());
+        delete cl;
+        return NULL;
+    }
+
+    ScopedLock ml(&handle_mutex);
+    std::map<std::string, rpcc*>::iterator it = handles.find(dst);
+    if (it != handles.end()) { // Bound by another thread meanwhile.
+        delete cl;
+        return it->second;
+    }
+    handles[dst] = cl;
+    return cl;
+}
+
+/* The client is kept, not deleted, as other threads may still be calling through it.
+ * A client that failed is left to time out its calls. */
+void handle::failed()
+{
+    ScopedLock ml(&handle_mutex);
+    handles.erase(dst);
+}
+
+int callback_port(std::string &addr)
+{
+    static pthread_mutex_t port_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static bool seeded = false;
+    int port;
+
+    ScopedLock ml(&port_mutex);
+
+    if (!seeded) {
+        srand(time(NULL) ^ getpid());
+        seeded = true;
+    }
+
+    // The port is tried by binding it, it may still be taken before the server listens on it.
+    while (true) {
+        port = 1024 + rand() % 30000;
+
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0)
+            break;
+        sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_ANY);
+        sin.sin_port = htons(port);
+        bool free = bind(s, (sockaddr*)&sin, sizeof(sin)) == 0;
+        close(s);
+        if (free)
+            break;
+    }
+
+    std::ostringstream host;
+    host << "127.0.0.1:" << port;
+    addr = host.str();
+    return port;
+}
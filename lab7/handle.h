@@ -0,0 +1,35 @@
+// RPC clients of other nodes, by address.
+
+#ifndef handle_h
+#define handle_h
+
+#include <string>
+#include "rpc.h"
+
+#define HANDLE_BIND_MS 1000 // How long binding to a node waits for it.
+
+/* An RPC client of the node at dst ("host:port"), bound once and shared by all handles of dst.
+ * Used by servers to call back their clients, e.g.
+ *
+ *   handle h(id);
+ *   rpcc *cl = h.safebind();
+ *   if (!cl || cl->call(proc, args..., r, rpcc::to(ms)) != OK)
+ *       h.failed();
+ */
+class handle {
+private:
+    std::string dst;
+
+public:
+    handle(const std::string &dst): dst(dst) {}
+    // The bound client of dst, or NULL if dst cannot be reached.
+    rpcc *safebind();
+    // Forget the client of dst after a call failed, so the next safebind() binds again.
+    void failed();
+};
+
+/* Pick a port of this host that nothing listens on, for a server called back by others,
+ * and set addr to its address for handles. */
+int callback_port(std::string &addr);
+
+#endif
@@ -0,0 +1,590 @@
+// hashed directory implementation.
+
+#include "hashed_dir.h"
+#include <string.h>
+#include <algorithm>
+
+hashed_dir::hashed_dir(inode_manager *im, uint32_t inum)
+    : im(im), inum(inum), legacy(false), modified(false)
+{
+    extent_protocol::attr a;
+    std::string buf;
+
+    im->getattr(inum, a);
+    if (a.size > 0)
+        im->read_file_range(inum, 0, sizeof(h), buf);
+
+    if (buf.size() == sizeof(h) && ((const header*)buf.data())->magic == DIR_MAGIC) {
+        memcpy(&h, buf.data(), sizeof(h));
+        return;
+    }
+
+    // An empty directory has an empty bucket in slot 1, which is written by the first insert.
+    memset(&h, 0, sizeof(h));
+    h.magic = DIR_MAGIC;
+    h.nbuckets = 1;
+    h.nslots = 2;
+    h.buckets[0] = 1;
+    legacy = a.size > 0;
+}
+
+// FNV-1a.
+uint32_t hashed_dir::hash(const std::string &name)
+{
+    uint32_t x = 2166136261u;
+
+    for (size_t i = 0; i < name.size(); ++i) {
+        x ^= (unsigned char)name[i];
+        x *= 16777619u;
+    }
+
+    return x;
+}
+
+/* The bucket of a hash in a table of nbuckets buckets.
+ * Buckets below nbuckets - half have been split already, and are addressed by one more bit of the hash. */
+uint32_t hashed_dir::bucket_of(uint32_t nbuckets, uint32_t hash)
+{
+    uint32_t mask = 1;
+
+    while (mask < nbuckets)
+        mask <<= 1;
+    mask -= 1;
+
+    uint32_t b = hash & mask;
+    if (b >= nbuckets)
+        b = hash & (mask >> 1);
+    return b;
+}
+
+// Bytes of v as a variable-length integer, 7 bits per byte with the high bit set on all but the last.
+int hashed_dir::varint_size(uint32_t v)
+{
+    int n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+int hashed_dir::put_varint(char *p, uint32_t v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (char)(unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)(unsigned char)v;
+    return n;
+}
+
+// Read a variable-length integer of at most avail bytes. Return its length, or -1 if truncated.
+int hashed_dir::get_varint(const char *p, int avail, uint32_t &v)
+{
+    v = 0;
+    for (int n = 0; n < avail && n < 5; ++n) {
+        v |= (uint32_t)((unsigned char)p[n] & 0x7f) << (7 * n);
+        if (!((unsigned char)p[n] & 0x80))
+            return n + 1;
+    }
+    return -1;
+}
+
+// Bytes of an entry. An entry whose numbers are not known yet takes at most entry_size(name, ~0U, ~0U).
+int hashed_dir::entry_size(const std::string &name, uint32_t inum, uint32_t seq)
+{
+    return 1 + name.size() + varint_size(inum) + varint_size(seq);
+}
+
+// Parse the entry at pos of s. Return its length, or -1 if truncated.
+int hashed_dir::parse_entry(const slot &s, int pos, entry &e)
+{
+    int used = s.used < (int)sizeof(s.entries) ? s.used : (int)sizeof(s.entries);
+    int namelen = (int)(unsigned char)s.entries[pos];
+    int len = 1 + namelen, n;
+    uint32_t inum;
+
+    if (pos + len > used || (n = get_varint(s.entries + pos + len, used - pos - len, inum)) < 0)
+        return -1;
+    len += n;
+    if ((n = get_varint(s.entries + pos + len, used - pos - len, e.seq)) < 0)
+        return -1;
+    len += n;
+
+    e.name.assign(s.entries + pos + 1, namelen);
+    e.inum = inum;
+    return len;
+}
+
+// Return the offset of the entry of name in s and set inum and its length, or return -1 if not found.
+int hashed_dir::find_entry(const slot &s, const std::string &name, extent_protocol::extentid_t &inum, int &len)
+{
+    int pos = 0;
+    entry e;
+
+    while (pos < s.used && (len = parse_entry(s, pos, e)) > 0) {
+        if (e.name == name) {
+            inum = e.inum;
+            return pos;
+        }
+        pos += len;
+    }
+
+    return -1;
+}
+
+void hashed_dir::slot_entries(const slot &s, std::vector<entry> &entries)
+{
+    int pos = 0, len;
+    entry e;
+
+    while (pos < s.used && (len = parse_entry(s, pos, e)) > 0) {
+        entries.push_back(e);
+        pos += len;
+    }
+}
+
+// Append e to s. Return false if it does not fit.
+bool hashed_dir::put_entry(slot &s, const entry &e)
+{
+    uint32_t n = e.inum; // Inode numbers fit in 32 bits.
+    int len = entry_size(e.name, n, e.seq);
+
+    if (s.used + len > (int)sizeof(s.entries))
+        return false;
+
+    char *p = s.entries + s.used;
+    *p = (char)(unsigned char)e.name.length();
+    memcpy(p + 1, e.name.data(), e.name.length());
+    p += 1 + e.name.length();
+    p += put_varint(p, n);
+    put_varint(p, e.seq);
+    s.used += len;
+    return true;
+}
+
+// Parse a directory in the flat layout. Entries are numbered in their order.
+void hashed_dir::parse_flat(const std::string &content, std::vector<entry> &entries)
+{
+    int size = content.size();
+    int pos = 0;
+    entry e;
+
+    while (pos < size) {
+        int namelen = (int)(unsigned char)content[pos];
+
+        if (pos + 1 + namelen + (int)sizeof(e.inum) > size) // Truncated entry.
+            break;
+
+        e.name = content.substr(pos + 1, namelen);
+        memcpy(&e.inum, content.data() + pos + 1 + namelen, sizeof(e.inum));
+        e.seq = entries.size();
+        entries.push_back(e);
+
+        pos += 1 + namelen + sizeof(e.inum);
+    }
+}
+
+// Build the content of a directory in the flat layout.
+void hashed_dir::build_flat(const std::vector<entry> &entries, std::string &content)
+{
+    content.clear();
+    for (size_t i = 0; i < entries.size(); ++i) {
+        content += (char)(unsigned char)entries[i].name.length();
+        content += entries[i].name;
+        content.append((const char*)&entries[i].inum, sizeof(entries[i].inum));
+    }
+}
+
+/* Build the whole content of a directory holding entries, with enough buckets for them.
+ * Return false if it does not fit in a file. */
+bool hashed_dir::build(const std::vector<entry> &entries, std::string &content)
+{
+    header nh;
+    memset(&nh, 0, sizeof(nh));
+    nh.magic = DIR_MAGIC;
+    nh.nentries = entries.size();
+    for (size_t i = 0; i < entries.size(); ++i)
+        nh.bytes += entry_size(entries[i].name, entries[i].inum, entries[i].seq);
+    nh.nbuckets = 1;
+    while (nh.nbuckets * DIR_SPLIT_BYTES < nh.bytes && nh.nbuckets < DIR_MAX_BUCKETS)
+        nh.nbuckets++;
+
+    std::vector<std::vector<const entry*> > groups(nh.nbuckets);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        groups[bucket_of(nh.nbuckets, hash(entries[i].name))].push_back(&entries[i]);
+        if (entries[i].seq >= nh.next_seq)
+            nh.next_seq = entries[i].seq + 1;
+    }
+
+    // Chains are laid out one after another.
+    std::vector<slot> slots;
+    for (uint32_t b = 0; b < nh.nbuckets; ++b) {
+        nh.buckets[b] = slots.size() + 1;
+        slots.push_back(slot());
+        memset(&slots.back(), 0, sizeof(slot));
+
+        for (size_t i = 0; i < groups[b].size(); ++i) {
+            if (!put_entry(slots.back(), *groups[b][i])) {
+                slots.back().next = slots.size() + 1;
+                slots.push_back(slot());
+                memset(&slots.back(), 0, sizeof(slot));
+                put_entry(slots.back(), *groups[b][i]);
+            }
+        }
+    }
+
+    nh.nslots = slots.size() + 1;
+    if (nh.nslots > DIR_MAX_SLOTS)
+        return false;
+
+    content.assign((const char*)&nh, sizeof(nh));
+    content.resize(DIR_SLOT_SIZE); // The header takes a whole slot.
+    content.append((const char*)&slots[0], slots.size() * sizeof(slot));
+    return true;
+}
+
+// Read slot n. The part beyond the end of file reads as zeros, an empty slot.
+void hashed_dir::read_slot(uint32_t n, slot &s)
+{
+    std::string buf;
+
+    im->read_file_range(inum, n * DIR_SLOT_SIZE, DIR_SLOT_SIZE, buf);
+    memset(&s, 0, sizeof(s));
+    memcpy(&s, buf.data(), buf.size());
+}
+
+void hashed_dir::write_slot(uint32_t n, const slot &s)
+{
+    im->write_file_range(inum, n * DIR_SLOT_SIZE, (const char*)&s, sizeof(s));
+    modified = true;
+}
+
+void hashed_dir::write_header()
+{
+    im->write_file_range(inum, 0, (const char*)&h, sizeof(h));
+    modified = true;
+}
+
+// Take a freed slot or a new one at the end of file. Return 0 if the file is full.
+uint32_t hashed_dir::alloc_slot()
+{
+    if (h.free_slot) {
+        slot s;
+        uint32_t n = h.free_slot;
+        read_slot(n, s);
+        h.free_slot = s.next;
+        return n;
+    }
+
+    if (h.nslots < DIR_MAX_SLOTS)
+        return h.nslots++;
+
+    return 0;
+}
+
+void hashed_dir::free_slot(uint32_t n, slot &s)
+{
+    s.used = 0;
+    s.next = h.free_slot;
+    write_slot(n, s);
+    h.free_slot = n;
+}
+
+// Rewrite a directory in the flat layout in the hashed one. Return false if it does not fit.
+bool hashed_dir::convert()
+{
+    if (!legacy)
+        return true;
+
+    std::string content;
+    std::vector<entry> entries;
+
+    im->read_file(inum, content);
+    parse_flat(content, entries);
+    if (!build(entries, content))
+        return false;
+
+    im->write_file(inum, content.data(), content.size(), true, false);
+    memcpy(&h, content.data(), sizeof(h));
+    legacy = false;
+    modified = true;
+    return true;
+}
+
+/* Split the next bucket of linear hashing into itself and a new bucket.
+ * The entries of the bucket are repacked, so its chain does not keep the holes left by removals.
+ * Nothing is done if the new chains may not fit in the file. */
+void hashed_dir::split()
+{
+    uint32_t n = h.nbuckets;
+    uint32_t half = 1;
+    while (half * 2 <= n)
+        half *= 2;
+    uint32_t src = n - half;
+
+    // Collect the chain and its entries.
+    std::vector<uint32_t> chain;
+    std::vector<entry> entries;
+    for (uint32_t i = h.buckets[src]; i && chain.size() < DIR_MAX_SLOTS; ) {
+        slot s;
+        read_slot(i, s);
+        chain.push_back(i);
+        slot_entries(s, entries);
+        i = s.next;
+    }
+
+    // Pack the entries staying and moving into chains of their own.
+    std::vector<slot> packed[2];
+    for (int k = 0; k < 2; ++k) {
+        packed[k].push_back(slot());
+        memset(&packed[k].back(), 0, sizeof(slot));
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+        std::vector<slot> &p = packed[(hash(entries[i].name) & (2 * half - 1)) == n];
+        if (!put_entry(p.back(), entries[i])) {
+            p.push_back(slot());
+            memset(&p.back(), 0, sizeof(slot));
+            put_entry(p.back(), entries[i]);
+        }
+    }
+
+    // Freed slots are not counted, so that the new ones surely fit.
+    size_t needed = packed[0].size() + packed[1].size();
+    if (needed > chain.size() && needed - chain.size() > DIR_MAX_SLOTS - h.nslots)
+        return;
+
+    // Reuse the slots of the chain first, then free the rest of them or allocate new ones.
+    std::vector<uint32_t> numbers;
+    for (size_t i = 0; i < needed; ++i)
+        numbers.push_back(i < chain.size() ? chain[i] : alloc_slot());
+    for (size_t i = needed; i < chain.size(); ++i) {
+        slot s;
+        memset(&s, 0, sizeof(s));
+        free_slot(chain[i], s);
+    }
+
+    size_t k = 0;
+    for (int j = 0; j < 2; ++j) {
+        h.buckets[j ? n : src] = numbers[k];
+        for (size_t i = 0; i < packed[j].size(); ++i, ++k) {
+            packed[j][i].next = i + 1 < packed[j].size() ? numbers[k + 1] : 0;
+            write_slot(numbers[k], packed[j][i]);
+        }
+    }
+
+    h.nbuckets++;
+}
+
+bool hashed_dir::lookup(const std::string &name, extent_protocol::extentid_t &inum)
+{
+    if (legacy) {
+        std::string content;
+        std::vector<entry> entries;
+
+        im->read_file(this->inum, content);
+        parse_flat(content, entries);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].name == name) {
+                inum = entries[i].inum;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint32_t n = h.buckets[bucket_of(h.nbuckets, hash(name))];
+    for (uint32_t steps = 0; n && steps < DIR_MAX_SLOTS; ++steps) {
+        slot s;
+        int len;
+        read_slot(n, s);
+        if (find_entry(s, name, inum, len) >= 0)
+            return true;
+        n = s.next;
+    }
+
+    return false;
+}
+
+int hashed_dir::can_insert(const std::string &name)
+{
+    extent_protocol::extentid_t inum;
+
+    if (lookup(name, inum))
+        return extent_protocol::EXIST;
+
+    // A flat directory too large to convert takes the entry in place if it fits.
+    if (!convert()) {
+        extent_protocol::attr a;
+        im->getattr(this->inum, a);
+        return a.size + 1 + name.size() + sizeof(inum) <= MAXFILE * BLOCK_DATA_SIZE ?
+            extent_protocol::OK : extent_protocol::IOERR;
+    }
+
+    // The numbers of the entry are not known yet, room is checked for the largest ones.
+    uint32_t n = h.buckets[bucket_of(h.nbuckets, hash(name))];
+    for (uint32_t steps = 0; n && steps < DIR_MAX_SLOTS; ++steps) {
+        slot s;
+        read_slot(n, s);
+        if (s.used + entry_size(name, ~0U, ~0U) <= (int)sizeof(s.entries))
+            return extent_protocol::OK;
+        n = s.next;
+    }
+
+    return h.free_slot || h.nslots < DIR_MAX_SLOTS ? extent_protocol::OK : extent_protocol::IOERR;
+}
+
+void hashed_dir::insert(const std::string &name, extent_protocol::extentid_t inum)
+{
+    entry e;
+    e.name = name;
+    e.inum = inum;
+
+    if (legacy) {
+        std::string content;
+        std::vector<entry> entries;
+
+        im->read_file(this->inum, content);
+        parse_flat(content, entries);
+        entries.push_back(e);
+        build_flat(entries, content);
+        im->write_file(this->inum, content.data(), content.size(), true, false);
+        modified = true;
+        return;
+    }
+
+    e.seq = h.next_seq++;
+
+    // Put the entry in the first slot of the chain with room for it, or in a new slot at its end.
+    slot s;
+    uint32_t n = h.buckets[bucket_of(h.nbuckets, hash(name))];
+    for (uint32_t steps = 0; steps < DIR_MAX_SLOTS; ++steps) {
+        read_slot(n, s);
+        if (put_entry(s, e)) {
+            write_slot(n, s);
+            break;
+        }
+        if (!s.next) {
+            slot ns;
+            memset(&ns, 0, sizeof(ns));
+            put_entry(ns, e);
+            s.next = alloc_slot();
+            write_slot(s.next, ns);
+            write_slot(n, s);
+            break;
+        }
+        n = s.next;
+    }
+
+    h.nentries++;
+    h.bytes += entry_size(name, e.inum, e.seq);
+    if (h.bytes > h.nbuckets * DIR_SPLIT_BYTES && h.nbuckets < DIR_MAX_BUCKETS)
+        split();
+    write_header();
+}
+
+int hashed_dir::remove(const std::string &name, extent_protocol::extentid_t &inum)
+{
+    if (!lookup(name, inum))
+        return extent_protocol::NOENT;
+
+    // Shrinking a flat directory cannot fail, so it is not converted.
+    if (legacy) {
+        std::string content;
+        std::vector<entry> entries;
+
+        im->read_file(this->inum, content);
+        parse_flat(content, entries);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].name == name) {
+                entries.erase(entries.begin() + i);
+                break;
+            }
+        }
+        build_flat(entries, content);
+        im->write_file(this->inum, content.data(), content.size(), true, false);
+        modified = true;
+        return extent_protocol::OK;
+    }
+
+    slot s, prev;
+    uint32_t n = h.buckets[bucket_of(h.nbuckets, hash(name))], prev_n = 0;
+    for (uint32_t steps = 0; n && steps < DIR_MAX_SLOTS; ++steps) {
+        int pos, len;
+
+        read_slot(n, s);
+        if ((pos = find_entry(s, name, inum, len)) >= 0) {
+            memmove(s.entries + pos, s.entries + pos + len, s.used - pos - len);
+            s.used -= len;
+            memset(s.entries + s.used, 0, len);
+
+            // Unlink a slot left empty from the chain, unless it is the first one.
+            if (s.used == 0 && prev_n) {
+                prev.next = s.next;
+                write_slot(prev_n, prev);
+                free_slot(n, s);
+            } else {
+                write_slot(n, s);
+            }
+
+            h.nentries--;
+            h.bytes -= len;
+            write_header();
+            return extent_protocol::OK;
+        }
+
+        prev = s;
+        prev_n = n;
+        n = s.next;
+    }
+
+    return extent_protocol::NOENT;
+}
+
+static bool seq_less(const std::pair<uint32_t, extent_protocol::dirent> &x,
+        const std::pair<uint32_t, extent_protocol::dirent> &y)
+{
+    return x.first < y.first;
+}
+
+void hashed_dir::list(const std::string &content, std::vector<extent_protocol::dirent> &list)
+{
+    std::vector<entry> entries;
+
+    list.clear();
+
+    if (content.size() >= sizeof(header) && ((const header*)content.data())->magic == DIR_MAGIC) {
+        header ch;
+        memcpy(&ch, content.data(), sizeof(ch));
+        uint32_t nbuckets = ch.nbuckets < DIR_MAX_BUCKETS ? ch.nbuckets : DIR_MAX_BUCKETS;
+
+        for (uint32_t b = 0; b < nbuckets; ++b) {
+            uint32_t n = ch.buckets[b];
+            for (uint32_t steps = 0; n && steps < DIR_MAX_SLOTS; ++steps) {
+                slot s;
+                memset(&s, 0, sizeof(s));
+                if ((size_t)n * DIR_SLOT_SIZE < content.size())
+                    memcpy(&s, content.data() + n * DIR_SLOT_SIZE,
+                            std::min(sizeof(s), content.size() - n * DIR_SLOT_SIZE));
+                slot_entries(s, entries);
+                n = s.next;
+            }
+        }
+    } else {
+        parse_flat(content, entries);
+    }
+
+    std::vector<std::pair<uint32_t, extent_protocol::dirent> > sorted(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        sorted[i].first = entries[i].seq;
+        sorted[i].second.name = entries[i].name;
+        sorted[i].second.inum = entries[i].inum;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), seq_less);
+
+    for (size_t i = 0; i < sorted.size(); ++i)
+        list.push_back(sorted[i].second);
+}
@@ -0,0 +1,103 @@
+// hashed directory layout.
+
+#ifndef hashed_dir_h
+#define hashed_dir_h
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "extent_protocol.h"
+#include "inode_manager.h"
+
+#define DIR_SLOT_SIZE 512 // Bytes of a slot, the unit a directory is read and written in.
+#define DIR_MAX_SLOTS (MAXFILE * BLOCK_DATA_SIZE / DIR_SLOT_SIZE) // Slots that fit in the largest file.
+#define DIR_MAX_BUCKETS (DIR_MAX_SLOTS / 6) // Buckets of the largest table, whose chains are about 6 slots long.
+#define DIR_SPLIT_BYTES 384 // Average bytes of entries per bucket above which a bucket is split.
+#define DIR_MAGIC 0x52494400 // "\0DIR", a first byte no entry of the flat layout can start with.
+
+/* A directory stored as a hash table with linear hashing, in slots of DIR_SLOT_SIZE bytes.
+ * Slot 0 is the header, which maps each bucket to the first slot of its chain. A bucket slot holds
+ * entries |<name length>|<name>|<inum>|<sequence number>| and the number of the next slot of the chain.
+ * The numbers are variable-length integers of 7 bits per byte, 2 bytes for most of them.
+ * The table grows by splitting one bucket at a time, so lookup, insert and remove read and write
+ * the header and one chain only. Entries are listed in the order they were inserted.
+ * A chain fills its slots before taking another, so the table stops growing at DIR_MAX_BUCKETS buckets
+ * and lets its chains grow instead: a full file holds more entries than the flat layout, whose inums take 8 bytes.
+ *
+ * Directories in the older flat layout of |<name length>|<name>|<inum, 8 bytes>| entries are still read,
+ * and converted to this layout when first inserted into. Entries are removed from them in place,
+ * and inserted in place if the converted directory would not fit in a file. An empty file is an empty directory.
+ * The caller serializes all operations on a directory.
+ */
+class hashed_dir {
+private:
+    struct header {
+        uint32_t magic;
+        uint32_t nbuckets;
+        uint32_t nentries;
+        uint32_t bytes; // Bytes of all entries.
+        uint32_t next_seq; // Sequence number of the next inserted entry.
+        uint32_t nslots; // Slots in the file, including the header and freed slots.
+        uint32_t free_slot; // First slot of the list of freed slots, linked by next, 0 if none.
+        uint16_t buckets[DIR_MAX_BUCKETS]; // First slot of each bucket.
+    };
+
+    struct slot {
+        uint16_t used; // Bytes of entries.
+        uint16_t next; // Next slot of the chain, 0 if last.
+        char entries[DIR_SLOT_SIZE - 2 * sizeof(uint16_t)];
+    };
+
+    struct entry {
+        std::string name;
+        extent_protocol::extentid_t inum;
+        uint32_t seq;
+    };
+
+    inode_manager *im;
+    uint32_t inum;
+    header h;
+    bool legacy; // The directory is in the flat layout.
+    bool modified; // The file has been written.
+
+    static uint32_t hash(const std::string &name);
+    static uint32_t bucket_of(uint32_t nbuckets, uint32_t hash);
+    static int varint_size(uint32_t v);
+    static int put_varint(char *p, uint32_t v);
+    static int get_varint(const char *p, int avail, uint32_t &v);
+    static int entry_size(const std::string &name, uint32_t inum, uint32_t seq);
+    static int parse_entry(const slot &s, int pos, entry &e);
+    static int find_entry(const slot &s, const std::string &name, extent_protocol::extentid_t &inum, int &len);
+    static void slot_entries(const slot &s, std::vector<entry> &entries);
+    static bool put_entry(slot &s, const entry &e);
+    static void parse_flat(const std::string &content, std::vector<entry> &entries);
+    static void build_flat(const std::vector<entry> &entries, std::string &content);
+    static bool build(const std::vector<entry> &entries, std::string &content);
+
+    void read_slot(uint32_t n, slot &s);
+    void write_slot(uint32_t n, const slot &s);
+    void write_header();
+    uint32_t alloc_slot();
+    void free_slot(uint32_t n, slot &s);
+    bool convert();
+    void split();
+
+public:
+    hashed_dir(inode_manager *im, uint32_t inum);
+
+    bool lookup(const std::string &name, extent_protocol::extentid_t &inum);
+    /* Check that name can be inserted, converting a flat directory first if it fits.
+     * Return EXIST if name exists, or IOERR if the directory is full. */
+    int can_insert(const std::string &name);
+    // Insert an entry for name after can_insert() returned OK for it.
+    void insert(const std::string &name, extent_protocol::extentid_t inum);
+    // Remove the entry of name and set inum. Return NOENT if not found.
+    int remove(const std::string &name, extent_protocol::extentid_t &inum);
+    // Whether the file has been written, including by a conversion.
+    bool changed() const { return modified; }
+
+    // List the entries of a directory of either layout from its whole content, in insertion order.
+    static void list(const std::string &content, std::vector<extent_protocol::dirent> &list);
+};
+
+#endif
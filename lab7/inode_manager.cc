@@ -1,5 +1,7 @@
 #include <pthread.h>
 #include "inode_manager.h"
+#include "compress.h"
+#include "parity.h"
 
 // Extract a bit from a byte (b0b1b2b3b4b5b6b7) at the given position.
 inline bool get_bit(byte c, int pos)
@@ -62,18 +64,36 @@ inline void decode2to8(byte data, bool &b0, bool &b1)
     }
 }
 
+// Encode a byte to 4 bytes at enc.
+inline void encode_byte(byte b, byte *enc)
+{
+    enc[0] = encode2to8(get_bit(b, 0), get_bit(b, 1));
+    enc[1] = encode2to8(get_bit(b, 2), get_bit(b, 3));
+    enc[2] = encode2to8(get_bit(b, 4), get_bit(b, 5));
+    enc[3] = encode2to8(get_bit(b, 6), get_bit(b, 7));
+}
+
+// Decode 4 bytes at enc to a byte.
+inline byte decode_byte(const byte *enc)
+{
+    bool b0, b1, b2, b3, b4, b5, b6, b7;
+    decode2to8(enc[0], b0, b1);
+    decode2to8(enc[1], b2, b3);
+    decode2to8(enc[2], b4, b5);
+    decode2to8(enc[3], b6, b7);
+    return construct_byte(b0, b1, b2, b3, b4, b5, b6, b7);
+}
+
 // Apply encode2to8 to byte stream.
 std::string encode_data(const std::string &data)
 {
     std::string result;
     int len = data.length();
+    byte enc[ENCODE_FACTOR];
 
     for (int i = 0; i < len; ++i) {
-        byte b = data[i];
-        result.push_back(encode2to8(get_bit(b, 0), get_bit(b, 1)));
-        result.push_back(encode2to8(get_bit(b, 2), get_bit(b, 3)));
-        result.push_back(encode2to8(get_bit(b, 4), get_bit(b, 5)));
-        result.push_back(encode2to8(get_bit(b, 6), get_bit(b, 7)));
+        encode_byte(data[i], enc);
+        result.append((const char*)enc, ENCODE_FACTOR);
     }
 
     return result;
@@ -90,14 +110,9 @@ std::string decode_data(const std::string &data)
 
     int parts = len / 4;
     std::string result;
-    for (int i = 0; i < parts; ++i) {
-        bool b0, b1, b2, b3, b4, b5, b6, b7;
-        decode2to8(data[i * 4], b0, b1);
-        decode2to8(data[i * 4 + 1], b2, b3);
-        decode2to8(data[i * 4 + 2], b4, b5);
-        decode2to8(data[i * 4 + 3], b6, b7);
-        result.push_back(construct_byte(b0, b1, b2, b3, b4, b5, b6, b7));
-    }
+    const byte *enc = (const byte*)data.data();
+    for (int i = 0; i < parts; ++i)
+        result.push_back(decode_byte(enc + i * 4));
 
     return result;
 }
@@ -318,6 +333,37 @@ blockid_t block_manager::alloc_block()
     return newid;
 }
 
+// Allocate n free disk blocks in a row. Return the first one, or 0 if there is no such room.
+uint32_t block_manager::alloc_blocks(uint32_t n)
+{
+    char bitmap[BITMAP_BLOCKS * BLOCK_SIZE];
+    uint32_t start = 0, run = 0;
+
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+    decode_bitmap_all();
+
+    for (int i = 0; i < BITMAP_BLOCKS; ++i)
+        read_block(BBLOCK(i * BPB), bitmap + i * BLOCK_SIZE);
+
+    for (uint32_t id = RESERVED_BLOCKS_NUM; id < BLOCK_NUM && run < n; ++id) {
+        if (bitmap[id / 8] & (1 << (id % 8))) {
+            run = 0;
+        } else if (run++ == 0) {
+            start = id;
+        }
+    }
+
+    if (run == n) {
+        for (uint32_t id = start; id < start + n; ++id)
+            mark_as_allocated(id);
+    }
+
+    encode_bitmap_all();
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+
+    return run == n ? start : 0;
+}
+
 void block_manager::free_block(uint32_t id)
 {
     /*
@@ -329,6 +375,20 @@ void block_manager::free_block(uint32_t id)
         return;
 
     assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+
+    // A shared block is only freed when its last reference is dropped.
+    std::map<uint32_t, int>::iterator it = using_blocks.find(id);
+    if (it != using_blocks.end()) {
+        if (--it->second == 1)
+            using_blocks.erase(it);
+        assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+        return;
+    }
+
+#if DEDUP
+    unindex_block_p(id);
+#endif
+
     decode_bitmap(BBLOCK(id));
 
     mark_as_free(id);
@@ -337,6 +397,203 @@ void block_manager::free_block(uint32_t id)
     assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
 }
 
+// Add a reference to an allocated block, which is then shared.
+void block_manager::ref_block(uint32_t id)
+{
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+
+    std::map<uint32_t, int>::iterator it = using_blocks.find(id);
+    if (it == using_blocks.end())
+        using_blocks[id] = 2;
+    else
+        it->second++;
+
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+}
+
+/* Prepare block id to be overwritten by one of its users (copy-on-write).
+ * Return id itself if it is not shared, otherwise drop a reference to it and return a new block. */
+uint32_t block_manager::unshare_block(uint32_t id)
+{
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+
+    std::map<uint32_t, int>::iterator it = using_blocks.find(id);
+    if (it == using_blocks.end()) {
+        assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+        return id;
+    }
+
+    if (--it->second == 1)
+        using_blocks.erase(it);
+
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+
+    return alloc_block();
+}
+
+/* Write a whole data block in place of block id of a file. Return the block now holding the data,
+ * which is a private copy if id is shared, or a block with the same content if deduplication finds one. */
+uint32_t block_manager::write_data_block(uint32_t id, const char *buf)
+{
+#if DEDUP
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t hash = hash_block(buf);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+
+    dedup_writes++;
+    dedup_hash_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+
+    // Compare the contents too, hashes may collide and indexed blocks may have been damaged since.
+    std::map<uint64_t, uint32_t>::iterator it = dedup_index.find(hash);
+    if (it != dedup_index.end())
+        prepare_block(it->second);
+    if (it != dedup_index.end() && memcmp(d->blocks[it->second], buf, BLOCK_SIZE) == 0) {
+        uint32_t dup = it->second;
+        dedup_hits++;
+
+        if (dup == id) { // Nothing changes.
+            assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+            return id;
+        }
+
+        if (using_blocks.find(dup) == using_blocks.end())
+            using_blocks[dup] = 2;
+        else
+            using_blocks[dup]++;
+
+        assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+
+        free_block(id); // Drop the reference to the old block.
+        return dup;
+    }
+
+    // The content of id is about to change, stop others from sharing it meanwhile.
+    if (using_blocks.find(id) == using_blocks.end())
+        unindex_block_p(id);
+
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+#endif
+
+    id = unshare_block(id);
+    write_block(id, buf);
+
+#if DEDUP
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+    index_block_p(id, hash);
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+#endif
+
+    return id;
+}
+
+#if DEDUP
+// 64-bit FNV-1a hash of a block.
+uint64_t block_manager::hash_block(const char *buf)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+        hash ^= (byte)buf[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Add a block to the deduplication index. The caller should hold block_manager_mutex.
+void block_manager::index_block_p(uint32_t id, uint64_t hash)
+{
+    unindex_block_p(id);
+    dedup_index[hash] = id;
+    dedup_hashes[id] = hash;
+}
+
+// Remove a block from the deduplication index. The caller should hold block_manager_mutex.
+void block_manager::unindex_block_p(uint32_t id)
+{
+    std::map<uint32_t, uint64_t>::iterator it = dedup_hashes.find(id);
+    if (it == dedup_hashes.end())
+        return;
+
+    std::map<uint64_t, uint32_t>::iterator iit = dedup_index.find(it->second);
+    if (iit != dedup_index.end() && iit->second == id)
+        dedup_index.erase(iit);
+    dedup_hashes.erase(it);
+}
+#endif
+
+/* Replace the reference counts of all data blocks, counted from the inodes.
+ * Used when the disk is replaced as a whole, e.g. by version control operations. */
+void block_manager::set_refs(const std::map<uint32_t, int> &refs)
+{
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+
+    using_blocks.clear();
+#if DEDUP
+    dedup_index.clear();
+    dedup_hashes.clear();
+#endif
+
+    for (std::map<uint32_t, int>::const_iterator it = refs.begin(); it != refs.end(); ++it) {
+        if (it->second > 1)
+            using_blocks.insert(*it);
+#if DEDUP
+        index_block_p(it->first, hash_block((const char*)d->blocks[it->first]));
+#endif
+    }
+
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+}
+
+// Add the counters of block sharing to stats.
+void block_manager::get_stats(std::map<std::string, unsigned long long> &stats)
+{
+    assert(pthread_mutex_lock(&block_manager_mutex) == 0);
+
+    unsigned long long saved = 0;
+    for (std::map<uint32_t, int>::iterator it = using_blocks.begin(); it != using_blocks.end(); ++it)
+        saved += it->second - 1;
+
+    stats["shared_blocks"] = using_blocks.size();
+    stats["shared_blocks_saved"] = saved; // Blocks that would be used if nothing were shared.
+    stats["ndisks"] = sb.ndisks;
+    stats["stripe_blocks"] = sb.stripe_blocks;
+#if PARITY_DISKS
+    assert(pthread_mutex_lock(&lost_mutex) == 0);
+    stats["parity_disks"] = PARITY_DISKS;
+    stats["parity_lost_blocks"] = lost_blocks();
+    stats["parity_degraded_reads"] = degraded_reads;
+    stats["parity_rebuilt_blocks"] = rebuilt_blocks;
+    assert(pthread_mutex_unlock(&lost_mutex) == 0);
+#endif
+#if DEDUP
+    stats["dedup_block_writes"] = dedup_writes;
+    stats["dedup_block_hits"] = dedup_hits;
+    stats["dedup_hit_rate_percent"] = dedup_writes ? dedup_hits * 100 / dedup_writes : 0;
+    stats["dedup_hash_ns"] = dedup_hash_ns;
+    stats["dedup_hash_ns_per_write"] = dedup_writes ? dedup_hash_ns / dedup_writes : 0;
+    stats["dedup_indexed_blocks"] = dedup_hashes.size();
+#endif
+
+    assert(pthread_mutex_unlock(&block_manager_mutex) == 0);
+
+    // Jobs and blocks handled by the worker of every stripe column.
+    for (int i = 0; i < NDISKS; ++i) {
+        char key[32];
+
+        assert(pthread_mutex_lock(&workers[i].mutex) == 0);
+        sprintf(key, "stripe%d_jobs", i);
+        stats[key] = workers[i].requests;
+        sprintf(key, "stripe%d_blocks", i);
+        stats[key] = workers[i].blocks;
+        assert(pthread_mutex_unlock(&workers[i].mutex) == 0);
+    }
+}
+
 // The layout of disk is like this:
 // |<-boot->|<-sb->|<-free block bitmap->|<-inode table->|<-bitmap encoding->|<-inode table encoding->|<-data->|
 block_manager::block_manager()
@@ -344,11 +601,28 @@ block_manager::block_manager()
     d = new disk();
 
     assert(pthread_mutex_init(&block_manager_mutex, NULL) == 0);
+#if DEDUP
+    dedup_writes = dedup_hits = dedup_hash_ns = 0;
+#endif
+#if PARITY_DISKS
+    // The parity of an empty disk is all zeros.
+    for (int i = 0; i < PARITY_DISKS; ++i)
+        parity[i] = (unsigned char*)calloc(PARITY_BLOCKS, BLOCK_SIZE);
+    for (int i = 0; i < PARITY_LOCKS; ++i)
+        assert(pthread_mutex_init(&row_locks[i], NULL) == 0);
+    assert(pthread_mutex_init(&lost_mutex, NULL) == 0);
+    lost.assign(BLOCK_NUM, 0);
+    lost_count = lost_disks = 0;
+    degraded_reads = rebuilt_blocks = 0;
+    rebuild_started = rebuild_running = false;
+#endif
 
     // format the disk
     sb.size = BLOCK_SIZE * BLOCK_NUM;
     sb.nblocks = BLOCK_NUM;
     sb.ninodes = INODE_NUM;
+    sb.ndisks = NDISKS;
+    sb.stripe_blocks = STRIPE_BLOCKS;
 
     // Write super block.
     char buf[BLOCK_SIZE];
@@ -359,22 +633,363 @@ block_manager::block_manager()
     // Mark reserved blocks as allocated.
     mark_as_allocated_batch(RESERVED_BLOCKS_NUM);
     encode_bitmap_all();
+
+    // Start the workers of the stripe columns.
+    for (int i = 0; i < NDISKS; ++i) {
+        stripe_worker &w = workers[i];
+        assert(pthread_mutex_init(&w.mutex, NULL) == 0);
+        assert(pthread_cond_init(&w.cond, NULL) == 0);
+        w.stop = false;
+        w.requests = w.blocks = 0;
+        assert(pthread_create(&w.thread, NULL, worker_thread, &w) == 0);
+    }
 }
 
 block_manager::~block_manager()
 {
+    for (int i = 0; i < NDISKS; ++i) {
+        stripe_worker &w = workers[i];
+
+        assert(pthread_mutex_lock(&w.mutex) == 0);
+        w.stop = true;
+        assert(pthread_cond_signal(&w.cond) == 0);
+        assert(pthread_mutex_unlock(&w.mutex) == 0);
+
+        assert(pthread_join(w.thread, NULL) == 0);
+        assert(pthread_cond_destroy(&w.cond) == 0);
+        assert(pthread_mutex_destroy(&w.mutex) == 0);
+    }
+
+#if PARITY_DISKS
+    if (rebuild_started) // It stops when everything is rebuilt.
+        assert(pthread_join(rebuild_thread, NULL) == 0);
+    for (int i = 0; i < PARITY_DISKS; ++i)
+        free(parity[i]);
+    for (int i = 0; i < PARITY_LOCKS; ++i)
+        assert(pthread_mutex_destroy(&row_locks[i]) == 0);
+    assert(pthread_mutex_destroy(&lost_mutex) == 0);
+#endif
+
     assert(pthread_mutex_destroy(&block_manager_mutex) == 0);
     delete d;
 }
 
+// Run the requests queued for a stripe column until it is stopped.
+void* block_manager::worker_thread(void *arg)
+{
+    stripe_worker *w = (stripe_worker*)arg;
+
+    assert(pthread_mutex_lock(&w->mutex) == 0);
+
+    while (true) {
+        while (w->queue.empty() && !w->stop)
+            assert(pthread_cond_wait(&w->cond, &w->mutex) == 0);
+
+        if (w->queue.empty())
+            break;
+
+        stripe_request r = w->queue.front();
+        w->queue.pop_front();
+        w->requests++;
+        w->blocks += r.items.size();
+
+        assert(pthread_mutex_unlock(&w->mutex) == 0);
+
+        for (size_t i = 0; i < r.items.size(); ++i)
+            r.job->run(r.items[i]);
+
+        assert(pthread_mutex_lock(&r.batch->mutex) == 0);
+        if (--r.batch->pending == 0)
+            assert(pthread_cond_signal(&r.batch->cond) == 0);
+        assert(pthread_mutex_unlock(&r.batch->mutex) == 0);
+
+        assert(pthread_mutex_lock(&w->mutex) == 0);
+    }
+
+    assert(pthread_mutex_unlock(&w->mutex) == 0);
+
+    return NULL;
+}
+
+/* Run job on the blocks bids[first..last), each by the worker of its stripe column, and wait for all of them.
+ * Few blocks are not worth handing over to other threads, the job is run by the caller then. */
+void block_manager::run_striped(const blockid_t *bids, int first, int last, block_job *job)
+{
+    if (last - first < PARALLEL_MIN_BLOCKS) {
+        for (int i = first; i < last; ++i)
+            job->run(i);
+        return;
+    }
+
+    std::vector<int> items[NDISKS];
+    stripe_batch batch;
+
+    for (int i = first; i < last; ++i)
+        items[disk_of(bids[i])].push_back(i);
+
+    assert(pthread_mutex_init(&batch.mutex, NULL) == 0);
+    assert(pthread_cond_init(&batch.cond, NULL) == 0);
+    batch.pending = 0;
+    for (int i = 0; i < NDISKS; ++i)
+        if (!items[i].empty())
+            batch.pending++;
+
+    for (int i = 0; i < NDISKS; ++i) {
+        if (items[i].empty())
+            continue;
+
+        stripe_request r;
+        r.job = job;
+        r.batch = &batch;
+        r.items.swap(items[i]);
+
+        assert(pthread_mutex_lock(&workers[i].mutex) == 0);
+        workers[i].queue.push_back(r);
+        assert(pthread_cond_signal(&workers[i].cond) == 0);
+        assert(pthread_mutex_unlock(&workers[i].mutex) == 0);
+    }
+
+    assert(pthread_mutex_lock(&batch.mutex) == 0);
+    while (batch.pending)
+        assert(pthread_cond_wait(&batch.cond, &batch.mutex) == 0);
+    assert(pthread_mutex_unlock(&batch.mutex) == 0);
+
+    assert(pthread_cond_destroy(&batch.cond) == 0);
+    assert(pthread_mutex_destroy(&batch.mutex) == 0);
+}
+
 void block_manager::read_block(uint32_t id, char *buf)
 {
+    prepare_block(id);
     d->read_block(id, buf);
 }
 
 void block_manager::write_block(uint32_t id, const char *buf)
 {
-    d->write_block(id, buf);
+    write_partial(id, 0, buf, BLOCK_SIZE);
+}
+
+/* Write len bytes of block id starting at byte off, leaving the rest of the block as it is.
+ * The parity is updated by the change of the written bytes, in the same hold of the row lock as the write,
+ * so a disk replaced meanwhile cannot lose it. */
+void block_manager::write_partial(uint32_t id, unsigned int off, const char *buf, unsigned int len)
+{
+#if PARITY_DISKS
+    uint32_t p = parity_of(id);
+
+    assert(pthread_mutex_lock(row_lock(p)) == 0);
+    if (lost_blocks())
+        recover_row_p(p);
+    parity_update(disk_of(id), d->blocks[id] + off, (const unsigned char*)buf, len, parity[0] + p * BLOCK_SIZE + off,
+        PARITY_DISKS > 1 ? parity[PARITY_DISKS - 1] + p * BLOCK_SIZE + off : NULL);
+    memcpy(d->blocks[id] + off, buf, len);
+    assert(pthread_mutex_unlock(row_lock(p)) == 0);
+#else
+    memcpy(d->blocks[id] + off, buf, len);
+#endif
+}
+
+#if PARITY_DISKS
+/* Rebuild the lost blocks of the row of parity block p from the others and the parity.
+ * The caller should hold the lock of the row. */
+void block_manager::recover_row_p(uint32_t p)
+{
+    unsigned char *data[NDISKS];
+    int lost_k[NDISKS], n = 0;
+
+    for (int k = 0; k < NDISKS; ++k) {
+        uint32_t id = row_member(p, k);
+        data[k] = d->blocks[id];
+        if (lost[id])
+            lost_k[n++] = k;
+    }
+
+    if (!n)
+        return;
+
+    if (n > PARITY_DISKS) {
+        printf("\tbm: %d blocks of stripe row %u lost, cannot rebuild\n", n, p);
+    } else {
+        parity_recover(data, NDISKS, BLOCK_SIZE, parity[0] + p * BLOCK_SIZE,
+            PARITY_DISKS > 1 ? parity[PARITY_DISKS - 1] + p * BLOCK_SIZE : NULL, lost_k[0], n > 1 ? lost_k[1] : -1);
+    }
+
+    for (int i = 0; i < n; ++i)
+        lost[row_member(p, lost_k[i])] = 0;
+
+    assert(pthread_mutex_lock(&lost_mutex) == 0);
+    rebuilt_blocks += n;
+    if (!__sync_sub_and_fetch(&lost_count, n))
+        lost_disks = 0;
+    assert(pthread_mutex_unlock(&lost_mutex) == 0);
+}
+
+/* Compute the parity of the row of parity block p from its blocks.
+ * The caller should hold the lock of the row. */
+void block_manager::compute_parity_p(uint32_t p)
+{
+    const unsigned char *data[NDISKS];
+
+    for (int k = 0; k < NDISKS; ++k)
+        data[k] = d->blocks[row_member(p, k)];
+
+    parity_compute(data, NDISKS, BLOCK_SIZE, parity[0] + p * BLOCK_SIZE,
+        PARITY_DISKS > 1 ? parity[PARITY_DISKS - 1] + p * BLOCK_SIZE : NULL);
+}
+
+// Rebuild the lost blocks row by row, until there are none.
+void* block_manager::rebuild_main(void *arg)
+{
+    block_manager *bm = (block_manager*)arg;
+
+    while (true) {
+        for (uint32_t p = 0; p < PARITY_BLOCKS && bm->lost_blocks(); ++p) {
+            assert(pthread_mutex_lock(bm->row_lock(p)) == 0);
+            bm->recover_row_p(p);
+            assert(pthread_mutex_unlock(bm->row_lock(p)) == 0);
+        }
+
+        assert(pthread_mutex_lock(&bm->lost_mutex) == 0);
+        if (!bm->lost_blocks()) {
+            bm->rebuild_running = false;
+            assert(pthread_mutex_unlock(&bm->lost_mutex) == 0);
+            break;
+        }
+        assert(pthread_mutex_unlock(&bm->lost_mutex) == 0);
+    }
+
+    printf("\tbm: rebuild finished\n");
+
+    return NULL;
+}
+#endif
+
+/* Make block id ready to be accessed directly. If its row has lost blocks, they are rebuilt first (a degraded read),
+ * as the parity of the row cannot be updated without them. */
+void block_manager::prepare_block(uint32_t id)
+{
+#if PARITY_DISKS
+    if (!lost_blocks()) // Nothing is lost, the usual case.
+        return;
+
+    uint32_t p = parity_of(id);
+
+    assert(pthread_mutex_lock(row_lock(p)) == 0);
+    bool degraded = lost[id];
+    recover_row_p(p);
+    assert(pthread_mutex_unlock(row_lock(p)) == 0);
+
+    if (degraded) {
+        assert(pthread_mutex_lock(&lost_mutex) == 0);
+        degraded_reads++;
+        assert(pthread_mutex_unlock(&lost_mutex) == 0);
+    }
+#endif
+}
+
+// Compute the parity of the row of block id again after the block was changed in place, not by write_block().
+void block_manager::update_parity(uint32_t id)
+{
+#if PARITY_DISKS
+    uint32_t p = parity_of(id);
+
+    assert(pthread_mutex_lock(row_lock(p)) == 0);
+    recover_row_p(p);
+    compute_parity_p(p);
+    assert(pthread_mutex_unlock(row_lock(p)) == 0);
+#endif
+}
+
+/* Replace disk i (a parity disk if i >= NDISKS) with an empty one, and rebuild its content.
+ * Data disks are rebuilt in the background, their blocks are rebuilt on demand until then.
+ * Return false if i is not a disk, or more disks would be lost than the parity can rebuild. */
+bool block_manager::replace_disk(int i)
+{
+#if PARITY_DISKS
+    if (i < 0 || i >= NDISKS + PARITY_DISKS)
+        return false;
+
+    if (i >= NDISKS) { // The parity is computed again from the data.
+        finish_rebuild();
+        memset(parity[i - NDISKS], 0, PARITY_BLOCKS * BLOCK_SIZE);
+        rebuild_parity();
+        return true;
+    }
+
+    assert(pthread_mutex_lock(&lost_mutex) == 0);
+    if (lost_disks >= PARITY_DISKS) {
+        assert(pthread_mutex_unlock(&lost_mutex) == 0);
+        return false;
+    }
+    lost_disks++;
+    assert(pthread_mutex_unlock(&lost_mutex) == 0);
+
+    for (uint32_t p = 0; p < PARITY_BLOCKS; ++p) {
+        uint32_t id = row_member(p, i);
+
+        assert(pthread_mutex_lock(row_lock(p)) == 0);
+        if (!lost[id]) {
+            memset(d->blocks[id], 0, BLOCK_SIZE);
+            lost[id] = 1;
+            __sync_fetch_and_add(&lost_count, 1);
+        }
+        assert(pthread_mutex_unlock(row_lock(p)) == 0);
+    }
+
+    printf("\tbm: disk %d replaced, rebuilding %d blocks\n", i, lost_blocks());
+
+    assert(pthread_mutex_lock(&lost_mutex) == 0);
+    if (!rebuild_running) {
+        if (rebuild_started)
+            assert(pthread_join(rebuild_thread, NULL) == 0);
+        rebuild_started = rebuild_running = true;
+        assert(pthread_create(&rebuild_thread, NULL, rebuild_main, this) == 0);
+    }
+    assert(pthread_mutex_unlock(&lost_mutex) == 0);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Rebuild all the lost blocks now, e.g. before the disk is saved as a whole.
+void block_manager::finish_rebuild()
+{
+#if PARITY_DISKS
+    for (uint32_t p = 0; p < PARITY_BLOCKS && lost_blocks(); ++p) {
+        assert(pthread_mutex_lock(row_lock(p)) == 0);
+        recover_row_p(p);
+        assert(pthread_mutex_unlock(row_lock(p)) == 0);
+    }
+#endif
+}
+
+// Compute all the parity again, when the disk is replaced as a whole, e.g. by version control operations.
+void block_manager::rebuild_parity()
+{
+#if PARITY_DISKS
+    for (uint32_t p = 0; p < PARITY_BLOCKS; ++p) {
+        assert(pthread_mutex_lock(row_lock(p)) == 0);
+
+        // Nothing is lost from a disk loaded as a whole.
+        int n = 0;
+        for (int k = 0; k < NDISKS; ++k) {
+            uint32_t id = row_member(p, k);
+            n += lost[id];
+            lost[id] = 0;
+        }
+        if (n) {
+            assert(pthread_mutex_lock(&lost_mutex) == 0);
+            if (!__sync_sub_and_fetch(&lost_count, n))
+                lost_disks = 0;
+            assert(pthread_mutex_unlock(&lost_mutex) == 0);
+        }
+
+        compute_parity_p(p);
+        assert(pthread_mutex_unlock(row_lock(p)) == 0);
+    }
+#endif
 }
 
 // inode layer -----------------------------------------
@@ -384,7 +999,14 @@ inode_manager::inode_manager()
     bm = new block_manager();
 
     assert(pthread_mutex_init(&inode_manager_mutex, NULL) == 0);
+#if COMPRESS
+    compress_in_bytes = compress_out_bytes = compress_ns = decompress_ns = decompress_errors = 0;
+    decompress_bytes = 0;
+#endif
+    corrected_bytes = 0;
     encode_inode_table_all();
+    next_inum = 1;
+    free_inodes = INODE_NUM - 1; // Inode number INODE_NUM is never allocated.
 
     uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
     if (root_dir != 1) {
@@ -465,7 +1087,7 @@ void inode_manager::decode_inode_table(uint32_t iblock)
 }
 
 /* Create a new file.
- * Return its inum. */
+ * Return its inum, or 0 if the inode table is full and cannot grow. */
 uint32_t inode_manager::alloc_inode(uint32_t type)
 {
     /*
@@ -476,37 +1098,48 @@ uint32_t inode_manager::alloc_inode(uint32_t type)
      * if you get some heap memory, do not forget to free it.
      */
 
-    int newinum = 0;
-    int pos;
-    char buf[BLOCK_SIZE];
-    inode_t *ino;
+    uint32_t newinum;
+    inode_t ino;
+    bool found = false;
 
     assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
-    decode_inode_table_all();
+    newinum = next_inum;
 
-    // Find the least available inode number.
-    do {
-        ++newinum;
-        pos = IBLOCK(newinum, bm->sb.nblocks);
-        bm->read_block(pos, buf);
-        ino = (inode_t*)buf + (newinum - 1) % IPB;
-    } while (ino->type && newinum < INODE_NUM);
+    /* Find an available inode number, starting from the one after the last allocated.
+     * Only the probed inodes are decoded, so an allocation usually touches a single inode.
+     * The inode table grows by a chunk when it is full.
+     */
+    if (!inum_valid(newinum))
+        newinum = 1;
+
+    for (uint32_t i = 1; i < disk_sb()->ninodes && free_inodes && !found; ++i) {
+        read_inode_p(newinum, &ino);
+        if (!ino.type)
+            found = true;
+        else
+            newinum = inum_after(newinum);
+    }
 
-    if (newinum == INODE_NUM) {
-        printf("Error: no inode numbers avaliable!\n");
-        exit(-1);
+    if (!found && (newinum = grow_inode_table_p()))
+        free_inodes += INODE_CHUNK;
+
+    if (!newinum) {
+        printf("\tim: no inode numbers available\n");
+        assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+        return 0;
     }
 
     // Initialize the inode.
-    bzero(ino, sizeof(inode_t));
-    ino->type = type;
-    ino->size = 0;
-    ino->atime = (unsigned int)time(NULL);
-    ino->mtime = (unsigned int)time(NULL);
-    ino->ctime = (unsigned int)time(NULL);
-    bm->write_block(pos, buf);
-
-    encode_inode_table_all();
+    bzero(&ino, sizeof(inode_t));
+    ino.type = type;
+    ino.size = 0;
+    ino.atime = (unsigned int)time(NULL);
+    ino.mtime = (unsigned int)time(NULL);
+    ino.ctime = (unsigned int)time(NULL);
+    write_inode_p(newinum, &ino);
+
+    free_inodes--;
+    next_inum = inum_after(newinum);
     assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
 
     return newinum;
@@ -521,91 +1154,181 @@ void inode_manager::free_inode(uint32_t inum)
      * do not forget to free memory if necessary.
      */
 
-    if (inum < 1 || inum > INODE_NUM)
+    if (!inum_valid(inum))
         return;
 
-    char buf[BLOCK_SIZE];
-    int pos = IBLOCK(inum, bm->sb.nblocks);
+    inode_t ino;
 
     assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
-    decode_inode_table(pos);
 
-    bm->read_block(pos, buf);
-    inode_t *ino = (inode_t*)buf + (inum - 1) % IPB;
-    ino->type = 0; // Set inode type to 0 to mark its number as free.
-    bm->write_block(pos, buf);
+    read_inode_p(inum, &ino);
+    if (ino.type) {
+        ino.type = 0; // Set inode type to 0 to mark its number as free.
+        write_inode_p(inum, &ino);
+        free_inodes++;
+    }
 
-    encode_inode_table(pos);
     assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
 }
 
-/* Return an inode structure by inum, NULL otherwise.
- * Caller should release the memory. */
-struct inode* inode_manager::get_inode(uint32_t inum)
+// The super block as it is on disk, which is replaced by version control operations.
+superblock_t* inode_manager::disk_sb()
 {
-    struct inode *ino, *ino_disk;
-    char buf[BLOCK_SIZE];
+    bm->prepare_block(1);
+    return (superblock_t*)(bm->get_disk_ptr() + BLOCK_SIZE);
+}
 
-    printf("\tim: get_inode %d\n", inum);
+// The first blocks of the chunks of the inode table, stored right after the super block.
+blockid_t* inode_manager::inode_chunk_map()
+{
+    bm->prepare_block(1);
+    return (blockid_t*)(bm->get_disk_ptr() + BLOCK_SIZE + sizeof(superblock_t));
+}
 
-    if (inum < 1 || inum > INODE_NUM) {
-        printf("\tim: inum out of range\n");
-        return NULL;
-    }
+// Check whether inum is in the inode table, including its chunks.
+bool inode_manager::inum_valid(uint32_t inum)
+{
+    return inum >= 1 && inum <= disk_sb()->ninodes;
+}
 
-    int pos = IBLOCK(inum, bm->sb.nblocks);
+/* Return the inode number probed after inum when allocating, wrapping around at the end of the table.
+ * Inode number INODE_NUM is never allocated, as before the table could grow. */
+uint32_t inode_manager::inum_after(uint32_t inum)
+{
+    uint32_t ninodes = disk_sb()->ninodes;
 
-    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
-    decode_inode_table(pos);
+    if (inum == INODE_NUM - 1)
+        return ninodes > INODE_NUM ? INODE_NUM + 1 : 1;
+    return inum >= ninodes ? 1 : inum + 1;
+}
 
-    bm->read_block(pos, buf);
+/* Add a chunk of free inodes to the inode table. Return its first inode number, 0 if it cannot grow.
+ * The blocks of a chunk are zeroed, which is the encoding of free inodes.
+ * The caller should hold inode_manager_mutex. */
+uint32_t inode_manager::grow_inode_table_p()
+{
+    superblock_t *sb = disk_sb();
+    uint32_t chunk = (sb->ninodes - INODE_NUM) / INODE_CHUNK;
 
-    ino_disk = (struct inode*)buf + (inum - 1) % IPB;
-    if (ino_disk->type == 0) {
-        printf("\tim: inode not exist\n");
-        ino = NULL;
-    } else {
-        ino = (struct inode*)malloc(sizeof(struct inode));
-        if (!ino) {
-            printf("Error: malloc failed\n");
-            exit(-1);
-        }
+    if (chunk >= MAX_INODE_CHUNKS)
+        return 0;
 
-        *ino = *ino_disk;
-    }
+    uint32_t start = bm->alloc_blocks(INODE_CHUNK * INODE_SLOT_BLOCKS);
+    if (!start)
+        return 0;
 
-    encode_inode_table(pos);
-    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+    char zero[BLOCK_SIZE];
+    memset(zero, 0, BLOCK_SIZE);
+    for (uint32_t i = 0; i < INODE_CHUNK * INODE_SLOT_BLOCKS; ++i)
+        bm->write_block(start + i, zero);
 
-    return ino;
+    inode_chunk_map()[chunk] = start;
+    sb->ninodes += INODE_CHUNK;
+    bm->sb.ninodes = sb->ninodes;
+    bm->update_parity(1);
+
+    printf("\tim: inode table grows to %u inodes\n", sb->ninodes);
+
+    return sb->ninodes - INODE_CHUNK + 1;
 }
 
-void inode_manager::put_inode(uint32_t inum, struct inode *ino)
+/* Read inode inum from the inode table, fixing possible errors.
+ * The caller should hold inode_manager_mutex. */
+void inode_manager::read_inode_p(uint32_t inum, inode_t *ino)
 {
-    char buf[BLOCK_SIZE];
-    struct inode *ino_disk;
+    if (inum <= INODE_NUM) {
+        char buf[BLOCK_SIZE];
+        int pos = IBLOCK(inum, bm->sb.nblocks);
 
-    printf("\tim: put_inode %d\n", inum);
+        decode_inode_table(pos);
+        bm->read_block(pos, buf);
+        *ino = *((inode_t*)buf + (inum - 1) % IPB);
+        encode_inode_table(pos);
+    } else {
+        uint32_t i = inum - INODE_NUM - 1;
+        blockid_t bids[INODE_SLOT_BLOCKS];
 
-    if (inum < 1 || inum > INODE_NUM) {
-        printf("\tim: inum out of range\n");
-        return;
+        bids[0] = inode_chunk_map()[i / INODE_CHUNK] + i % INODE_CHUNK * INODE_SLOT_BLOCKS;
+        for (int j = 1; j < INODE_SLOT_BLOCKS; ++j)
+            bids[j] = bids[0] + j;
+
+        decode_in_place(bids, 0, sizeof(inode_t), (char*)ino);
     }
+}
 
-    if (ino == NULL)
-        return;
+/* Write inode inum to the inode table.
+ * The caller should hold inode_manager_mutex. */
+void inode_manager::write_inode_p(uint32_t inum, const inode_t *ino)
+{
+    if (inum <= INODE_NUM) {
+        char buf[BLOCK_SIZE];
+        int pos = IBLOCK(inum, bm->sb.nblocks);
 
-    int pos = IBLOCK(inum, bm->sb.nblocks);
+        decode_inode_table(pos);
+        bm->read_block(pos, buf);
+        *((inode_t*)buf + (inum - 1) % IPB) = *ino;
+        bm->write_block(pos, buf);
+        encode_inode_table(pos);
+    } else {
+        uint32_t i = inum - INODE_NUM - 1;
+        blockid_t slot = inode_chunk_map()[i / INODE_CHUNK] + i % INODE_CHUNK * INODE_SLOT_BLOCKS;
+        std::string encoded = encode_data(std::string((const char*)ino, sizeof(inode_t)));
+
+        for (unsigned int off = 0; off < encoded.size(); off += BLOCK_SIZE) {
+            unsigned int n = encoded.size() - off < BLOCK_SIZE ? encoded.size() - off : BLOCK_SIZE;
+            bm->write_partial(slot + off / BLOCK_SIZE, 0, encoded.data() + off, n);
+        }
+    }
+}
+
+/* Return an inode structure by inum, NULL otherwise.
+ * Caller should release the memory. */
+struct inode* inode_manager::get_inode(uint32_t inum)
+{
+    struct inode *ino, ino_disk;
+
+    printf("\tim: get_inode %d\n", inum);
+
+    if (!inum_valid(inum)) {
+        printf("\tim: inum out of range\n");
+        return NULL;
+    }
 
     assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
-    decode_inode_table(pos);
 
-    bm->read_block(pos, buf);
-    ino_disk = (struct inode*)buf + (inum - 1) % IPB;
-    *ino_disk = *ino;
-    bm->write_block(pos, buf);
+    read_inode_p(inum, &ino_disk);
+    if (ino_disk.type == 0) {
+        printf("\tim: inode not exist\n");
+        ino = NULL;
+    } else {
+        ino = (struct inode*)malloc(sizeof(struct inode));
+        if (!ino) {
+            printf("Error: malloc failed\n");
+            exit(-1);
+        }
 
-    encode_inode_table(pos);
+        *ino = ino_disk;
+    }
+
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+
+    return ino;
+}
+
+void inode_manager::put_inode(uint32_t inum, struct inode *ino)
+{
+    printf("\tim: put_inode %d\n", inum);
+
+    if (!inum_valid(inum)) {
+        printf("\tim: inum out of range\n");
+        return;
+    }
+
+    if (ino == NULL)
+        return;
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+    write_inode_p(inum, ino);
     assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
 }
 
@@ -643,12 +1366,352 @@ void inode_manager::set_blockids(inode_t *ino, const blockid_t *bids, int cnt) /
     }
 }
 
+#define MIN(a,b) ((a)<(b) ? (a) : (b))
+
+/* Grow or shrink the block list bids of an inode from old_block_num to new_block_num blocks,
+ * allocating or freeing data blocks (and the indirect block) as needed.
+ * Return false if the new size exceeds the maximum file size. */
+bool inode_manager::resize_blocks(inode_t *ino, blockid_t *bids, int old_block_num, int new_block_num)
+{
+    if (new_block_num > (int)MAXFILE)
+        return false;
+
+    int diff_num;
+
+    if (new_block_num > old_block_num) { // Need to allocated more blocks.
+        diff_num = new_block_num - old_block_num;
+        for (int i = 0; i < diff_num; ++i)
+            bids[old_block_num + i] = bm->alloc_block();
+
+        if (old_block_num <= NDIRECT && new_block_num > NDIRECT) // Need to allocate the indirect block.
+            ino->blocks[NDIRECT] = bm->alloc_block();
+
+    } else if (new_block_num < old_block_num) { // We can free some blocks.
+        diff_num = old_block_num - new_block_num;
+        for (int i = 0; i < diff_num; ++i)
+            bm->free_block(bids[old_block_num - 1 - i]);
+
+        if (old_block_num > NDIRECT && new_block_num <= NDIRECT) // We can free the indirect block.
+            bm->free_block(ino->blocks[NDIRECT]);
+    }
+
+    return true;
+}
+
+/* Write encoded data to the encoded byte stream of a file, starting at encoded offset enc_off.
+ * Blocks only partially covered are read, patched and written back.
+ * Blocks may be replaced in bids, see block_manager::write_data_block(). */
+void inode_manager::write_encoded(blockid_t *bids, int enc_off, const std::string &encoded)
+{
+    char buf[BLOCK_SIZE];
+    const char *src = encoded.data();
+    int pos = enc_off;
+    int end = enc_off + encoded.length();
+
+    while (pos < end) {
+        int bno = pos / BLOCK_SIZE;
+        int inner = pos % BLOCK_SIZE;
+        int n = MIN(BLOCK_SIZE - inner, end - pos);
+
+        if (n == BLOCK_SIZE) {
+            bids[bno] = bm->write_data_block(bids[bno], src);
+        } else {
+            bm->read_block(bids[bno], buf);
+            memcpy(buf + inner, src, n);
+            bids[bno] = bm->write_data_block(bids[bno], buf);
+        }
+
+        src += n;
+        pos += n;
+    }
+}
+
+/* Allocate slots of a shared block for the encoded data of size bytes of a small file, and set them to ino.
+ * The first block with enough free slots in a row is used, so packed files are kept together. */
+bool inode_manager::alloc_tail(inode_t *ino, unsigned int size)
+{
+    unsigned int n = CEIL_DIV(ENCODED_SIZE(size), TAIL_SLOT_SIZE);
+    unsigned int mask = (1U << n) - 1;
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+
+    for (std::map<blockid_t, unsigned int>::iterator it = tail_slots.begin(); it != tail_slots.end(); ++it) {
+        for (unsigned int i = 0; i + n <= TAIL_SLOTS; ++i) {
+            if (!(it->second & mask << i)) {
+                it->second |= mask << i;
+                ino->tail_block = it->first;
+                ino->tail_off = i * TAIL_SLOT_SIZE;
+                assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+                return true;
+            }
+        }
+    }
+
+    // No room, start a new shared block.
+    blockid_t id = bm->alloc_block();
+    if (id)
+        tail_slots[id] = mask;
+
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+
+    ino->tail_block = id;
+    ino->tail_off = 0;
+    return id != 0;
+}
+
+// Release the slots holding the packed data of ino, freeing the shared block if it is no longer used.
+void inode_manager::free_tail(inode_t *ino)
+{
+    if (!ino->tail_block)
+        return;
+
+    unsigned int n = CEIL_DIV(ENCODED_SIZE(STORED_SIZE(ino)), TAIL_SLOT_SIZE);
+    unsigned int mask = ((1U << n) - 1) << (ino->tail_off / TAIL_SLOT_SIZE);
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+
+    std::map<blockid_t, unsigned int>::iterator it = tail_slots.find(ino->tail_block);
+    if (it != tail_slots.end()) {
+        it->second &= ~mask;
+        if (!it->second) {
+            bm->free_block(it->first);
+            tail_slots.erase(it);
+        }
+    }
+
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+
+    ino->tail_block = 0;
+    ino->tail_off = 0;
+}
+
 char* inode_manager::get_disk_ptr()
 {
+    bm->finish_rebuild(); // The disk is saved or loaded as a whole.
     return bm->get_disk_ptr();
 }
 
-#define MIN(a,b) ((a)<(b) ? (a) : (b)) // Seems unused.
+// Decode the part of the encoded byte stream [pos, end) of a file held by one of its blocks, see decode_in_place().
+class decode_job : public block_job {
+public:
+    block_manager *bm;
+    byte *blocks;
+    const blockid_t *bids;
+    unsigned int pos, end;
+    char *out;
+    unsigned int corrected; // Bytes found with errors, added by the workers.
+
+    void run(int bno)
+    {
+        unsigned int start = (unsigned int)bno * BLOCK_SIZE;
+        unsigned int from = pos > start ? pos : start;
+        unsigned int to = MIN(end, start + BLOCK_SIZE);
+        byte *enc = blocks + bids[bno] * BLOCK_SIZE;
+        char *o = out + (from - pos) / ENCODE_FACTOR;
+        byte fixed[ENCODE_FACTOR];
+        unsigned int n = 0;
+
+        bm->prepare_block(bids[bno]);
+        for (unsigned int i = from; i < to; i += ENCODE_FACTOR) { // A multiple of ENCODE_FACTOR, as BLOCK_SIZE is.
+            byte b = decode_byte(enc + i % BLOCK_SIZE);
+            encode_byte(b, fixed);
+            if (memcmp(fixed, enc + i % BLOCK_SIZE, ENCODE_FACTOR) != 0) {
+                memcpy(enc + i % BLOCK_SIZE, fixed, ENCODE_FACTOR);
+                n++;
+            }
+            *o++ = b;
+        }
+        if (n)
+            __sync_fetch_and_add(&corrected, n);
+    }
+};
+
+// Encode and write the data held by one block of a file, see write_file().
+class write_job : public block_job {
+public:
+    block_manager *bm;
+    blockid_t *bids;
+    const char *data;
+    int size;
+
+    void run(int i)
+    {
+        byte buf[BLOCK_SIZE];
+        int n = MIN(BLOCK_DATA_SIZE, size - i * BLOCK_DATA_SIZE);
+
+        if (n < BLOCK_DATA_SIZE)
+            memset(buf, 0, BLOCK_SIZE);
+        for (int j = 0; j < n; ++j)
+            encode_byte(data[i * BLOCK_DATA_SIZE + j], buf + ENCODED_SIZE(j));
+
+        bids[i] = bm->write_data_block(bids[i], (const char*)buf);
+    }
+};
+
+/* Decode len bytes of a file starting at byte off straight from its disk blocks to out.
+ * Every byte found with errors is encoded again in place to fix them, so no intermediate buffer is needed.
+ * Many blocks are decoded in parallel by the workers of their stripe columns. */
+void inode_manager::decode_in_place(const blockid_t *bids, unsigned int off, unsigned int len, char *out)
+{
+    decode_job job;
+    job.bm = bm;
+    job.blocks = (byte*)bm->get_disk_ptr();
+    job.bids = bids;
+    job.pos = ENCODED_SIZE(off);
+    job.end = ENCODED_SIZE(off + len);
+    job.out = out;
+    job.corrected = 0;
+
+    if (job.pos < job.end)
+        bm->run_striped(bids, job.pos / BLOCK_SIZE, (job.end - 1) / BLOCK_SIZE + 1, &job);
+
+    if (job.corrected)
+        __sync_fetch_and_add(&corrected_bytes, job.corrected);
+}
+
+/* The number of bytes of file data found with errors so far, which were corrected.
+ * A change means the disk was damaged, possibly also where data known from elsewhere is stored, see refresh_file(). */
+unsigned long long inode_manager::corrected_count()
+{
+    return __sync_fetch_and_add(&corrected_bytes, 0);
+}
+
+/* Decode len bytes of the data stored for a file starting at byte off, see decode_in_place().
+ * The data of a packed file starts at its offset in the shared block. */
+void inode_manager::decode_stored(const inode_t *ino, unsigned int off, unsigned int len, char *out)
+{
+    if (ino->tail_block) {
+        decode_in_place(&ino->tail_block, ino->tail_off / ENCODE_FACTOR + off, len, out);
+        return;
+    }
+
+    blockid_t bids[MAXFILE];
+
+    get_blockids(ino, bids, CEIL_DIV(ENCODED_SIZE(off + len), BLOCK_SIZE));
+    decode_in_place(bids, off, len, out);
+}
+
+// Get all the data of a file, however it is stored.
+void inode_manager::read_data(const inode_t *ino, std::string &data)
+{
+#if COMPRESS
+    if (ino->csize) {
+        read_compressed(ino, 0, ino->size, data);
+        return;
+    }
+#endif
+
+    data.resize(ino->size);
+    if (ino->size)
+        decode_stored(ino, 0, ino->size, &data[0]);
+}
+
+#if COMPRESS
+/* Compressed data is made of runs of COMPRESS_RUN_SIZE bytes of the file compressed one by one,
+ * after an index |<number of runs>|<end of each compressed run>...| counting from the end of the index.
+ * A range of the file is read by decoding and decompressing only the runs covering it. */
+static std::string compress_runs(const char *buf, int size)
+{
+    uint32_t nruns = CEIL_DIV(size, COMPRESS_RUN_SIZE);
+    std::string index((1 + nruns) * sizeof(uint32_t), '\0'), runs;
+
+    memcpy(&index[0], &nruns, sizeof(nruns));
+    for (uint32_t i = 0; i < nruns; ++i) {
+        int start = i * COMPRESS_RUN_SIZE;
+        runs += lz_compress(std::string(buf + start, MIN(COMPRESS_RUN_SIZE, size - start)));
+        uint32_t end = runs.size();
+        memcpy(&index[(1 + i) * sizeof(uint32_t)], &end, sizeof(end));
+    }
+
+    return index + runs;
+}
+
+/* Compress size bytes of buf to compressed.
+ * Return true if the compressed data takes fewer blocks, i.e. it is worth storing. */
+bool inode_manager::compress_data(const char *buf, int size, std::string &compressed)
+{
+    struct timespec t0, t1;
+
+    if (size <= BLOCK_DATA_SIZE) // Nothing to save.
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    compressed = compress_runs(buf, size);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    bool worth = CEIL_DIV(compressed.size(), BLOCK_DATA_SIZE) < CEIL_DIV((unsigned int)size, BLOCK_DATA_SIZE);
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+    compress_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    if (worth) {
+        compress_in_bytes += size;
+        compress_out_bytes += compressed.size();
+    }
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+
+    return worth;
+}
+
+/* Get len bytes of a compressed file starting at byte off, which are within the file.
+ * Only the index and the compressed runs covering the range are decoded (and fixed in place), see compress_runs().
+ * Damaged runs read as '\0's. */
+void inode_manager::read_compressed(const inode_t *ino, unsigned int off, unsigned int len, std::string &data)
+{
+    struct timespec t0, t1;
+    uint32_t nruns = CEIL_DIV(ino->size, COMPRESS_RUN_SIZE);
+    unsigned int index_size = (1 + nruns) * sizeof(uint32_t);
+    std::vector<uint32_t> index(1 + nruns);
+
+    data.clear();
+    if (!len)
+        return;
+
+    decode_stored(ino, 0, MIN(index_size, ino->csize), (char*)&index[0]);
+    bool ok = index_size <= ino->csize && index[0] == nruns;
+    for (uint32_t i = 1; ok && i <= nruns; ++i)
+        ok = index[i] >= (i > 1 ? index[i - 1] : 0) && index[i] <= ino->csize - index_size;
+
+    // Decode the compressed runs of the range at once.
+    unsigned int first = off / COMPRESS_RUN_SIZE, last = (off + len - 1) / COMPRESS_RUN_SIZE;
+    unsigned int start = 0, end = 0;
+    std::string compressed;
+    if (ok) {
+        start = first ? index[first] : 0;
+        end = index[last + 1];
+        compressed.resize(end - start);
+        decode_stored(ino, index_size + start, end - start, &compressed[0]);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    std::string run;
+    unsigned int damaged = 0, decompressed = 0;
+    for (unsigned int r = first; r <= last; ++r) {
+        unsigned int run_off = r * COMPRESS_RUN_SIZE;
+        unsigned int run_size = MIN((unsigned int)COMPRESS_RUN_SIZE, ino->size - run_off);
+
+        if (!ok || !lz_decompress(compressed.substr((r ? index[r] : 0) - start, index[r + 1] - (r ? index[r] : 0)),
+                    run, run_size)) {
+            run.assign(run_size, '\0');
+            damaged++;
+        }
+        decompressed += run_size;
+
+        unsigned int from = off > run_off ? off - run_off : 0;
+        unsigned int to = MIN(off + len, run_off + run_size) - run_off;
+        data.append(run, from, to - from);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (damaged)
+        printf("\tim: damaged compressed data\n");
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+    decompress_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    decompress_bytes += decompressed;
+    decompress_errors += damaged;
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+}
+#endif
 
 /* Get all the data of a file by inum.
  * Return allocated data, should be freed by caller. */
@@ -660,81 +1723,169 @@ void inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
      * and copy them to buf_out
      */
 
+    std::string data;
+    read_file(inum, data);
+
+    *size = data.size();
+    *buf_out = NULL;
+    if (data.empty())
+        return;
+
+    *buf_out = (char*)malloc(data.size());
+
+    if (!*buf_out) {
+        printf("Error: malloc failed\n");
+        exit(-1);
+    }
+
+    memcpy(*buf_out, data.data(), data.size());
+}
+
+// Get all the data of a file by inum into buf.
+void inode_manager::read_file(uint32_t inum, std::string &buf)
+{
+    read_file_range(inum, 0, UINT_MAX, buf);
+}
+
+/* alloc/free blocks if needed
+ * The data is stored compressed if compress is set and that saves blocks. */
+void inode_manager::write_file(uint32_t inum, const char *buf, int size, bool set_timestamps /*= true*/,
+        bool compress /*= true*/)
+{
+    /*
+     * your lab1 code goes here.
+     * note: write buf to blocks of inode inum.
+     * you need to consider the situation when the size of buf
+     * is larger or smaller than the size of original inode.
+     * you should free some blocks if necessary.
+     */
+
+    if (!buf)
+        return;
+
+    // Choose the data to store.
+    const char *data = buf;
+    int data_size = size;
+    unsigned int csize = 0;
+#if COMPRESS
+    std::string compressed;
+    if (compress && compress_data(buf, size, compressed)) {
+        data = compressed.data();
+        data_size = csize = compressed.size();
+    }
+#else
+    (void) compress;
+#endif
+
+    write_stored(inum, data, data_size, size, csize, set_timestamps);
+}
+
+/* Replace the stored data of a file with data_size bytes of data, for a file of size bytes.
+ * csize is data_size if the data is compressed, 0 otherwise. */
+void inode_manager::write_stored(uint32_t inum, const char *data, int data_size, unsigned int size,
+        unsigned int csize, bool set_timestamps)
+{
     // Retrieve the corresponding inode.
     inode_t* ino = get_inode(inum);
     if (!ino) {
         printf("\tim: bad inode\n");
-        *size = 0;
         return;
     }
 
-    // Handle inode with no content.
-    if (ino->size == 0) {
-        *size = 0;
-        *buf_out = NULL;
-        ino->atime = (unsigned int)time(NULL);
-        put_inode(inum, ino);
+    blockid_t new_blockids[MAXFILE];
+
+    if (CEIL_DIV(ENCODED_SIZE(data_size), BLOCK_SIZE) > (int)MAXFILE) {
+        printf("Error: file too large");
         free(ino);
         return;
     }
 
-    // Return inode size and set returned data pointer.
-    *size = ino->size;
-    *buf_out = (char*)malloc(ino->size);
+    // Get original block ids, and release the original packed data if any.
+    int old_block_num = STORED_BLOCKS(ino);
+    get_blockids(ino, new_blockids, old_block_num);
+    free_tail(ino);
 
-    if (!*buf_out) {
-        printf("Error: malloc failed\n");
-        exit(-1);
-    }
+    // Small data is packed into a shared block, other data is written to blocks of its own.
+    bool packed = false;
+#if PACK_TAILS
+    if (data_size > 0 && data_size <= PACK_MAX_SIZE)
+        packed = alloc_tail(ino, data_size);
+#endif
 
-    char buf[BLOCK_SIZE];
-    blockid_t read_blockids[MAXFILE];
+    // Adjust block ids.
+    int new_encoded_size = packed ? 0 : ENCODED_SIZE(data_size);
+    int new_block_num = CEIL_DIV(new_encoded_size, BLOCK_SIZE);
+    resize_blocks(ino, new_blockids, old_block_num, new_block_num);
+
+    // Encode and write data to data blocks. Only the slots of the file are written if it is packed,
+    // other files may be using the rest of the shared block.
+    if (packed) {
+        std::string encoded_string = encode_data(std::string(data, data_size));
+        bm->write_partial(ino->tail_block, ino->tail_off, encoded_string.data(), encoded_string.size());
+    } else {
+        write_job job;
+        job.bm = bm;
+        job.bids = new_blockids;
+        job.data = data;
+        job.size = data_size;
+        bm->run_striped(new_blockids, 0, new_block_num, &job);
+    }
 
-    int encoded_size = ENCODED_SIZE(ino->size);
-    int whole_blocks = encoded_size / BLOCK_SIZE;
-    int total_blocks = CEIL_DIV(encoded_size, BLOCK_SIZE);
-    int last_bytes = encoded_size % BLOCK_SIZE;
-    char *encoded_buf = (char*)malloc(encoded_size);
+    // Set new block ids, new size and mtime to inode.
+    set_blockids(ino, new_blockids, new_block_num);
+    ino->size = size;
+    ino->csize = csize;
+    if (set_timestamps) {
+        ino->mtime = (unsigned int)time(NULL);
+        ino->ctime = (unsigned int)time(NULL);
+    }
+    put_inode(inum, ino);
 
-    // Get block ids of the inode.
-    get_blockids(ino, read_blockids, total_blocks);
+    // Free memory allocated by get_inode().
+    free(ino);
+}
 
-    // Read encoded file data.
-    for (int i = 0; i < whole_blocks; ++i)
-        bm->read_block(read_blockids[i], encoded_buf + i * BLOCK_SIZE);
+/* Get len bytes of a file starting at byte off.
+ * Only the blocks covering the range are decoded. */
+void inode_manager::read_file_range(uint32_t inum, unsigned int off, unsigned int len, std::string &buf)
+{
+    buf.clear();
 
-    if (last_bytes) {
-        bm->read_block(read_blockids[whole_blocks], buf);
-        memcpy(encoded_buf + whole_blocks * BLOCK_SIZE, buf, last_bytes);
+    // Retrieve the corresponding inode.
+    inode_t* ino = get_inode(inum);
+    if (!ino) {
+        printf("\tim: bad inode\n");
+        return;
     }
 
-    // Decode data and transfer to returned data pointer.
-    std::string decoded_data = decode_data(std::string(encoded_buf, encoded_size));
-    free(encoded_buf);
-    memcpy(*buf_out, decoded_data.c_str(), decoded_data.length());
+    // Clip the range to the end of file.
+    if (off < ino->size && len > 0) {
+        if (len > ino->size - off)
+            len = ino->size - off;
+
+#if COMPRESS
+        if (ino->csize) {
+            read_compressed(ino, off, len, buf);
+        } else
+#endif
+        { // Decode the requested range straight into buf.
+            buf.resize(len);
+            decode_stored(ino, off, len, &buf[0]);
+        }
+    }
 
     // Set atime of inode.
     ino->atime = (unsigned int)time(NULL);
     put_inode(inum, ino);
 
-    // Write back the file (encode it again to fix possible errors, but do not set timestamps again).
-    write_file(inum, decoded_data.c_str(), decoded_data.length(), false);
-
     // Free memory allocated by get_inode().
     free(ino);
 }
 
-/* alloc/free blocks if needed */
-void inode_manager::write_file(uint32_t inum, const char *buf, int size, bool set_timestamps /*= true*/)
+/* Write size bytes to a file starting at byte off, growing the file if needed.
+ * A gap between the old end of file and off is filled with '\0's. */
+void inode_manager::write_file_range(uint32_t inum, unsigned int off, const char *buf, int size)
 {
-    /*
-     * your lab1 code goes here.
-     * note: write buf to blocks of inode inum.
-     * you need to consider the situation when the size of buf
-     * is larger or smaller than the size of original inode.
-     * you should free some blocks if necessary.
-     */
-
     if (!buf)
         return;
 
@@ -745,66 +1896,123 @@ void inode_manager::write_file(uint32_t inum, const char *buf, int size, bool se
         return;
     }
 
+    /* Writing the whole file replaces it, which may be packed again. Nothing is compressed here, so that
+     * a file written in parts is compressed once at the end, see compress_file(). A compressed file is stored
+     * as is first, so that writing a part of it does not compress everything again, and later small writes stay cheap.
+     * A packed file is small, it is just written again. */
+    if ((off == 0 && (unsigned int)size >= ino->size) || ino->csize || ino->tail_block) {
+        std::string data;
+
+        if (off != 0 || (unsigned int)size < ino->size) {
+            read_data(ino, data);
+            if (off > data.size())
+                data.resize(off, '\0');
+            data.replace(off, size, buf, size);
+        }
+        free(ino);
+
+        if (data.empty())
+            write_file(inum, buf, size, true, false);
+        else
+            write_file(inum, data.data(), data.size(), true, false);
+        return;
+    }
+
     blockid_t new_blockids[MAXFILE];
-    char rest_buf[BLOCK_SIZE];
 
-    // Get original block ids.
-    int old_block_num = CEIL_DIV(ENCODED_SIZE(ino->size), BLOCK_SIZE);
-    get_blockids(ino, new_blockids, old_block_num);
+    unsigned int old_size = ino->size;
+    unsigned int new_size = off + size > old_size ? off + size : old_size;
+    int old_block_num = CEIL_DIV(ENCODED_SIZE(old_size), BLOCK_SIZE);
+    int new_block_num = CEIL_DIV(ENCODED_SIZE(new_size), BLOCK_SIZE);
 
-    // Adjust block ids.
-    int new_encoded_size = ENCODED_SIZE(size);
-    int new_block_num = CEIL_DIV(new_encoded_size, BLOCK_SIZE);
-    if (new_block_num > MAXFILE) {
+    // Get original block ids and adjust them.
+    get_blockids(ino, new_blockids, old_block_num);
+    if (!resize_blocks(ino, new_blockids, old_block_num, new_block_num)) {
         printf("Error: file too large");
+        free(ino);
         return;
     }
-    int diff_num;
 
-    if (new_block_num > old_block_num) { // Need to allocated more blocks.
-        diff_num = new_block_num - old_block_num;
-        for (int i = 0; i < diff_num; ++i)
-            new_blockids[old_block_num + i] = bm->alloc_block();
+    // Construct the data to write, including the gap after the old end of file.
+    unsigned int start = MIN(old_size, off);
+    std::string data(off - start, '\0');
+    data.append(buf, size);
 
-        if (old_block_num <= NDIRECT && new_block_num > NDIRECT) // Need to allocate the indirect block.
-            ino->blocks[NDIRECT] = bm->alloc_block();
+    // Encode and write data to the blocks it covers.
+    write_encoded(new_blockids, ENCODED_SIZE(start), encode_data(data));
 
-    } else if (new_block_num < old_block_num) { // We can free some blocks.
-        diff_num = old_block_num - new_block_num;
-        for (int i = 0; i < diff_num; ++i)
-            bm->free_block(new_blockids[old_block_num - 1 - i]);
+    // Set new block ids, new size and mtime to inode.
+    set_blockids(ino, new_blockids, new_block_num);
+    ino->size = new_size;
+    ino->mtime = (unsigned int)time(NULL);
+    ino->ctime = (unsigned int)time(NULL);
+    put_inode(inum, ino);
 
-        if (old_block_num > NDIRECT && new_block_num <= NDIRECT) // We can free the indirect block.
-            bm->free_block(ino->blocks[NDIRECT]);
+    // Free memory allocated by get_inode().
+    free(ino);
+}
+
+// Set the size of a file, dropping data beyond size or extending it with '\0's.
+void inode_manager::truncate_file(uint32_t inum, unsigned int size)
+{
+    // Retrieve the corresponding inode.
+    inode_t* ino = get_inode(inum);
+    if (!ino) {
+        printf("\tim: bad inode\n");
+        return;
     }
 
-    // Encode and write data to data blocks.
-    int whole_blocks = new_encoded_size / BLOCK_SIZE;
-    int last_bytes = new_encoded_size % BLOCK_SIZE;
-    std::string encoded_string = encode_data(std::string(buf, size));
-    const char *encoded_buf = encoded_string.c_str();
+    if (size > ino->size) { // Extending is the same as writing '\0's at the end of file.
+        std::string zeros(size - ino->size, '\0');
+        unsigned int old_size = ino->size;
+        free(ino);
+        write_file_range(inum, old_size, zeros.data(), zeros.length());
+        return;
+    }
 
-    for (int i = 0; i < whole_blocks; ++i)
-        bm->write_block(new_blockids[i], encoded_buf + i * BLOCK_SIZE);
+    if (ino->csize || ino->tail_block) { // Store the remaining data as is (or packed).
+        std::string data;
 
-    if (last_bytes) {
-        memcpy(rest_buf, encoded_buf + whole_blocks * BLOCK_SIZE, last_bytes);
-        bm->write_block(new_blockids[whole_blocks], rest_buf);
+        read_data(ino, data);
+        free(ino);
+        write_file(inum, data.data(), size, true, false);
+        return;
     }
 
+    blockid_t new_blockids[MAXFILE];
+
+    int old_block_num = STORED_BLOCKS(ino);
+    int new_block_num = CEIL_DIV(ENCODED_SIZE(size), BLOCK_SIZE);
+
+    // Free blocks beyond the new end of file.
+    get_blockids(ino, new_blockids, old_block_num);
+    resize_blocks(ino, new_blockids, old_block_num, new_block_num);
+
     // Set new block ids, new size and mtime to inode.
     set_blockids(ino, new_blockids, new_block_num);
     ino->size = size;
-    if (set_timestamps) {
-        ino->mtime = (unsigned int)time(NULL);
-        ino->ctime = (unsigned int)time(NULL);
-    }
+    ino->csize = 0;
+    ino->mtime = (unsigned int)time(NULL);
+    ino->ctime = (unsigned int)time(NULL);
     put_inode(inum, ino);
 
     // Free memory allocated by get_inode().
     free(ino);
 }
 
+// Append size bytes to the end of a file. Return the new file size.
+unsigned int inode_manager::append_file(uint32_t inum, const char *buf, int size)
+{
+    extent_protocol::attr a;
+
+    getattr(inum, a);
+    if (!a.type)
+        return 0;
+
+    write_file_range(inum, a.size, buf, size);
+    return a.size + size;
+}
+
 void inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
 {
     /*
@@ -850,7 +2058,7 @@ void inode_manager::remove_file(uint32_t inum)
     // Get block ids of the inode.
     blockid_t remove_blockids[MAXFILE];
 
-    int total_blocks = CEIL_DIV(ENCODED_SIZE(ino->size), BLOCK_SIZE);
+    int total_blocks = STORED_BLOCKS(ino);
     get_blockids(ino, remove_blockids, total_blocks);
 
     // Free all the data blocks.
@@ -861,9 +2069,265 @@ void inode_manager::remove_file(uint32_t inum)
     if (total_blocks > NDIRECT)
         bm->free_block(ino->blocks[NDIRECT]);
 
+    // Release the packed data if any.
+    free_tail(ino);
+
     // Free the inode (mark inum as free).
     free_inode(inum);
 
     // Free memory allocated by get_inode().
     free(ino);
 }
+
+/* Encode the known content of a file again over its blocks to fix possible errors.
+ * Shared blocks are written in place too, as their content does not change. */
+void inode_manager::refresh_file(uint32_t inum, const std::string &content)
+{
+    // Retrieve the corresponding inode.
+    inode_t* ino = get_inode(inum);
+    if (!ino) {
+        printf("\tim: bad inode\n");
+        return;
+    }
+
+    if (ino->size == content.size()) {
+        blockid_t bids[MAXFILE];
+        byte *blocks = (byte*)bm->get_disk_ptr();
+        const std::string *stored = &content;
+
+#if COMPRESS
+        // Compression is deterministic, so the stored data can be made from the content again.
+        std::string compressed;
+        if (ino->csize) {
+            compressed = compress_runs(content.data(), content.size());
+            stored = &compressed;
+            if (compressed.size() != ino->csize) {
+                free(ino);
+                return;
+            }
+        }
+#endif
+
+        get_blockids(ino, bids, STORED_BLOCKS(ino));
+
+        // The content is what is stored, so the parity stays the same.
+        if (ino->tail_block)
+            bm->prepare_block(ino->tail_block);
+        for (unsigned int i = 0; i < STORED_BLOCKS(ino); ++i)
+            bm->prepare_block(bids[i]);
+
+        for (unsigned int i = 0; i < stored->size(); ++i) {
+            unsigned int pos = ENCODED_SIZE(i);
+            if (ino->tail_block)
+                encode_byte((*stored)[i], blocks + ino->tail_block * BLOCK_SIZE + ino->tail_off + pos);
+            else
+                encode_byte((*stored)[i], blocks + bids[pos / BLOCK_SIZE] * BLOCK_SIZE + pos % BLOCK_SIZE);
+        }
+    }
+
+    // Free memory allocated by get_inode().
+    free(ino);
+}
+
+#if COMPRESS
+// Store a file compressed if it is stored as is and compressing saves blocks, e.g. after it was written in parts.
+void inode_manager::compress_file(uint32_t inum)
+{
+    std::string data, compressed;
+
+    // Retrieve the corresponding inode.
+    inode_t* ino = get_inode(inum);
+    if (!ino) {
+        printf("\tim: bad inode\n");
+        return;
+    }
+
+    bool stored_as_is = !ino->csize;
+    free(ino);
+
+    if (!stored_as_is)
+        return;
+
+    read_file(inum, data);
+    if (compress_data(data.data(), data.size(), compressed))
+        write_stored(inum, compressed.data(), compressed.size(), data.size(), compressed.size(), false);
+}
+#endif
+
+/* Create a copy of a file sharing all its data blocks, which are copied on write.
+ * Return the new inode number, or 0 if inum does not exist or no inode is left. */
+uint32_t inode_manager::clone_file(uint32_t inum)
+{
+    // Retrieve the corresponding inode.
+    inode_t* ino = get_inode(inum);
+    if (!ino) {
+        printf("\tim: bad inode\n");
+        return 0;
+    }
+
+    blockid_t bids[MAXFILE];
+
+    int total_blocks = STORED_BLOCKS(ino);
+    get_blockids(ino, bids, total_blocks);
+
+    uint32_t newinum = alloc_inode(ino->type);
+    if (!newinum) {
+        free(ino);
+        return 0;
+    }
+
+    for (int i = 0; i < total_blocks; ++i)
+        bm->ref_block(bids[i]);
+
+    inode_t* newino = get_inode(newinum);
+
+    // The indirect block is not shared, it is metadata of the new file.
+    if (total_blocks > NDIRECT)
+        newino->blocks[NDIRECT] = bm->alloc_block();
+
+    set_blockids(newino, bids, total_blocks);
+    newino->size = ino->size;
+    newino->csize = ino->csize;
+
+    // Slots of shared blocks are not reference counted, packed data is copied to slots of the new file.
+    if (ino->tail_block) {
+        if (alloc_tail(newino, STORED_SIZE(ino))) {
+            char *blocks = bm->get_disk_ptr();
+            bm->prepare_block(ino->tail_block);
+            bm->write_partial(newino->tail_block, newino->tail_off,
+                blocks + ino->tail_block * BLOCK_SIZE + ino->tail_off, ENCODED_SIZE(STORED_SIZE(ino)));
+        } else {
+            newino->size = newino->csize = 0;
+        }
+    }
+
+    put_inode(newinum, newino);
+
+    // Free memory allocated by get_inode().
+    free(ino);
+    free(newino);
+
+    return newinum;
+}
+
+/* Give file inum the data of file from, which is freed, e.g. to install data written to a staging file.
+ * The data is switched in one update of the inode, then the old data of inum is freed.
+ * Return false, and free from, if inum does not exist. */
+bool inode_manager::replace_file(uint32_t inum, uint32_t from)
+{
+    // Retrieve the corresponding inodes.
+    inode_t* src = get_inode(from);
+    inode_t* ino = get_inode(inum);
+    if (!src || !ino) {
+        printf("\tim: bad inode\n");
+        free(ino);
+        free(src);
+        remove_file(from);
+        return false;
+    }
+
+    inode_t old = *ino;
+
+    // The blocks of from, including the indirect block, now belong to inum.
+    ino->size = src->size;
+    ino->csize = src->csize;
+    ino->tail_block = src->tail_block;
+    ino->tail_off = src->tail_off;
+    memcpy(ino->blocks, src->blocks, sizeof(ino->blocks));
+    ino->mtime = (unsigned int)time(NULL);
+    ino->ctime = (unsigned int)time(NULL);
+    put_inode(inum, ino);
+    free_inode(from);
+
+    // Free the old data of inum.
+    blockid_t old_blockids[MAXFILE];
+
+    int total_blocks = STORED_BLOCKS(&old);
+    get_blockids(&old, old_blockids, total_blocks);
+    for (int i = 0; i < total_blocks; ++i)
+        bm->free_block(old_blockids[i]);
+    if (total_blocks > NDIRECT)
+        bm->free_block(old.blocks[NDIRECT]);
+    free_tail(&old);
+
+    // Free memory allocated by get_inode().
+    free(ino);
+    free(src);
+
+    return true;
+}
+
+/* Count the references to data blocks from all inodes again, which also rebuilds the deduplication index
+ * and the used slots of shared blocks. Used when the disk is replaced as a whole, e.g. by version control operations. */
+void inode_manager::rebuild_block_refs()
+{
+    std::map<uint32_t, int> refs;
+    std::map<blockid_t, unsigned int> slots;
+    blockid_t bids[MAXFILE];
+    uint32_t used = 0;
+
+    bm->rebuild_parity();
+
+    for (uint32_t inum = 1; inum <= disk_sb()->ninodes; ++inum) {
+        inode_t* ino = get_inode(inum);
+        if (!ino)
+            continue;
+        used++;
+
+        int total_blocks = STORED_BLOCKS(ino);
+        get_blockids(ino, bids, total_blocks);
+
+        for (int i = 0; i < total_blocks; ++i)
+            refs[bids[i]]++;
+
+        if (ino->tail_block) {
+            unsigned int n = CEIL_DIV(ENCODED_SIZE(STORED_SIZE(ino)), TAIL_SLOT_SIZE);
+            slots[ino->tail_block] |= ((1U << n) - 1) << (ino->tail_off / TAIL_SLOT_SIZE);
+        }
+
+        free(ino);
+    }
+
+    bm->set_refs(refs);
+    bm->sb = *disk_sb();
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+    tail_slots.swap(slots);
+    free_inodes = disk_sb()->ninodes - 1 - used; // Inode number INODE_NUM is never allocated.
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+}
+
+// Replace disk i with an empty one, see block_manager::replace_disk().
+bool inode_manager::replace_disk(int i)
+{
+    return bm->replace_disk(i);
+}
+
+// Add the counters of the inode layer and the block layer to stats.
+void inode_manager::get_stats(std::map<std::string, unsigned long long> &stats)
+{
+    bm->get_stats(stats);
+
+    assert(pthread_mutex_lock(&inode_manager_mutex) == 0);
+
+    unsigned long long used = 0;
+    for (std::map<blockid_t, unsigned int>::iterator it = tail_slots.begin(); it != tail_slots.end(); ++it)
+        used += __builtin_popcount(it->second);
+
+    stats["tail_blocks"] = tail_slots.size();
+    stats["tail_slots_used"] = used;
+    stats["tail_fill_percent"] = tail_slots.empty() ? 0 : used * 100 / (tail_slots.size() * TAIL_SLOTS);
+    stats["corrected_bytes"] = corrected_count();
+
+#if COMPRESS
+    stats["compress_in_bytes"] = compress_in_bytes;
+    stats["compress_out_bytes"] = compress_out_bytes;
+    stats["compress_ratio_percent"] = compress_in_bytes ? compress_out_bytes * 100 / compress_in_bytes : 0;
+    stats["compress_ns"] = compress_ns;
+    stats["decompress_ns"] = decompress_ns;
+    stats["decompress_errors"] = decompress_errors;
+    stats["decompress_bytes"] = decompress_bytes;
+#endif
+
+    assert(pthread_mutex_unlock(&inode_manager_mutex) == 0);
+}
@@ -10,7 +10,11 @@
 #include <string>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
 #include <pthread.h>
+#include <map>
+#include <list>
+#include <vector>
 #include "extent_protocol.h"
 
 #define DISK_SIZE (1024 * 1024 * 32)
@@ -19,10 +23,31 @@
 
 typedef uint32_t blockid_t;
 
+/* Optional storage features, off unless enabled when building, e.g. with -DDEDUP=1.
+ * They change the layout of the disk, so all servers sharing a disk image must agree on them.
+ */
+
+// Point data blocks with identical content at one physical copy.
+#ifndef DEDUP
+#define DEDUP 0
+#endif
+
+// Store file data compressed when that takes fewer blocks.
+#ifndef COMPRESS
+#define COMPRESS 0
+#endif
+#define COMPRESS_RUN_SIZE 4096 // Bytes of data compressed one after another, so that a range is read by its runs.
+
+// Pack the data of small files into blocks shared by several files.
+#ifndef PACK_TAILS
+#define PACK_TAILS 0
+#endif
+
 // Encode and decode (redundant) algorithm for fault tolerance.
 #define ENCODE_FACTOR 4 // Encoded data size / Original data size
 #define ENCODED_SIZE(x) ((x) * ENCODE_FACTOR)
 #define ENCODE_EXTRA_SIZE(x) ((x) * (ENCODE_FACTOR - 1))
+#define BLOCK_DATA_SIZE (BLOCK_SIZE / ENCODE_FACTOR) // Original data bytes held by one encoded data block.
 typedef unsigned char byte;
 inline bool get_bit(byte c, int pos);
 inline bool voter_3(bool x1, bool x2, bool x3);
@@ -49,19 +74,55 @@ public:
 
 // block layer -----------------------------------------
 
+/* The blocks are striped over NDISKS columns, called disks, STRIPE_BLOCKS blocks at a time. All columns are
+ * in the one in-memory image, which version control saves and loads as a whole. Each column has a worker thread,
+ * so that the encoding and decoding of operations on at least PARALLEL_MIN_BLOCKS blocks run in parallel,
+ * see block_manager::run_striped(). The columns are also the units of the parity, see replace_disk(). */
+#define NDISKS 4
+#define STRIPE_BLOCKS 8
+#define PARALLEL_MIN_BLOCKS 32
+
+/* Parity of stripe rows kept on PARITY_DISKS extra disks: 1 for XOR parity (RAID-5 style),
+ * 2 for XOR and Reed-Solomon parity (RAID-6 style), 0 for none unless set when building, e.g. with -DPARITY_DISKS=2.
+ * The encoding of blocks fixes bit flips, the parity rebuilds whole disks that are lost and replaced.
+ */
+#ifndef PARITY_DISKS
+#define PARITY_DISKS 0
+#endif
+#define PARITY_BLOCKS (BLOCK_NUM / NDISKS) // Blocks of a parity disk, one for every row of stripe blocks.
+#define PARITY_LOCKS 64 // Locks protecting the rows, shared by rows with the same number modulo this.
+
 typedef struct superblock {
     uint32_t size;
     uint32_t nblocks;
-    uint32_t ninodes;
+    uint32_t ninodes; // Including the inodes of the inode table chunks, see inode_manager::grow_inode_table_p().
+    uint32_t ndisks;
+    uint32_t stripe_blocks;
 } superblock_t;
 
+// Work done on each of a list of blocks, possibly by several workers at once.
+class block_job {
+public:
+    virtual ~block_job() {}
+    virtual void run(int i) = 0; // Process the i-th block of the list.
+};
+
 class block_manager {
     friend class inode_manager;
     friend class extent_server;
 private:
     disk *d;
-    std::map <uint32_t, int> using_blocks;
+    std::map <uint32_t, int> using_blocks; // Reference counts of data blocks shared by files. Others are used at most once.
     pthread_mutex_t block_manager_mutex; // Used to protect atomicity during bitmap manipulation.
+#if DEDUP
+    // Index of data blocks by content hash, used to find a block with the same content as the one to write.
+    std::map <uint64_t, uint32_t> dedup_index;
+    std::map <uint32_t, uint64_t> dedup_hashes;
+    unsigned long long dedup_writes, dedup_hits, dedup_hash_ns;
+    static uint64_t hash_block(const char *buf);
+    void index_block_p(uint32_t id, uint64_t hash);
+    void unindex_block_p(uint32_t id);
+#endif
     void encode_bitmap_all();
     void decode_bitmap_all();
     void encode_bitmap(uint32_t bblock);
@@ -72,12 +133,67 @@ private:
     void mark_as_allocated_batch(uint32_t to_id);
     void mark_as_free(uint32_t id);
     char* get_disk_ptr();
+
+    // A part of a striped operation, covering the blocks of one column.
+    struct stripe_batch {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        int pending; // Parts not finished yet.
+    };
+    struct stripe_request {
+        block_job *job;
+        std::vector<int> items;
+        stripe_batch *batch;
+    };
+    struct stripe_worker {
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        std::list<stripe_request> queue;
+        bool stop;
+        unsigned long long requests, blocks;
+    };
+    stripe_worker workers[NDISKS];
+    static void* worker_thread(void *arg);
+    static int disk_of(uint32_t id) { return id / STRIPE_BLOCKS % NDISKS; }
+
+#if PARITY_DISKS
+    unsigned char *parity[PARITY_DISKS];
+    pthread_mutex_t row_locks[PARITY_LOCKS];
+    pthread_mutex_t lost_mutex; // Protects the counters below, and starting the rebuild thread.
+    std::vector<unsigned char> lost; // Blocks of replaced disks not rebuilt yet, protected by the lock of their rows.
+    int lost_count, lost_disks; // lost_count is also changed atomically, so lost_blocks() reads it without the lock.
+    unsigned long long degraded_reads, rebuilt_blocks;
+    pthread_t rebuild_thread;
+    bool rebuild_started, rebuild_running;
+    // The parity block of the row of block id, and the block of disk k in the row of parity block p.
+    static uint32_t parity_of(uint32_t id) { return id / (NDISKS * STRIPE_BLOCKS) * STRIPE_BLOCKS + id % STRIPE_BLOCKS; }
+    static uint32_t row_member(uint32_t p, int k) { return (p / STRIPE_BLOCKS * NDISKS + k) * STRIPE_BLOCKS + p % STRIPE_BLOCKS; }
+    pthread_mutex_t *row_lock(uint32_t p) { return &row_locks[p % PARITY_LOCKS]; }
+    int lost_blocks() { return __sync_fetch_and_add(&lost_count, 0); }
+    void recover_row_p(uint32_t p);
+    void compute_parity_p(uint32_t p);
+    static void* rebuild_main(void *arg);
+#endif
 public:
     block_manager();
     ~block_manager();
     struct superblock sb;
     uint32_t alloc_block();
+    uint32_t alloc_blocks(uint32_t n);
     void free_block(uint32_t id);
+    void ref_block(uint32_t id);
+    uint32_t unshare_block(uint32_t id);
+    uint32_t write_data_block(uint32_t id, const char *buf);
+    void set_refs(const std::map<uint32_t, int> &refs);
+    void get_stats(std::map<std::string, unsigned long long> &stats);
+    void run_striped(const blockid_t *bids, int first, int last, block_job *job);
+    void prepare_block(uint32_t id);
+    void update_parity(uint32_t id);
+    void write_partial(uint32_t id, unsigned int off, const char *buf, unsigned int len);
+    bool replace_disk(int i);
+    void finish_rebuild();
+    void rebuild_parity();
     void read_block(uint32_t id, char *buf);
     void write_block(uint32_t id, const char *buf);
 };
@@ -115,6 +231,15 @@ public:
  */
 #define RESERVED_BLOCKS_NUM (2 + ENCODED_SIZE(BITMAP_BLOCKS + INODE_TABLE_BLOCKS))
 
+/* Inodes beyond INODE_NUM live in chunks of the inode table allocated from the data area on demand.
+ * The chunk map (first block of every chunk) follows the super block, so finding an inode stays O(1).
+ * Chunks are larger on larger disks. Each inode of a chunk is encoded in INODE_SLOT_BLOCKS blocks. */
+#define INODE_CHUNK (BLOCK_NUM / 512)
+#define INODE_SLOT_SIZE (BLOCK_DATA_SIZE * 2) // Original bytes of an inode slot, at least sizeof(inode_t).
+#define INODE_SLOT_BLOCKS CEIL_DIV(ENCODED_SIZE(INODE_SLOT_SIZE), BLOCK_SIZE)
+#define MAX_INODE_CHUNKS ((BLOCK_SIZE - sizeof(superblock_t)) / sizeof(blockid_t))
+#define MAX_INUM (INODE_NUM + MAX_INODE_CHUNKS * INODE_CHUNK)
+
 // Direct/indirect blocks number
 #define NDIRECT 100
 #define NINDIRECT (BLOCK_SIZE / sizeof(uint))
@@ -124,27 +249,65 @@ typedef struct inode {
     //short type;
     unsigned int type;
     unsigned int size;
+    unsigned int csize; // Size of the compressed data stored in the blocks, 0 if the data is stored as is.
+    blockid_t tail_block; // Shared block holding the (encoded) data of a small file, 0 if the data has blocks of its own.
+    unsigned int tail_off; // Offset of the encoded data in tail_block.
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     blockid_t blocks[NDIRECT + 1]; // Data block addresses
 } inode_t;
 
+// The size of the data stored for a file, and the number of data blocks of its own used by it.
+#define STORED_SIZE(ino) ((ino)->csize ? (ino)->csize : (ino)->size)
+#define STORED_BLOCKS(ino) ((ino)->tail_block ? 0 : CEIL_DIV(ENCODED_SIZE(STORED_SIZE(ino)), BLOCK_SIZE))
+
+// Shared blocks are allocated to small files in slots of encoded bytes.
+#define TAIL_SLOT_SIZE 64
+#define TAIL_SLOTS (BLOCK_SIZE / TAIL_SLOT_SIZE)
+#define PACK_MAX_SIZE (BLOCK_DATA_SIZE / 2) // Files storing up to this many bytes are packed.
+
 class inode_manager {
     friend class extent_server;
 private:
     block_manager *bm;
     bool uncommitted;
     int current_version;
+    uint32_t next_inum; // Where the search for a free inode number starts.
+    uint32_t free_inodes; // Free inode numbers in the table, so a full table grows without being searched.
     pthread_mutex_t inode_manager_mutex; // Used to protect atomicity during inode table manipulation.
+    std::map<blockid_t, unsigned int> tail_slots; // Bitmaps of the used slots of shared blocks.
+    unsigned long long corrected_bytes;
+#if COMPRESS
+    unsigned long long compress_in_bytes, compress_out_bytes, compress_ns, decompress_ns, decompress_errors;
+    unsigned long long decompress_bytes;
+    bool compress_data(const char *buf, int size, std::string &compressed);
+    void read_compressed(const inode_t *ino, unsigned int off, unsigned int len, std::string &data);
+#endif
+    bool alloc_tail(inode_t *ino, unsigned int size);
+    void free_tail(inode_t *ino);
     void encode_inode_table_all();
     void decode_inode_table_all();
     void encode_inode_table(uint32_t inum);
     void decode_inode_table(uint32_t inum);
+    superblock_t* disk_sb();
+    blockid_t* inode_chunk_map();
+    bool inum_valid(uint32_t inum);
+    uint32_t inum_after(uint32_t inum);
+    uint32_t grow_inode_table_p();
+    void read_inode_p(uint32_t inum, inode_t *ino);
+    void write_inode_p(uint32_t inum, const inode_t *ino);
     struct inode* get_inode(uint32_t inum);
     void put_inode(uint32_t inum, struct inode *ino);
     void get_blockids(const inode_t *ino, blockid_t *bids, int cnt);
     void set_blockids(inode_t *ino, const blockid_t *bids, int cnt);
+    bool resize_blocks(inode_t *ino, blockid_t *bids, int old_block_num, int new_block_num);
+    void write_encoded(blockid_t *bids, int enc_off, const std::string &encoded);
+    void decode_in_place(const blockid_t *bids, unsigned int off, unsigned int len, char *out);
+    void decode_stored(const inode_t *ino, unsigned int off, unsigned int len, char *out);
+    void read_data(const inode_t *ino, std::string &data);
+    void write_stored(uint32_t inum, const char *data, int data_size, unsigned int size, unsigned int csize,
+            bool set_timestamps);
     char* get_disk_ptr();
 public:
     inode_manager();
@@ -152,8 +315,23 @@ public:
     uint32_t alloc_inode(uint32_t type);
     void free_inode(uint32_t inum);
     void read_file(uint32_t inum, char **buf, int *size);
-    void write_file(uint32_t inum, const char *buf, int size, bool set_timestamps = true);
+    void read_file(uint32_t inum, std::string &buf);
+    void write_file(uint32_t inum, const char *buf, int size, bool set_timestamps = true, bool compress = true);
+    void read_file_range(uint32_t inum, unsigned int off, unsigned int len, std::string &buf);
+    void write_file_range(uint32_t inum, unsigned int off, const char *buf, int size);
+    void truncate_file(uint32_t inum, unsigned int size);
+    unsigned int append_file(uint32_t inum, const char *buf, int size);
     void remove_file(uint32_t inum);
+    void refresh_file(uint32_t inum, const std::string &content);
+    unsigned long long corrected_count();
+#if COMPRESS
+    void compress_file(uint32_t inum);
+#endif
+    uint32_t clone_file(uint32_t inum);
+    bool replace_file(uint32_t inum, uint32_t from);
+    void rebuild_block_refs();
+    void get_stats(std::map<std::string, unsigned long long> &stats);
+    bool replace_disk(int i);
     void getattr(uint32_t inum, extent_protocol::attr &a);
 };
 
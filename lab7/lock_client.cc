@@ -2,25 +2,63 @@
 
 #include "lock_client.h"
 #include "rpc.h"
+#include "slock.h"
+#include "handle.h"
 #include <arpa/inet.h>
 
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
-lock_client::lock_client(std::string dst)
+lock_client::lock_client(std::string dst, lock_release_user *l): lu(l)
 {
+    VERIFY(pthread_mutex_init(&mutex, NULL) == 0);
+    VERIFY(pthread_cond_init(&cond, NULL) == 0);
+    VERIFY(pthread_cond_init(&retry_cond, NULL) == 0);
+    VERIFY(pthread_cond_init(&releaser_cond, NULL) == 0);
+    rlsrpc = new rpcs(callback_port(id));
+    rlsrpc->reg(rlock_protocol::retry, this, &lock_client::retry);
+    rlsrpc->reg(rlock_protocol::revoke, this, &lock_client::revoke);
     sockaddr_in dstsock;
     make_sockaddr(dst.c_str(), &dstsock);
     cl = new rpcc(dstsock);
     if (cl->bind() < 0) {
         printf("lock_client: call bind\n");
     }
+    releaser_stop = false;
+    VERIFY(pthread_create(&releaser_thread, NULL, releaser_main, this) == 0);
 }
 
+// Give back the cached locks, so that other clients do not wait for a client that is gone.
 lock_client::~lock_client()
 {
+    {
+        ScopedLock ml(&mutex);
+        releaser_stop = true;
+        VERIFY(pthread_cond_signal(&releaser_cond) == 0);
+    }
+    VERIFY(pthread_join(releaser_thread, NULL) == 0);
+
+    std::vector<lock_protocol::lockid_t> cached;
+    {
+        ScopedLock ml(&mutex);
+        for (std::map<lock_protocol::lockid_t, cached_lock>::iterator it = locks.begin(); it != locks.end(); ++it)
+            if (it->second.status == FREE) {
+                it->second.status = RELEASING;
+                cached.push_back(it->first);
+            }
+    }
+    for (size_t i = 0; i < cached.size(); i++)
+        give_back(cached[i]);
+
     delete cl;
+    delete rlsrpc;
+    VERIFY(pthread_mutex_destroy(&mutex) == 0);
+    VERIFY(pthread_cond_destroy(&cond) == 0);
+    VERIFY(pthread_cond_destroy(&retry_cond) == 0);
+    VERIFY(pthread_cond_destroy(&releaser_cond) == 0);
 }
 
 int lock_client::stat(lock_protocol::lockid_t lid)
@@ -35,12 +73,148 @@ lock_protocol::status lock_client::acquire(lock_protocol::lockid_t lid)
 {
     // Your lab4 code goes here
     int r;
-    return cl->call(lock_protocol::acquire, cl->id(), lid, r);
+    ScopedLock ml(&mutex);
+
+    // Wait for another thread of this client using it, acquiring it or giving it back.
+    while (locks[lid].status != NONE && locks[lid].status != FREE)
+        VERIFY(pthread_cond_wait(&cond, &mutex) == 0);
+
+    cached_lock &l = locks[lid];
+    if (l.status == FREE) { // Cached, the server is not asked.
+        l.status = LOCKED;
+        return lock_protocol::OK;
+    }
+
+    l.status = ACQUIRING;
+    lock_protocol::status ret;
+    while (true) {
+        l.retried = false;
+        VERIFY(pthread_mutex_unlock(&mutex) == 0);
+        ret = cl->call(lock_protocol::acquire, lid, id, r);
+        VERIFY(pthread_mutex_lock(&mutex) == 0);
+        if (ret != lock_protocol::RETRY)
+            break;
+
+        // A retry may already have come while the answer was on its way.
+        struct timespec now, deadline;
+        clock_gettime(CLOCK_REALTIME, &now);
+        add_timespec(now, LOCK_RETRY_MS, &deadline);
+        while (!l.retried)
+            if (pthread_cond_timedwait(&retry_cond, &mutex, &deadline) == ETIMEDOUT)
+                break;
+    }
+
+    if (ret != lock_protocol::OK) {
+        l.status = NONE;
+        l.revoked = false;
+        VERIFY(pthread_cond_broadcast(&cond) == 0);
+        return ret;
+    }
+
+    l.status = LOCKED;
+    if (lu)
+        lu->doacquire(lid);
+    return ret;
 }
 
 lock_protocol::status lock_client::release(lock_protocol::lockid_t lid)
 {
     // Your lab4 code goes here
+    {
+        ScopedLock ml(&mutex);
+        cached_lock &l = locks[lid];
+        if (!l.revoked) { // Kept for the next thread of this client.
+            l.status = FREE;
+            VERIFY(pthread_cond_broadcast(&cond) == 0);
+            return lock_protocol::OK;
+        }
+        l.status = RELEASING;
+    }
+
+    return give_back(lid);
+}
+
+/* Give back a lock being released to the server, after the data it covers is written back.
+ * If that fails, the lock is kept, free and still revoked, and the releaser thread tries again later. */
+lock_protocol::status lock_client::give_back(lock_protocol::lockid_t lid)
+{
     int r;
-    return cl->call(lock_protocol::release, cl->id(), lid, r);
+    lock_protocol::status ret = lock_protocol::OK;
+
+    if (lu)
+        ret = lu->dorelease(lid);
+    if (ret == lock_protocol::OK)
+        ret = cl->call(lock_protocol::release, lid, id, r);
+
+    ScopedLock ml(&mutex);
+    cached_lock &l = locks[lid];
+    if (ret == lock_protocol::OK) {
+        l.status = NONE;
+        l.revoked = false;
+    } else {
+        printf("lock_client: cannot give back lock %llu\n", lid);
+        l.status = FREE;
+        to_release.push_back(lid);
+    }
+    VERIFY(pthread_cond_broadcast(&cond) == 0);
+    return ret;
+}
+
+// Give back the revoked locks that are free.
+void *lock_client::releaser_main(void *arg)
+{
+    lock_client *lc = (lock_client *)arg;
+    ScopedLock ml(&lc->mutex);
+
+    while (true) {
+        while (!lc->releaser_stop && lc->to_release.empty())
+            VERIFY(pthread_cond_wait(&lc->releaser_cond, &lc->mutex) == 0);
+        if (lc->releaser_stop)
+            break;
+
+        lock_protocol::lockid_t lid = lc->to_release.front();
+        lc->to_release.pop_front();
+
+        cached_lock &l = lc->locks[lid];
+        if (l.status != FREE || !l.revoked) // In use again, given back by its release(), or given back already.
+            continue;
+        l.status = RELEASING;
+
+        VERIFY(pthread_mutex_unlock(&lc->mutex) == 0);
+        lock_protocol::status ret = lc->give_back(lid);
+        VERIFY(pthread_mutex_lock(&lc->mutex) == 0);
+
+        if (ret != lock_protocol::OK && !lc->releaser_stop) { // Not again at once.
+            struct timespec now, deadline;
+            clock_gettime(CLOCK_REALTIME, &now);
+            add_timespec(now, LOCK_RETRY_MS, &deadline);
+            pthread_cond_timedwait(&lc->releaser_cond, &lc->mutex, &deadline);
+        }
+    }
+
+    return NULL;
+}
+
+rlock_protocol::status lock_client::retry(lock_protocol::lockid_t lid, int &)
+{
+    ScopedLock ml(&mutex);
+    locks[lid].retried = true;
+    VERIFY(pthread_cond_broadcast(&retry_cond) == 0);
+    return rlock_protocol::OK;
+}
+
+/* Called back by the server when others wait for a lock. It is given back now if it is free,
+ * or when the thread holding it releases it. */
+rlock_protocol::status lock_client::revoke(lock_protocol::lockid_t lid, int &)
+{
+    ScopedLock ml(&mutex);
+    cached_lock &l = locks[lid];
+    if (l.status == NONE) // Given back already.
+        return rlock_protocol::OK;
+    l.revoked = true;
+    if (l.status == FREE) {
+        to_release.push_back(lid);
+        VERIFY(pthread_cond_signal(&releaser_cond) == 0);
+    }
+    return rlock_protocol::OK;
 }
@@ -7,17 +7,61 @@
 #include "lock_protocol.h"
 #include "rpc.h"
 #include <vector>
+#include <map>
+#include <deque>
+#include <pthread.h>
 
-// Client interface to the lock server
+/* Told about the locks cached by a client, so that it can cache the data they cover.
+ * doacquire() is called when the server grants a lock, and dorelease() before it is given back to the server,
+ * which should write back the cached data it covers. If that fails, the lock is kept and given back later.
+ */
+class lock_release_user {
+public:
+    virtual void doacquire(lock_protocol::lockid_t) {}
+    virtual lock_protocol::status dorelease(lock_protocol::lockid_t) = 0;
+    virtual ~lock_release_user() {}
+};
+
+/* Client interface to the lock server. Locks granted by the server are kept after release(),
+ * so the threads of this client acquire them again without asking it, until the server revokes them.
+ * A revoked lock is given back once no thread holds it, by the thread releasing it or by the releaser thread.
+ * An acquire answered RETRY waits for the server to call retry() once the lock is released,
+ * or asks again after LOCK_RETRY_MS.
+ */
 class lock_client {
 protected:
+    enum lock_status { NONE, FREE, LOCKED, ACQUIRING, RELEASING };
+    struct cached_lock {
+        lock_status status;
+        bool revoked; // The server wants it back.
+        bool retried; // The server has called retry() since it was asked.
+        cached_lock(): status(NONE), revoked(false), retried(false) {}
+    };
+
     rpcc *cl;
+    rpcs *rlsrpc; // Takes the calls back of the lock server.
+    std::string id; // Address of rlsrpc, by which the server knows this client.
+    lock_release_user *lu;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // Signaled when a lock changes status.
+    pthread_cond_t retry_cond; // Signaled when a retry comes.
+    std::map<lock_protocol::lockid_t, cached_lock> locks;
+
+    pthread_cond_t releaser_cond; // Signaled when a free lock is revoked.
+    pthread_t releaser_thread;
+    bool releaser_stop;
+    std::deque<lock_protocol::lockid_t> to_release; // Free locks to give back.
+    lock_protocol::status give_back(lock_protocol::lockid_t lid);
+    static void *releaser_main(void *arg);
+
 public:
-    lock_client(std::string d);
+    lock_client(std::string d, lock_release_user *l = 0);
     virtual ~lock_client();
     virtual lock_protocol::status acquire(lock_protocol::lockid_t);
     virtual lock_protocol::status release(lock_protocol::lockid_t);
     virtual lock_protocol::status stat(lock_protocol::lockid_t);
+    rlock_protocol::status retry(lock_protocol::lockid_t, int &);
+    rlock_protocol::status revoke(lock_protocol::lockid_t, int &);
 };
 
 #endif
@@ -17,4 +17,18 @@ public:
     };
 };
 
+// Calls from the lock server back to its clients.
+class rlock_protocol {
+public:
+    enum xxstatus { OK, RPCERR };
+    typedef int status;
+    enum rpc_numbers {
+        retry = 0x8001, // A lock that a client was told to RETRY has been released.
+        revoke // Give back a lock that others are waiting for, once it is not in use.
+    };
+};
+
+#define RLOCK_CALL_MS 1000 // How long the lock server waits for a client to take a call back.
+#define LOCK_RETRY_MS 1000 // How long a client waits for a retry before asking again.
+
 #endif
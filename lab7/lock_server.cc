@@ -1,6 +1,8 @@
 // the lock server implementation
 
 #include "lock_server.h"
+#include "handle.h"
+#include "slock.h"
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
@@ -9,11 +11,64 @@
 lock_server::lock_server()
 {
     VERIFY(pthread_mutex_init(&mutex, NULL) == 0);
+    VERIFY(pthread_cond_init(&callback_cond, NULL) == 0);
+    VERIFY(pthread_create(&callback_thread, NULL, callback_main, this) == 0);
 }
 
 lock_server::~lock_server()
 {
     VERIFY(pthread_mutex_destroy(&mutex) == 0);
+    VERIFY(pthread_cond_destroy(&callback_cond) == 0);
+}
+
+void *lock_server::callback_main(void *arg)
+{
+    ((lock_server *)arg)->send_callbacks();
+    return NULL;
+}
+
+void lock_server::send_callbacks()
+{
+    while (true) {
+        lock_callback cb(0, "", 0);
+        {
+            ScopedLock ml(&mutex);
+            while (callbacks.empty())
+                VERIFY(pthread_cond_wait(&callback_cond, &mutex) == 0);
+            cb = callbacks.front();
+            callbacks.pop_front();
+        }
+
+        int r;
+        handle h(cb.id);
+        rpcc *cl = h.safebind();
+        if (cl && cl->call(cb.proc, cb.lid, r, rpcc::to(RLOCK_CALL_MS)) == rlock_protocol::OK)
+            continue;
+
+        printf("%s of lock %llu to %s failed\n", cb.proc == rlock_protocol::revoke ? "revoke" : "retry",
+                cb.lid, cb.id.c_str());
+        if (cl)
+            h.failed();
+
+        // A client that misses its retry asks again after LOCK_RETRY_MS. A missed revoke is sent again then.
+        if (cb.proc == rlock_protocol::revoke) {
+            ScopedLock ml(&mutex);
+            lock_state &ls = lock_table[cb.lid];
+            if (ls.flag && ls.holder == cb.id)
+                ls.revoke_sent = false;
+        }
+    }
+}
+
+/* Ask the holder of a lock to give it back, once for every time it is granted.
+ * The caller should hold mutex. */
+void lock_server::revoke_p(lock_protocol::lockid_t lid, lock_state &ls)
+{
+    if (ls.revoke_sent)
+        return;
+    ls.revoke_sent = true;
+    callbacks.push_back(lock_callback(rlock_protocol::revoke, ls.holder, lid));
+    VERIFY(pthread_cond_signal(&callback_cond) == 0);
 }
 
 lock_protocol::status lock_server::stat(int clt, lock_protocol::lockid_t lid, int &r)
@@ -29,28 +84,34 @@ lock_protocol::status lock_server::stat(int clt, lock_protocol::lockid_t lid, in
     return ret;
 }
 
-lock_protocol::status lock_server::acquire(int clt, lock_protocol::lockid_t lid, int &r)
+lock_protocol::status lock_server::acquire(lock_protocol::lockid_t lid, std::string id, int &r)
 {
     lock_protocol::status ret = lock_protocol::OK;
 
     // Your lab4 code goes here
-    printf("acquire request from clt %d\n", clt);
+    printf("acquire request from %s\n", id.c_str());
 
     VERIFY(pthread_mutex_lock(&mutex) == 0);
 
-    if (lock_table.find(lid) != lock_table.end()) { // Lock exists.
-        while (lock_table[lid].flag) { // Lock is acquired, wait for a chance to acquire it.
-            // Give release() a chance to release lock during waiting.
-            VERIFY(pthread_mutex_unlock(&mutex) == 0);
-            VERIFY(pthread_mutex_lock(&mutex) == 0);
-        }
-
-        // Acquire it.
-        lock_table[lid].flag = true;
-        lock_table[lid].holder = clt;
-        lock_table[lid].nacquire++;
-    } else { // Lock does not exist, create a new lock and acquire it.
-        lock_table[lid] = lock_state(true, clt, 1);
+    lock_state &ls = lock_table[lid]; // Created free if it does not exist.
+    if (ls.flag && ls.holder != id) {
+        // Lock is acquired, the client is called back when release() releases it.
+        std::list<std::string>::iterator it = ls.waiting.begin();
+        while (it != ls.waiting.end() && *it != id)
+            it++;
+        if (it == ls.waiting.end())
+            ls.waiting.push_back(id);
+        revoke_p(lid, ls);
+        ret = lock_protocol::RETRY;
+    } else if (!ls.flag) {
+        // Acquire it, and have it back at once if others are waiting for it.
+        ls.flag = true;
+        ls.holder = id;
+        ls.nacquire++;
+        ls.revoke_sent = false;
+        ls.waiting.remove(id);
+        if (!ls.waiting.empty())
+            revoke_p(lid, ls);
     }
 
     VERIFY(pthread_mutex_unlock(&mutex) == 0);
@@ -59,12 +120,12 @@ lock_protocol::status lock_server::acquire(int clt, lock_protocol::lockid_t lid,
     return ret;
 }
 
-lock_protocol::status lock_server::release(int clt, lock_protocol::lockid_t lid, int &r)
+lock_protocol::status lock_server::release(lock_protocol::lockid_t lid, std::string id, int &r)
 {
     lock_protocol::status ret = lock_protocol::OK;
 
     // Your lab4 code goes here
-    printf("release request from clt %d\n", clt);
+    printf("release request from %s\n", id.c_str());
 
     VERIFY(pthread_mutex_lock(&mutex) == 0);
 
@@ -73,11 +134,17 @@ lock_protocol::status lock_server::release(int clt, lock_protocol::lockid_t lid,
      * 2. Lock lid is not acquired.
      * 3. A client is trying to release a lock acquired by another client.
      */
-    if (lock_table.find(lid) == lock_table.end() || !lock_table[lid].flag || lock_table[lid].holder != clt) {
+    if (lock_table.find(lid) == lock_table.end() || !lock_table[lid].flag || lock_table[lid].holder != id) {
         r = -1; // Fail to release.
     } else {
-        // Release it.
-        lock_table[lid].flag = false;
+        // Release it, and tell the first waiting client to ask again.
+        lock_state &ls = lock_table[lid];
+        ls.flag = false;
+        if (!ls.waiting.empty()) {
+            callbacks.push_back(lock_callback(rlock_protocol::retry, ls.waiting.front(), lid));
+            ls.waiting.pop_front();
+            VERIFY(pthread_cond_signal(&callback_cond) == 0);
+        }
         r = 0;
     }
 
@@ -6,6 +6,8 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <deque>
 #include <pthread.h>
 #include "lock_protocol.h"
 #include "lock_client.h"
@@ -15,23 +17,44 @@
 class lock_state {
 public:
     bool flag; // Whether this lock is available or acquired.
-    int holder; // The client that is holding this lock.
+    std::string holder; // The client that is holding this lock.
     int nacquire; // The times that this lock has been acquired.
-    lock_state() {}
-    lock_state(bool f, int h, int n): flag(f), holder(h), nacquire(n) {}
+    std::list<std::string> waiting; // Clients told to RETRY, in the order they asked.
+    bool revoke_sent; // Whether the holder has been asked to give the lock back.
+    lock_state(): flag(false), nacquire(0), revoke_sent(false) {}
 };
 
+// A call back to a client, revoke or retry.
+struct lock_callback {
+    unsigned int proc;
+    std::string id;
+    lock_protocol::lockid_t lid;
+    lock_callback(unsigned int proc, const std::string &id, lock_protocol::lockid_t lid): proc(proc), id(id), lid(lid) {}
+};
+
+/* Clients are identified by the address of their callback server, and keep the locks granted to them
+ * until they are revoked. An acquire of a held lock is answered RETRY at once rather than waiting
+ * in an RPC thread, and the holder is asked to give it back. The first waiting client is called back
+ * when it is released. The calls back are made by a thread of their own, so that no handler waits for a client.
+ */
 class lock_server {
 protected:
     std::map<lock_protocol::lockid_t, lock_state> lock_table;
     pthread_mutex_t mutex;
+    std::deque<lock_callback> callbacks; // Calls back to make.
+    pthread_cond_t callback_cond; // Signaled when a call back is queued.
+    pthread_t callback_thread;
+
+    void revoke_p(lock_protocol::lockid_t lid, lock_state &ls);
+    static void *callback_main(void *);
+    void send_callbacks();
 
 public:
     lock_server();
     ~lock_server();
     lock_protocol::status stat(int clt, lock_protocol::lockid_t lid, int &);
-    lock_protocol::status acquire(int clt, lock_protocol::lockid_t lid, int &);
-    lock_protocol::status release(int clt, lock_protocol::lockid_t lid, int &);
+    lock_protocol::status acquire(lock_protocol::lockid_t lid, std::string id, int &);
+    lock_protocol::status release(lock_protocol::lockid_t lid, std::string id, int &);
 };
 
 #endif
@@ -0,0 +1,145 @@
+// erasure code implementation.
+
+#include "parity.h"
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, as used by RAID-6.
+#define GF_POLY 0x1d
+
+static unsigned char gf_exp[512], gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init()
+{
+    unsigned int x = 1;
+
+    for (int i = 0; i < 255; ++i) {
+        gf_exp[i] = gf_exp[i + 255] = (unsigned char)x;
+        gf_log[x] = (unsigned char)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x100 | GF_POLY;
+    }
+}
+
+static inline unsigned char gf_mul(unsigned char a, unsigned char b)
+{
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static inline unsigned char gf_inv(unsigned char a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+static inline unsigned char gf_mul2(unsigned char a)
+{
+    return (unsigned char)(a << 1 ^ (a & 0x80 ? GF_POLY : 0));
+}
+
+// Multiply the 8 bytes of a word by 2 in GF(2^8) at once.
+static inline uint64_t gf_mul2_word(uint64_t v)
+{
+    uint64_t high = v & 0x8080808080808080ULL;
+    return (v & 0x7f7f7f7f7f7f7f7fULL) << 1 ^ (high >> 7) * GF_POLY;
+}
+
+void parity_compute(const unsigned char *const *data, int k, size_t len, unsigned char *p, unsigned char *q)
+{
+    for (size_t off = 0; off < len; off += sizeof(uint64_t)) {
+        uint64_t pw = 0, qw = 0, d;
+
+        // Horner's rule: Q = ((data[k-1] * g + data[k-2]) * g + ...) * g + data[0].
+        for (int i = k - 1; i >= 0; --i) {
+            memcpy(&d, data[i] + off, sizeof(d));
+            pw ^= d;
+            qw = gf_mul2_word(qw) ^ d;
+        }
+
+        memcpy(p + off, &pw, sizeof(pw));
+        if (q)
+            memcpy(q + off, &qw, sizeof(qw));
+    }
+}
+
+// P changes by the XOR of the old and new data, Q by that delta times g^i.
+void parity_update(int i, const unsigned char *old_data, const unsigned char *new_data, size_t len,
+        unsigned char *p, unsigned char *q)
+{
+    size_t off = 0;
+
+    for (; off + sizeof(uint64_t) <= len; off += sizeof(uint64_t)) {
+        uint64_t o, n, w;
+
+        memcpy(&o, old_data + off, sizeof(o));
+        memcpy(&n, new_data + off, sizeof(n));
+        uint64_t delta = o ^ n;
+
+        memcpy(&w, p + off, sizeof(w));
+        w ^= delta;
+        memcpy(p + off, &w, sizeof(w));
+
+        if (q) {
+            for (int j = 0; j < i; ++j)
+                delta = gf_mul2_word(delta);
+            memcpy(&w, q + off, sizeof(w));
+            w ^= delta;
+            memcpy(q + off, &w, sizeof(w));
+        }
+    }
+
+    for (; off < len; ++off) {
+        unsigned char delta = old_data[off] ^ new_data[off];
+
+        p[off] ^= delta;
+        if (q) {
+            for (int j = 0; j < i; ++j)
+                delta = gf_mul2(delta);
+            q[off] ^= delta;
+        }
+    }
+}
+
+void parity_recover(unsigned char *const *data, int k, size_t len, const unsigned char *p, const unsigned char *q,
+        int x, int y)
+{
+    if (y < 0) { // XOR of P and the other blocks.
+        for (size_t off = 0; off < len; off += sizeof(uint64_t)) {
+            uint64_t w, d;
+
+            memcpy(&w, p + off, sizeof(w));
+            for (int i = 0; i < k; ++i) {
+                if (i == x)
+                    continue;
+                memcpy(&d, data[i] + off, sizeof(d));
+                w ^= d;
+            }
+            memcpy(data[x] + off, &w, sizeof(w));
+        }
+        return;
+    }
+
+    pthread_once(&gf_once, gf_init);
+
+    /* With Pxy = data[x] + data[y] and Qxy = g^x * data[x] + g^y * data[y] left by the others,
+     * data[x] = (Qxy + g^y * Pxy) / (g^x + g^y) and data[y] = Pxy + data[x].
+     */
+    unsigned char gy = gf_exp[y];
+    unsigned char div = gf_inv(gf_exp[x] ^ gf_exp[y]);
+
+    for (size_t j = 0; j < len; ++j) {
+        unsigned char pxy = p[j], qxy = 0;
+
+        for (int i = k - 1; i >= 0; --i) {
+            unsigned char d = i == x || i == y ? 0 : data[i][j];
+            pxy ^= d;
+            qxy = gf_mul2(qxy) ^ d;
+        }
+        qxy ^= q[j];
+
+        data[x][j] = gf_mul(qxy ^ gf_mul(gy, pxy), div);
+        data[y][j] = pxy ^ data[x][j];
+    }
+}
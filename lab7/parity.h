@@ -0,0 +1,27 @@
+// erasure code interface.
+
+#ifndef parity_h
+#define parity_h
+
+#include <stddef.h>
+
+/* Parity over k data blocks of len bytes (a multiple of 8), in the style of RAID-6.
+ * P is the XOR of the data blocks, Q is the sum of g^i * data[i] over GF(2^8) with generator g = 2.
+ * P alone recovers one lost data block, P and Q together recover two.
+ * Both are computed a 64-bit word at a time.
+ */
+void parity_compute(const unsigned char *const *data, int k, size_t len, unsigned char *p, unsigned char *q);
+
+/* Update p and q for a change of len bytes of data block i from old_data to new_data. All pointers are at the
+ * offset of the change, which needs not be aligned. Only the change is read, so a small write updates little.
+ */
+void parity_update(int i, const unsigned char *old_data, const unsigned char *new_data, size_t len,
+        unsigned char *p, unsigned char *q);
+
+/* Rebuild the lost data blocks data[x] and data[y] (y < 0 if only one is lost) in place from the others.
+ * q is only needed when two blocks are lost.
+ */
+void parity_recover(unsigned char *const *data, int k, size_t len, const unsigned char *p, const unsigned char *q,
+        int x, int y);
+
+#endif
@@ -208,8 +208,11 @@ unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
 
+// vectors are sent as a count followed by the elements. elements
+// may be tagged structures (e.g. the ops of a compound request)
+// whose own operators only send the fields their tag uses.
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
@@ -222,9 +225,13 @@ operator>>(unmarshall &u, std::vector<C> &v)
 {
 	unsigned n;
 	u >> n;
+	// stop at the first element that fails to unmarshall, so that
+	// a bogus count cannot make us allocate without bound.
 	for(unsigned i = 0; i < n; i++){
 		C z;
 		u >> z;
+		if(!u.ok())
+			break;
 		v.push_back(z);
 	}
 	return u;
@@ -0,0 +1,118 @@
+//
+// Count the RPCs and time of getting the attributes of a file,
+// the way fuse.cc used to (isfile, isdir, issymlink, then getfile,
+// getdir or getsymlink), and with yfs_client::stat().
+//
+// Run it against idle servers, other clients' RPCs are counted too:
+//   ./stat_bench extent_port lock_port [count] > /dev/null
+// yfs_client logs to stdout, the results are printed to stderr.
+//
+
+#include "yfs_client.h"
+#include "extent_client.h"
+#include "lock_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+yfs_client *yfs;
+extent_client *ec;
+lock_client *lc;
+
+// The attributes of a file, as fuse.cc got them before yfs_client::stat().
+static void old_getattr(yfs_client::inum inum)
+{
+    printf("getattr %016llx %d\n", inum, yfs->isfile(inum));
+
+    if (yfs->isfile(inum)) {
+        yfs_client::fileinfo info;
+        yfs->getfile(inum, info);
+    } else if (yfs->isdir(inum)) {
+        yfs_client::dirinfo info;
+        yfs->getdir(inum, info);
+    } else if (yfs->issymlink(inum)) {
+        yfs_client::fileinfo info;
+        yfs->getsymlink(inum, info);
+    }
+}
+
+static void new_getattr(yfs_client::inum inum)
+{
+    struct stat st;
+    yfs->stat(inum, st);
+}
+
+static unsigned long long getattr_requests()
+{
+    std::map<std::string, unsigned long long> stats;
+    VERIFY(ec->stats(stats) == extent_protocol::OK);
+    return stats["getattr_requests"];
+}
+
+static double now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+/* Get the attributes of inum count times, waiting pause_ms between them.
+ * Every acquire of its lock is followed by a release, so a lock costs 2 RPCs. */
+static void bench(const char *name, void (*getattr)(yfs_client::inum), yfs_client::inum inum,
+        int count, int pause_ms)
+{
+    unsigned long long ext0 = getattr_requests();
+    int lck0 = lc->stat(inum);
+    double us = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (pause_ms)
+            usleep(pause_ms * 1000);
+        double t = now_us();
+        getattr(inum);
+        us += now_us() - t;
+    }
+
+    double ext = (double)(getattr_requests() - ext0) / count;
+    double lck = 2.0 * (lc->stat(inum) - lck0) / count;
+    fprintf(stderr, "%-24s %6.2f extent + %6.2f lock = %6.2f RPCs, %8.1f us per stat\n",
+            name, ext, lck, ext + lck, us / count);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s extent_port lock_port [count]\n", argv[0]);
+        exit(1);
+    }
+
+    int count = argc > 3 ? atoi(argv[3]) : 1000;
+    if (count < 1)
+        count = 1;
+
+    yfs = new yfs_client(argv[1], argv[2], "");
+    ec = new extent_client(argv[1]);
+    lc = new lock_client(argv[2]);
+
+    char name[64];
+    yfs_client::inum inum;
+    snprintf(name, sizeof(name), "stat_bench.%d", getpid());
+    VERIFY(yfs->create(1, name, 0666, inum) == yfs_client::OK);
+
+    // Idle for a lease period first, so that attributes are leased.
+    usleep((ATTR_LEASE_MS + 20) * 1000);
+    bench("old getattr", old_getattr, inum, count, 0);
+    bench("yfs_client::stat", new_getattr, inum, count, 0);
+
+    // Each stat after the leases have expired.
+    int cold = count < 10 ? count : 10;
+    bench("old getattr (cold)", old_getattr, inum, cold, ATTR_LEASE_MS + 20);
+    bench("yfs_client::stat (cold)", new_getattr, inum, cold, ATTR_LEASE_MS + 20);
+
+    VERIFY(yfs->unlink(1, name) == yfs_client::OK);
+    delete yfs;
+    delete ec;
+    delete lc;
+    return 0;
+}
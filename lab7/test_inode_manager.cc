@@ -0,0 +1,444 @@
+/*
+ * test_inode_manager
+ *
+ * Test the storage layer without servers: directories stored as
+ * hash tables, byte ranges of compressed and packed files, and the
+ * rebuild of lost disks and the growth of the inode table, on an
+ * inode_manager of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "inode_manager.h"
+#include "hashed_dir.h"
+
+#define TEST_ERR(fmt, args...) do { \
+    fprintf(stderr, "test_inode_manager: " fmt "\n", ##args); \
+    exit(1); \
+} while (0)
+
+inode_manager *im;
+int name_digits = 5; // Longer names make directories hold fewer entries.
+
+std::string entry_name(int i)
+{
+    char name[256];
+    sprintf(name, "file%0*d", name_digits, i);
+    return name;
+}
+
+void check_entry(uint32_t dir, int i, bool present)
+{
+    hashed_dir d(im, dir);
+    extent_protocol::extentid_t inum = 0;
+
+    if (d.lookup(entry_name(i), inum) != present)
+        TEST_ERR("lookup(%s) %s", entry_name(i).c_str(), present ? "not found" : "found a removed entry");
+    if (present && inum != (extent_protocol::extentid_t)(1000 + i))
+        TEST_ERR("lookup(%s) returned %llu, not %d", entry_name(i).c_str(), inum, 1000 + i);
+}
+
+// Insert the entry of i, return the error of can_insert().
+int insert_entry(uint32_t dir, int i)
+{
+    hashed_dir d(im, dir);
+    int r = d.can_insert(entry_name(i));
+
+    if (r == extent_protocol::OK)
+        d.insert(entry_name(i), 1000 + i);
+    return r;
+}
+
+void remove_entry(uint32_t dir, int i)
+{
+    hashed_dir d(im, dir);
+    extent_protocol::extentid_t inum;
+
+    if (d.remove(entry_name(i), inum) != extent_protocol::OK || inum != (extent_protocol::extentid_t)(1000 + i))
+        TEST_ERR("remove(%s) failed", entry_name(i).c_str());
+}
+
+// Whether a directory is in the hashed layout, and how many buckets it has.
+bool hashed_layout(uint32_t dir, uint32_t &nbuckets)
+{
+    std::string buf;
+    uint32_t magic;
+
+    im->read_file_range(dir, 0, 2 * sizeof(uint32_t), buf);
+    if (buf.size() < 2 * sizeof(uint32_t))
+        return false;
+    memcpy(&magic, buf.data(), sizeof(magic));
+    memcpy(&nbuckets, buf.data() + sizeof(magic), sizeof(nbuckets));
+    return magic == DIR_MAGIC;
+}
+
+// Check that the directory lists entries first..last-1, except the removed ones, in order.
+void check_list(uint32_t dir, int first, int last, const std::vector<bool> &removed)
+{
+    std::string content;
+    std::vector<extent_protocol::dirent> list;
+
+    im->read_file(dir, content);
+    hashed_dir::list(content, list);
+
+    size_t k = 0;
+    for (int i = first; i < last; ++i) {
+        if (removed[i])
+            continue;
+        if (k >= list.size() || list[k].name != entry_name(i))
+            TEST_ERR("entry %d listed as %s, not %s", (int)k,
+                    k < list.size() ? list[k].name.c_str() : "nothing", entry_name(i).c_str());
+        k++;
+    }
+    if (k != list.size())
+        TEST_ERR("%d entries listed, not %d", (int)list.size(), (int)k);
+}
+
+// A growing directory splits its buckets, and finds and lists every entry after that.
+void test_splits()
+{
+    uint32_t dir = im->alloc_inode(extent_protocol::T_DIR), nbuckets;
+    std::vector<bool> removed(1000, false);
+
+    printf("Hashed directory splits: ");
+    for (int i = 0; i < 1000; ++i)
+        if (insert_entry(dir, i) != extent_protocol::OK)
+            TEST_ERR("insert(%s) failed", entry_name(i).c_str());
+    if (!hashed_layout(dir, nbuckets) || nbuckets < 16)
+        TEST_ERR("%u buckets for 1000 entries", nbuckets);
+
+    for (int i = 0; i < 1000; i += 3) {
+        remove_entry(dir, i);
+        removed[i] = true;
+    }
+    for (int i = 0; i < 1000; ++i)
+        check_entry(dir, i, !removed[i]);
+    if (insert_entry(dir, 1) != extent_protocol::EXIST)
+        TEST_ERR("inserted %s twice", entry_name(1).c_str());
+    check_list(dir, 0, 1000, removed);
+
+    im->remove_file(dir);
+    printf("OK (%u buckets)\n", nbuckets);
+}
+
+// Write a directory in the flat layout with entries 0..n-1.
+uint32_t flat_dir(int n)
+{
+    uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+    std::string content;
+
+    for (int i = 0; i < n; ++i) {
+        extent_protocol::extentid_t inum = 1000 + i;
+        content += (char)entry_name(i).size();
+        content += entry_name(i);
+        content.append((const char*)&inum, sizeof(inum));
+    }
+    im->write_file(dir, content.data(), content.size());
+    return dir;
+}
+
+// Flat directories are read and shrunk in place, and converted on insert if they fit.
+void test_legacy()
+{
+    uint32_t dir = flat_dir(300), nbuckets;
+    std::vector<bool> removed(301, false);
+
+    printf("Flat directory conversion: ");
+    check_entry(dir, 7, true);
+    remove_entry(dir, 7);
+    removed[7] = true;
+    if (hashed_layout(dir, nbuckets))
+        TEST_ERR("converted by remove");
+    check_entry(dir, 7, false);
+
+    if (insert_entry(dir, 300) != extent_protocol::OK)
+        TEST_ERR("insert(%s) failed", entry_name(300).c_str());
+    if (!hashed_layout(dir, nbuckets))
+        TEST_ERR("not converted by insert");
+    for (int i = 0; i <= 300; ++i)
+        check_entry(dir, i, !removed[i]);
+    check_list(dir, 0, 301, removed);
+    im->remove_file(dir);
+
+    // A full flat directory fits in the hashed layout. One of long names does not, and is changed in place.
+    for (int k = 0; k < 2; ++k) {
+        name_digits = k ? 200 : 5;
+        int n = MAXFILE * BLOCK_DATA_SIZE / (1 + entry_name(0).size() + sizeof(extent_protocol::extentid_t)) - 1;
+        std::vector<bool> big_removed(n + 1, false);
+        dir = flat_dir(n);
+        remove_entry(dir, n / 2);
+        big_removed[n / 2] = true;
+        if (insert_entry(dir, n) != extent_protocol::OK)
+            TEST_ERR("insert into a full flat directory of %d entries failed", n);
+        if (hashed_layout(dir, nbuckets) != !k)
+            TEST_ERR("a full flat directory of %d entries %s", n, k ? "converted" : "not converted");
+        check_entry(dir, n, true);
+        check_entry(dir, n / 2, false);
+        check_list(dir, 0, n + 1, big_removed);
+        im->remove_file(dir);
+    }
+    name_digits = 5;
+    printf("OK\n");
+}
+
+// A hashed directory holds at least as many entries as a flat one, and rejects the ones beyond.
+void test_limit()
+{
+    uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+    int flat = MAXFILE * BLOCK_DATA_SIZE / (1 + entry_name(0).size() + sizeof(extent_protocol::extentid_t));
+    int n = 0;
+
+    printf("Hashed directory entry limit: ");
+    while (insert_entry(dir, n) == extent_protocol::OK)
+        n++;
+    if (n < flat)
+        TEST_ERR("full after %d entries, a flat directory holds %d", n, flat);
+    if (insert_entry(dir, n) != extent_protocol::IOERR)
+        TEST_ERR("a full directory took another entry");
+
+    // Room left by a removal is used again.
+    remove_entry(dir, 0);
+    if (insert_entry(dir, 0) != extent_protocol::OK)
+        TEST_ERR("insert after remove in a full directory failed");
+    check_entry(dir, n - 1, true);
+
+    im->remove_file(dir);
+    printf("OK (%d entries, %d flat)\n", n, flat);
+}
+
+unsigned long long im_stat(const char *name)
+{
+    std::map<std::string, unsigned long long> stats;
+
+    im->get_stats(stats);
+    return stats[name];
+}
+
+// Check that the file holds expected, read as a whole and in ranges.
+void check_file(uint32_t inum, const std::string &expected)
+{
+    std::string buf;
+    unsigned int size = expected.size();
+    unsigned int ranges[][2] = {
+        {0, 100}, {size / 3, 3000}, {COMPRESS_RUN_SIZE - 10, 20}, {size - 10, 100}, {size / 2, 1}, {size, 10}
+    };
+
+    im->read_file(inum, buf);
+    if (buf != expected)
+        TEST_ERR("read %u bytes, not the %u written", (unsigned int)buf.size(), size);
+
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+        unsigned int off = ranges[i][0], len = ranges[i][1];
+        if (off > size)
+            continue;
+        im->read_file_range(inum, off, len, buf);
+        if (buf != expected.substr(off, len))
+            TEST_ERR("read of %u bytes at %u of %u differs", len, off, size);
+    }
+}
+
+// Compressible data of size bytes, different for every seed.
+std::string text(unsigned int size, int seed)
+{
+    std::string data;
+    char line[64];
+
+    for (int i = 0; data.size() < size; ++i) {
+        sprintf(line, "line %d of text %d\n", i, seed);
+        data += line;
+    }
+    data.resize(size);
+    return data;
+}
+
+// Compressed files are read by the runs covering a range, and compressed once after being written in parts.
+void test_compressed_ranges()
+{
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+    std::string data = text(60000, 1);
+
+    printf("Compressed file ranges: ");
+#if COMPRESS
+    unsigned long long in = im_stat("compress_in_bytes");
+#endif
+    im->write_file(inum, data.data(), data.size());
+    check_file(inum, data);
+#if COMPRESS
+    if (im_stat("compress_in_bytes") - in != data.size())
+        TEST_ERR("a compressible file is not stored compressed");
+    unsigned long long before = im_stat("decompress_bytes");
+    std::string buf;
+    im->read_file_range(inum, 30000, 100, buf);
+    if (im_stat("decompress_bytes") - before > COMPRESS_RUN_SIZE * 2)
+        TEST_ERR("read 100 bytes by decompressing %llu", im_stat("decompress_bytes") - before);
+#endif
+
+    // A write to a part of the file.
+    data.replace(12345, 5000, text(5000, 2));
+    im->write_file_range(inum, 12345, data.data() + 12345, 5000);
+    check_file(inum, data);
+    im->remove_file(inum);
+
+    // A file written in parts, like a stream, is compressed once when complete.
+    inum = im->alloc_inode(extent_protocol::T_FILE);
+    data = text(50000, 3);
+#if COMPRESS
+    in = im_stat("compress_in_bytes");
+    unsigned long long ns = im_stat("compress_ns");
+#endif
+    for (unsigned int off = 0; off < data.size(); off += 8192)
+        im->write_file_range(inum, off, data.data() + off, data.size() - off < 8192 ? data.size() - off : 8192);
+#if COMPRESS
+    if (im_stat("compress_ns") != ns)
+        TEST_ERR("compressed while written in parts");
+    im->compress_file(inum);
+    if (im_stat("compress_in_bytes") - in != data.size())
+        TEST_ERR("compressed %llu bytes of a file of %u", im_stat("compress_in_bytes") - in,
+                (unsigned int)data.size());
+#endif
+    check_file(inum, data);
+
+    im->remove_file(inum);
+    printf("OK\n");
+}
+
+// Small files are packed into shared blocks, read and written in place, and moved out when they grow.
+void test_packed_ranges()
+{
+    uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+    std::string data = text(100, 4), buf;
+    unsigned long long slots = im_stat("tail_slots_used");
+
+    printf("Packed file ranges: ");
+    im->write_file(inum, data.data(), data.size());
+#if PACK_TAILS
+    if (im_stat("tail_slots_used") == slots)
+        TEST_ERR("a file of %u bytes is not packed", (unsigned int)data.size());
+#endif
+    im->read_file_range(inum, 10, 30, buf);
+    if (buf != data.substr(10, 30))
+        TEST_ERR("read of a packed file differs");
+
+    data.replace(50, 20, "twenty bytes written");
+    im->write_file_range(inum, 50, data.data() + 50, 20);
+    im->read_file(inum, buf);
+    if (buf != data)
+        TEST_ERR("write inside a packed file differs");
+
+    // Growing past PACK_MAX_SIZE moves the data to blocks of its own.
+    data += text(PACK_MAX_SIZE, 5);
+    im->write_file_range(inum, 100, data.data() + 100, data.size() - 100);
+    im->read_file(inum, buf);
+    if (buf != data)
+        TEST_ERR("write growing a packed file differs");
+    if (im_stat("tail_slots_used") != slots)
+        TEST_ERR("the slots of a grown file are not freed");
+
+    im->remove_file(inum);
+    printf("OK\n");
+}
+
+// Two lost data disks are rebuilt from the two parity disks, and their blocks are read before the rebuild finishes.
+void test_raid6_rebuild()
+{
+#if PARITY_DISKS > 1
+    std::vector<uint32_t> inums;
+    std::vector<std::string> contents;
+
+    printf("RAID-6 rebuild: ");
+    srandom(6);
+    for (int i = 0; i < 8; ++i) { // Random data, so that it takes blocks on every disk even if compressed.
+        std::string data;
+        for (int j = 0; j < 20000; ++j)
+            data.push_back((char)random());
+        inums.push_back(im->alloc_inode(extent_protocol::T_FILE));
+        contents.push_back(data);
+        im->write_file(inums[i], data.data(), data.size());
+    }
+
+    if (!im->replace_disk(0) || !im->replace_disk(2))
+        TEST_ERR("replacing two data disks failed");
+    if (im_stat("parity_lost_blocks") == 0)
+        TEST_ERR("no blocks lost after replacing two disks");
+    if (im->replace_disk(1))
+        TEST_ERR("a third data disk is replaced with only %d parity disks", PARITY_DISKS);
+
+    for (size_t i = 0; i < inums.size(); ++i)
+        check_file(inums[i], contents[i]);
+
+    // The rebuild thread finishes the rest.
+    for (int i = 0; i < 100 && im_stat("parity_lost_blocks"); ++i)
+        usleep(100 * 1000);
+    if (im_stat("parity_lost_blocks"))
+        TEST_ERR("%llu blocks still lost after the rebuild", im_stat("parity_lost_blocks"));
+
+    // The disks can be lost again once rebuilt.
+    if (!im->replace_disk(1) || !im->replace_disk(3))
+        TEST_ERR("replacing two rebuilt disks failed");
+    for (size_t i = 0; i < inums.size(); ++i) {
+        check_file(inums[i], contents[i]);
+        im->remove_file(inums[i]);
+    }
+    printf("OK\n");
+#endif
+}
+
+// The inode table grows by chunks once the static table is full, up to the chunk map or the free blocks.
+void test_inode_table()
+{
+    std::vector<uint32_t> inums;
+    uint32_t inum, last = 0;
+
+    printf("Inode table growth: ");
+    while ((inum = im->alloc_inode(extent_protocol::T_FILE)) != 0) {
+        inums.push_back(inum);
+        if (inum > last)
+            last = inum;
+    }
+    if (last <= INODE_NUM + 2 * INODE_CHUNK)
+        TEST_ERR("full at inode %u, after less than three chunks of %u", last, (unsigned int)INODE_CHUNK);
+    if (last > MAX_INUM)
+        TEST_ERR("inode %u allocated beyond the %u of a full chunk map", last, (unsigned int)MAX_INUM);
+
+    // Inodes of the static table and of the chunks hold files.
+    uint32_t probes[] = { inums[0], INODE_NUM + 1, INODE_NUM + INODE_CHUNK, INODE_NUM + INODE_CHUNK + 1, last };
+    for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i) {
+        std::string data = text(3000, probes[i]);
+        im->write_file(probes[i], data.data(), data.size());
+    }
+    for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i)
+        check_file(probes[i], text(3000, probes[i]));
+
+    // A freed inode of a chunk is allocated again.
+    im->remove_file(INODE_NUM + INODE_CHUNK + 1);
+    if (im->alloc_inode(extent_protocol::T_FILE) != INODE_NUM + INODE_CHUNK + 1)
+        TEST_ERR("the freed inode %d is not allocated again", INODE_NUM + INODE_CHUNK + 1);
+    if (im->alloc_inode(extent_protocol::T_FILE) != 0)
+        TEST_ERR("allocated an inode in a full table");
+
+    for (size_t i = 0; i < inums.size(); ++i)
+        im->remove_file(inums[i]);
+    printf("OK (%u inodes)\n", last);
+}
+
+int main()
+{
+    im = new inode_manager();
+
+    test_splits();
+    test_legacy();
+    test_limit();
+    test_compressed_ranges();
+    test_packed_ranges();
+    test_raid6_rebuild();
+    test_inode_table();
+
+    printf("test_inode_manager: Passed all tests.\n");
+    return 0;
+}
@@ -1,6 +1,7 @@
 // yfs client.  implements FS operations using extent and lock server
 #include "yfs_client.h"
 #include "extent_client.h"
+#include "slock.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -11,10 +12,6 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-static inline size_t maxsize2(size_t s1, size_t s2) {
-    return s1 > s2 ? s1 : s2;
-}
-
 // Macros for RPC error handling.
 
 #define EXT_RPC(xx) do { \
@@ -40,13 +37,147 @@ static inline size_t maxsize2(size_t s1, size_t s2) {
 yfs_client::yfs_client(std::string extent_dst, std::string lock_dst, const char* cert_file)
 {
     ec = new extent_client(extent_dst);
-    lc = new lock_client(lock_dst);
+    lc = new lock_client(lock_dst, ec); // Extents are cached while their locks are cached.
+    VERIFY(pthread_mutex_init(&dcache_mutex, NULL) == 0);
+    dcache_names = 0;
+    VERIFY(pthread_mutex_init(&batch_mutex, NULL) == 0);
+    VERIFY(pthread_cond_init(&batch_cond, NULL) == 0);
 }
 
 yfs_client::~yfs_client()
 {
+    delete lc; // Writes back the extents of the cached locks, so before ec.
     delete ec;
-    delete lc;
+    VERIFY(pthread_mutex_destroy(&dcache_mutex) == 0);
+    VERIFY(pthread_mutex_destroy(&batch_mutex) == 0);
+    VERIFY(pthread_cond_destroy(&batch_cond) == 0);
+}
+
+// Look up name in the dentry cache of parent, whose current lease expires at expiry. Return false on a miss.
+bool yfs_client::dcache_lookup(inum parent, unsigned long long expiry, const std::string &name, bool &found,
+        inum &ino)
+{
+    ScopedLock ml(&dcache_mutex);
+
+    std::map<inum, dentries>::iterator d = dcache.find(parent);
+    if (d == dcache.end() || d->second.expiry != expiry)
+        return false;
+
+    std::map<std::string, inum>::iterator it = d->second.names.find(name);
+    if (it == d->second.names.end())
+        return false;
+
+    found = it->second != 0;
+    if (found)
+        ino = it->second;
+    return true;
+}
+
+// Remember what name refers to in parent, looked up under the lease expiring at expiry.
+void yfs_client::dcache_insert(inum parent, unsigned long long expiry, const std::string &name, inum ino)
+{
+    ScopedLock ml(&dcache_mutex);
+
+    // Make room by dropping the names of directories whose leases have expired, or everything.
+    if (dcache_names >= DCACHE_SIZE) {
+        unsigned long long now = lease_clock_ms();
+        for (std::map<inum, dentries>::iterator it = dcache.begin(); it != dcache.end(); ) {
+            if (it->second.expiry <= now) {
+                dcache_names -= it->second.names.size();
+                dcache.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        if (dcache_names >= DCACHE_SIZE) {
+            dcache.clear();
+            dcache_names = 0;
+        }
+    }
+
+    dentries &d = dcache[parent];
+    if (d.expiry != expiry) { // Names known under an older lease.
+        dcache_names -= d.names.size();
+        d.names.clear();
+        d.expiry = expiry;
+    }
+    if (d.names.insert(std::make_pair(name, ino)).second)
+        dcache_names++;
+    else
+        d.names[name] = ino;
+}
+
+void yfs_client::dcache_forget(inum parent)
+{
+    ScopedLock ml(&dcache_mutex);
+
+    std::map<inum, dentries>::iterator it = dcache.find(parent);
+    if (it != dcache.end()) {
+        dcache_names -= it->second.names.size();
+        dcache.erase(it);
+    }
+}
+
+void yfs_client::dcache_forget_all()
+{
+    ScopedLock ml(&dcache_mutex);
+    dcache.clear();
+    dcache_names = 0;
+}
+
+// Apply a change of dir made of ops, in a batch with the changes of other threads to it.
+extent_protocol::status yfs_client::change_dir(inum dir, const std::vector<extent_protocol::op> &ops,
+        std::vector<extent_protocol::op_result> &results)
+{
+    staged_change c;
+    c.ops = ops;
+    c.ret = extent_protocol::OK;
+    c.done = false;
+
+    ScopedLock ml(&batch_mutex);
+
+    batches[dir].staged.push_back(&c);
+
+    // Wait while another batch is in flight, ours may be sent by whoever is first after it.
+    while (!c.done && batches[dir].busy)
+        VERIFY(pthread_cond_wait(&batch_cond, &batch_mutex) == 0);
+
+    if (!c.done) {
+        dir_batch &b = batches[dir];
+        std::list<staged_change*> batch;
+        std::vector<extent_protocol::op> all;
+        std::vector<extent_protocol::op_result> all_results;
+
+        batch.swap(b.staged);
+        b.busy = true;
+        for (std::list<staged_change*>::iterator it = batch.begin(); it != batch.end(); ++it)
+            all.insert(all.end(), (*it)->ops.begin(), (*it)->ops.end());
+
+        VERIFY(pthread_mutex_unlock(&batch_mutex) == 0);
+        printf("change_dir: %zu changes of %llu in %zu ops\n", batch.size(), dir, all.size());
+        extent_protocol::status ret = ec->compound(all, all_results);
+        VERIFY(pthread_mutex_lock(&batch_mutex) == 0);
+
+        // Give every change the results of its own ops.
+        size_t first = 0;
+        for (std::list<staged_change*>::iterator it = batch.begin(); it != batch.end(); ++it) {
+            staged_change *s = *it;
+            s->ret = ret;
+            if (ret == extent_protocol::OK)
+                s->results.assign(all_results.begin() + first, all_results.begin() + first + s->ops.size());
+            first += s->ops.size();
+            s->done = true;
+        }
+
+        dir_batch &nb = batches[dir];
+        nb.busy = false;
+        if (nb.staged.empty())
+            batches.erase(dir);
+        VERIFY(pthread_cond_broadcast(&batch_cond) == 0);
+    }
+
+    results.swap(c.results);
+    return c.ret;
 }
 
 bool yfs_client::filename_valid(std::string name)
@@ -57,10 +188,10 @@ bool yfs_client::filename_valid(std::string name)
 
 bool yfs_client::inum_valid(inum inum) // Check whether inum is in the possible range.
 {
-    return inum >= 1 && inum <= INODE_NUM;
+    return inum >= 1 && inum <= MAX_INUM;
 }
 
-// Dir entry layout: |<file name length>|<file name>|<inum>|
+// Directory entries are stored and parsed by the extent server, see hashed_dir.
 
 int yfs_client::readdir_p(inum dir, std::list<dirent> &list)
 {
@@ -74,34 +205,18 @@ int yfs_client::readdir_p(inum dir, std::list<dirent> &list)
 
     list.clear();
 
-    if (!isdir_p(dir))
+    if (!inum_valid(dir))
         return IOERR;
 
-    std::istringstream ist;
-    std::string content;
-    char c;
-    char buf[MAX_FILENAME + 1];
+    std::vector<extent_protocol::dirent> entries;
     dirent de;
-    int namelen;
 
-    EXT_RPC(ec->get(dir, content));
-
-    ist.str(content);
-
-    while (ist.get(c)) { // Read next file name length.
-        namelen = (int)(unsigned char)c;
-
-        // Read file name.
-        // Note: not using ist.get(buf, namelen) because it will stop at '\n'!
-        if (!ist.read(buf, namelen))
-            break;
-
-        de.name = std::string(buf, namelen); // Specify size because istringstream::read will not append '\0'.
-
-        // Read inode number.
-        if (!ist.read((char*)&de.inum, sizeof(inum)))
-            break;
+    // The extent server parses the directory, and fails if dir is not a directory.
+    EXT_RPC(ec->dir_list(dir, entries));
 
+    for (std::vector<extent_protocol::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        de.name = it->name;
+        de.inum = it->inum;
         list.push_back(de);
     }
 
@@ -109,32 +224,9 @@ release:
     return r;
 }
 
-int yfs_client::writedir(inum dir, std::list<dirent> &list) // Write the directory entry table.
-{
-    int r = OK;
-
-    if (!isdir_p(dir))
-        return IOERR;
-
-    std::ostringstream ost;
-
-    for (std::list<dirent>::iterator it = list.begin(); it != list.end(); ++it) {
-        if (!ost.put((unsigned char)it->name.length()) ||
-                !ost.write(it->name.c_str(), it->name.length()) ||
-                !ost.write((char*)&it->inum, sizeof(inum))) {
-            printf("Error: ostringstream write failed.\n");
-            return IOERR;
-        }
-    }
-
-    EXT_RPC(ec->put(dir, ost.str()));
-
-release:
-    return r;
-}
-
-// Helper function to create a given type of inode.
-int yfs_client::createitem(inum parent, const char *name, mode_t mode, inum &ino_out, uint32_t type)
+// Helper function to create a given type of inode, with optional initial content.
+int yfs_client::createitem(inum parent, const char *name, mode_t mode, inum &ino_out, uint32_t type,
+        const char *content)
 {
     int r = OK;
 
@@ -151,38 +243,33 @@ int yfs_client::createitem(inum parent, const char *name, mode_t mode, inum &ino
 
     std::string fname = std::string(name);
 
-    if (!filename_valid(fname))
-        return IOERR;
-
-    if (!isdir_p(parent))
+    if (!filename_valid(fname) || !inum_valid(parent))
         return IOERR;
 
-    // Read the directory entries.
-    std::list<dirent> itemlist;
-
-    r = readdir_p(parent, itemlist);
-    if (r != OK)
-        return r;
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::op_result> results;
 
-    // Check whether the name already exist.
-    for (std::list<dirent>::iterator it = itemlist.begin(); it != itemlist.end(); ++it)
-        if (it->name == fname)
-            return EXIST;
+    /* Allocate a new inode and link it into the parent at the extent server,
+     * which fails if the name already exists. The content is written by the same op before the
+     * name is linked, so the new item is never seen empty and nothing is left behind on failure.
+     * Inode allocation is atomic at the extent server, so no lock is needed.
+     */
+    ops.push_back(extent_protocol::op(extent_protocol::dir_add_entry, parent));
+    ops.back().name = fname;
+    ops.back().type = type;
+    if (content)
+        ops.back().buf = content;
 
-    dirent de;
-    de.name = fname;
+    EXT_RPC(change_dir(parent, ops, results));
+    dcache_forget(parent);
 
-    // Allocate a new inode.
-    LCK_RPC(lc->acquire(CREATE_LOCK_ID), IOERR); // Lock for create inode operations.
-    EXT_RPC(ec->create(type, ino_out));
-    de.inum = ino_out;
+    if (results[0].ret == extent_protocol::EXIST)
+        return EXIST;
 
-    // Add the new entry to the directory and write back.
-    itemlist.push_back(de);
-    r = writedir(parent, itemlist);
+    EXT_RPC(results[0].ret);
+    ino_out = results[0].eid;
 
 release:
-    LCK_RPC(lc->release(CREATE_LOCK_ID), IOERR);
     return r;
 }
 
@@ -349,6 +436,63 @@ release:
     return r;
 }
 
+/* Fill st with the attributes of an inode. Return false if it has no valid type.
+ * The mode and link count are faked. */
+bool yfs_client::fill_stat(inum inum, const extent_protocol::attr &a, struct stat &st)
+{
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inum;
+
+    switch (a.type) {
+        case extent_protocol::T_FILE:
+            st.st_mode = S_IFREG | 0666;
+            st.st_nlink = 1;
+            st.st_size = a.size;
+            break;
+        case extent_protocol::T_DIR:
+            st.st_mode = S_IFDIR | 0777;
+            st.st_nlink = 2;
+            break;
+        case extent_protocol::T_SYMLINK:
+            st.st_mode = S_IFLNK | 0777;
+            st.st_nlink = 1;
+            st.st_size = a.size;
+            break;
+        default: // Invalid inode or unimplemented file type.
+            return false;
+    }
+
+    st.st_atime = a.atime;
+    st.st_mtime = a.mtime;
+    st.st_ctime = a.ctime;
+    return true;
+}
+
+/* Get the type and attributes of an inode in one extent RPC, which is not sent at all while they are leased.
+ * No lock is needed, the extent server reads attributes atomically, and extent_client applies the writes of
+ * this client first.
+ */
+int yfs_client::stat(inum inum, struct stat &st)
+{
+    int r = OK;
+    extent_protocol::attr a;
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inum;
+
+    if (!inum_valid(inum))
+        return NOENT;
+
+    EXT_RPC(ec->getattr(inum, a));
+
+    if (!fill_stat(inum, a, st))
+        return NOENT;
+    printf("stat %016llx -> type %u size %u\n", inum, a.type, a.size);
+
+release:
+    return r;
+}
+
 // Only support set size of attr
 int yfs_client::setattr(inum ino, size_t size)
 {
@@ -363,18 +507,10 @@ int yfs_client::setattr(inum ino, size_t size)
     if (!inum_valid(ino))
         return IOERR;
 
-    size_t csize;
-    std::string content;
-
     LCK_RPC(lc->acquire(ino), IOERR);
 
-    // Get current content.
-    EXT_RPC(ec->get(ino, content));
-
-    csize = content.length();
-
-    // Write new content.
-    EXT_RPC(ec->put(ino, size > csize ? (content + std::string(size - csize, '\0')) : content.substr(0, size)));
+    // The extent server drops or zero-fills the content beyond size.
+    EXT_RPC(ec->truncate(ino, size));
 
 release:
     LCK_RPC(lc->release(ino), IOERR);
@@ -383,24 +519,13 @@ release:
 
 int yfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    int r;
-
-    LCK_RPC(lc->acquire(parent), IOERR);
-    r = createitem(parent, name, mode, ino_out, extent_protocol::T_FILE);
-    LCK_RPC(lc->release(parent), IOERR);
-
-    return r;
+    // The extent server links the new inode atomically, so the parent does not need to be locked.
+    return createitem(parent, name, mode, ino_out, extent_protocol::T_FILE);
 }
 
 int yfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
-    int r;
-
-    LCK_RPC(lc->acquire(parent), IOERR);
-    r = createitem(parent, name, mode, ino_out, extent_protocol::T_DIR);
-    LCK_RPC(lc->release(parent), IOERR);
-
-    return r;
+    return createitem(parent, name, mode, ino_out, extent_protocol::T_DIR);
 }
 
 int yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
@@ -423,43 +548,88 @@ int yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out
     if (!filename_valid(fname))
         return r;
 
-    std::list<dirent> itemlist;
+    if (!inum_valid(parent))
+        return IOERR;
 
-    LCK_RPC(lc->acquire(parent), IOERR);
-    if (!isdir_p(parent)) {
-        r = IOERR;
-        goto release;
+    // Names looked up recently are answered locally while the parent stays leased.
+    unsigned long long expiry = ec->lease_expiry(parent);
+    if (expiry && dcache_lookup(parent, expiry, fname, found, ino_out)) {
+        printf("lookup: %s in %llu from dentry cache\n", name, parent);
+        return r;
     }
 
-    r = readdir_p(parent, itemlist);
-
-    if (r != OK)
-        goto release;
-
-    for (std::list<dirent>::iterator it = itemlist.begin(); it != itemlist.end(); ++it) {
-        if (it->name == fname) {
+    /* The extent server looks up the name atomically, so the parent does not need to be locked.
+     * It leases the parent in the same request, so that the result holds until the lease expires.
+     * The server recalls the lease before the parent is changed, see extent_client::recall(). */
+    switch (ec->dir_lookup_lease(parent, fname, ino_out, expiry)) {
+        case extent_protocol::OK:
             found = true;
-            ino_out = it->inum;
             break;
-        }
+        case extent_protocol::NOENT:
+            break;
+        default:
+            r = IOERR;
     }
 
-release:
-    LCK_RPC(lc->release(parent), IOERR);
+    // A name not found is remembered too, as an inum of 0.
+    if (r == OK && expiry && ec->lease_expiry(parent) == expiry)
+        dcache_insert(parent, expiry, fname, found ? ino_out : 0);
+
     return r;
 }
 
 int yfs_client::readdir(inum dir, std::list<dirent> &list)
 {
-    int r;
+    // The extent server lists the directory atomically, so it does not need to be locked.
+    return readdir_p(dir, list);
+}
+
+/* List a directory with the attributes of its entries in one extent RPC. The attributes are leased
+ * by extent_client, so stat() calls for the entries soon after are answered locally.
+ * An entry whose inode is gone has only st_ino set.
+ */
+int yfs_client::readdirplus(inum dir, std::list<direntplus> &list)
+{
+    int r = OK;
+
+    list.clear();
+
+    if (!inum_valid(dir))
+        return NOENT;
+
+    std::vector<extent_protocol::dirent_plus> entries;
+    direntplus de;
+
+    // The extent server lists the directory atomically, and fails if dir is not a directory.
+    if (ec->dir_list_plus(dir, entries) != extent_protocol::OK) {
+        // Tell a missing inode and one that is not a directory from other errors.
+        extent_protocol::attr a;
+        if (ec->getattr(dir, a) != extent_protocol::OK || a.type == extent_protocol::T_DIR)
+            r = IOERR;
+        else
+            r = a.type ? NOTDIR : NOENT;
+        printf("readdirplus: %llu fails with %d\n", dir, r);
+        goto release;
+    }
 
-    LCK_RPC(lc->acquire(dir), IOERR);
-    r = readdir_p(dir, list);
-    LCK_RPC(lc->release(dir), IOERR);
+    for (std::vector<extent_protocol::dirent_plus>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        de.name = it->name;
+        de.inum = it->inum;
+        fill_stat(it->inum, it->a, de.st);
+        list.push_back(de);
+    }
 
+release:
     return r;
 }
 
+// A directory is about to be listed, start fetching its entries.
+void yfs_client::opendir(inum dir)
+{
+    if (inum_valid(dir))
+        ec->prefetch_dir(dir);
+}
+
 int yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
     int r = OK;
@@ -469,8 +639,6 @@ int yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
      * note: read using ec->get().
      */
 
-    std::string content;
-
     LCK_RPC(lc->acquire(ino), IOERR);
     if (!isfile_p(ino)) {
         data.clear();
@@ -478,8 +646,8 @@ int yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
         goto release;
     }
 
-    EXT_RPC(ec->get(ino, content));
-    data = content.substr(off, size);
+    // Only fetch the requested range, the extent server clips it to the end of file.
+    EXT_RPC(ec->read(ino, off, size, data));
 
 release:
     LCK_RPC(lc->release(ino), IOERR);
@@ -498,10 +666,6 @@ int yfs_client::write(inum ino, size_t size, off_t off, const char *data, size_t
 
     bytes_written = 0;
 
-    size_t newsize;
-    std::string content, newcontent;
-    char *buf;
-
     // Check input parameters.
     if (!data)
         return r;
@@ -512,25 +676,8 @@ int yfs_client::write(inum ino, size_t size, off_t off, const char *data, size_t
         goto release;
     }
 
-    // Read original content.
-    EXT_RPC(ec->get(ino, content));
-
-    newsize = maxsize2(content.length(), off + size);
-
-    buf = (char*)calloc(newsize, 1); // Buffer already initialized to '\0's.
-    if (!buf) {
-        printf("Error: calloc failed.\n");
-        exit(-1);
-    }
-
-    // Construct new content.
-    memcpy(buf, content.c_str(), content.length());
-    memcpy(buf + off, data, size);
-    newcontent = std::string(buf, newsize); // We have to specify size, or the construction may stop at '\0'!
-    free(buf);
-
-    // Write back.
-    EXT_RPC(ec->put(ino, newcontent));
+    // Only send the written range, the extent server fills holes with '\0's.
+    EXT_RPC(ec->write(ino, off, std::string(data, size))); // We have to specify size, or the construction may stop at '\0'!
     bytes_written = size;
 
 release:
@@ -548,9 +695,11 @@ int yfs_client::unlink(inum parent, const char *name)
      * and update the parent directory content.
      */
 
-    std::list<dirent> itemlist;
-    std::list<dirent>::iterator it;
     inum delinum;
+    extent_protocol::attr a;
+    extent_protocol::status ret;
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::op_result> results;
 
     // Check input parameters.
     if (!name)
@@ -561,45 +710,36 @@ int yfs_client::unlink(inum parent, const char *name)
     if (!filename_valid(fname))
         return NOENT;
 
-    LCK_RPC(lc->acquire(parent), IOERR);
-    if (!isdir_p(parent)) {
-        r = IOERR;
-        goto release;
-    }
-
-    // Read the directory entries.
-    r = readdir_p(parent, itemlist);
-    if (r != OK)
-        goto release;
+    if (!inum_valid(parent))
+        return IOERR;
 
-    // Find position of the name.
-    for (it = itemlist.begin(); it != itemlist.end(); ++it)
-        if (it->name == fname)
-            break;
+    // Lock the parent, so that the name still refers to the same inode when we remove it.
+    LCK_RPC(lc->acquire(parent), IOERR);
 
-    if (it == itemlist.end()) { // Name not found.
-        r = NOENT;
+    ret = ec->dir_lookup(parent, fname, delinum);
+    if (ret != extent_protocol::OK) {
+        r = ret == extent_protocol::NOENT ? NOENT : IOERR;
         goto release;
     }
 
-    delinum = it->inum;
-
     if (lc->acquire(delinum) != lock_protocol::OK) {
         r = IOERR;
         goto release;
     }
 
-    if (!isfile_p(delinum) && !issymlink_p(delinum)) { // Not a (regular) file or a symlink, cannot unlink.
+    if (ec->getattr(delinum, a) != extent_protocol::OK
+            || (a.type != extent_protocol::T_FILE && a.type != extent_protocol::T_SYMLINK)) {
+        // Not a (regular) file or a symlink, cannot unlink.
         r = IOERR;
     } else {
-        // Remove the entry from the directory and write back.
-        itemlist.erase(it);
-        r = writedir(parent, itemlist);
-        if (r == OK) {
-            // Remove the inode.
-            if (ec->remove(delinum) != extent_protocol::OK)
-                r = IOERR;
-        }
+        // Remove the entry from the directory and the inode in one round trip.
+        ops.push_back(extent_protocol::op(extent_protocol::dir_remove_entry, parent));
+        ops.back().name = fname;
+        ops.push_back(extent_protocol::op(extent_protocol::remove, delinum, extent_protocol::OP_CHAIN));
+
+        if (change_dir(parent, ops, results) != extent_protocol::OK || results.back().ret != extent_protocol::OK)
+            r = IOERR;
+        dcache_forget(parent);
     }
 
     if (lc->release(delinum) != lock_protocol::OK) {
@@ -620,30 +760,9 @@ int yfs_client::symlink(inum parent, const char *name, const char *target, inum
     if (!target || !strlen(target))
         return IOERR;
 
-    LCK_RPC(lc->acquire(parent), IOERR);
+    // Create a symlink type inode with target path as its content.
+    r = createitem(parent, name, 0, ino_out, extent_protocol::T_SYMLINK, target);
 
-    // Create a symlink type inode.
-    r = createitem(parent, name, 0, ino_out, extent_protocol::T_SYMLINK);
-
-    if (r != OK)
-        goto release;
-
-    if (lc->acquire(ino_out) != lock_protocol::OK) {
-        r = IOERR;
-        goto release;
-    }
-
-    // Write target path as its content.
-    if (ec->put(ino_out, std::string(target)) != extent_protocol::OK)
-        r = IOERR;
-
-    if (lc->release(ino_out) != lock_protocol::OK) {
-        r = IOERR;
-        goto release;
-    }
-
-release:
-    LCK_RPC(lc->release(parent), IOERR);
     return r;
 }
 
@@ -665,6 +784,20 @@ release:
     return r;
 }
 
+// Wait until the writes to ino are at the extent server.
+int yfs_client::fsync(inum ino)
+{
+    int r = OK;
+
+    if (!inum_valid(ino))
+        return IOERR;
+
+    EXT_RPC(ec->sync(ino));
+
+release:
+    return r;
+}
+
 int yfs_client::commit()
 {
     int r = OK;
@@ -680,6 +813,7 @@ int yfs_client::undo()
     int r = OK;
 
     EXT_RPC(ec->undo());
+    dcache_forget_all();
 
 release:
     return r;
@@ -690,6 +824,7 @@ int yfs_client::redo()
     int r = OK;
 
     EXT_RPC(ec->redo());
+    dcache_forget_all();
 
 release:
     return r;
@@ -9,9 +9,13 @@
 //#include "yfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #define MAX_FILENAME 255 // Maximum file name length allowed.
-#define CREATE_LOCK_ID 0 // Lock id for create inode operations.
+#define DCACHE_SIZE 4096 // Maximum number of names in the dentry cache.
 
 #define CA_FILE "./cert/ca.pem"
 #define USERFILE "./etc/passwd"
@@ -23,7 +27,7 @@ class yfs_client {
 
 public:
     typedef unsigned long long inum;
-    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, NOPEM, ERRPEM, EINVA, ECTIM, ENUSE };
+    enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, NOPEM, ERRPEM, EINVA, ECTIM, ENUSE, NOTDIR };
     typedef int status;
 
     struct fileinfo {
@@ -41,15 +45,58 @@ public:
         std::string name;
         yfs_client::inum inum;
     };
+    struct direntplus {
+        std::string name;
+        yfs_client::inum inum;
+        struct stat st;
+    };
 
 private:
+    /* Names looked up in a directory, with the inode they refer to, or 0 if not found.
+     * They are only used while the attributes of the directory stay leased by the same lease,
+     * see extent_client::lease_expiry(). The extent server does not change a directory whose
+     * attributes are leased, and a change by this client drops the lease, so they are never outdated.
+     */
+    struct dentries {
+        unsigned long long expiry;
+        std::map<std::string, inum> names;
+    };
+    pthread_mutex_t dcache_mutex;
+    std::map<inum, dentries> dcache;
+    size_t dcache_names;
+    bool dcache_lookup(inum parent, unsigned long long expiry, const std::string &name, bool &found, inum &ino);
+    void dcache_insert(inum parent, unsigned long long expiry, const std::string &name, inum ino);
+    void dcache_forget(inum parent);
+    void dcache_forget_all();
+
+    /* Changes to a directory are sent in batches. While a compound request changing a directory is
+     * in flight, the changes other threads make to it are staged, and the first of them then sends
+     * all of them in one request. Each change is a sequence of ops, whose first op is not chained.
+     */
+    struct staged_change {
+        std::vector<extent_protocol::op> ops;
+        std::vector<extent_protocol::op_result> results;
+        extent_protocol::status ret;
+        bool done;
+    };
+    struct dir_batch {
+        std::list<staged_change*> staged;
+        bool busy; // A batch is in flight.
+        dir_batch() : busy(false) {}
+    };
+    pthread_mutex_t batch_mutex;
+    pthread_cond_t batch_cond;
+    std::map<inum, dir_batch> batches;
+    extent_protocol::status change_dir(inum dir, const std::vector<extent_protocol::op> &ops,
+            std::vector<extent_protocol::op_result> &results);
+
     static bool filename_valid(std::string);
     static bool inum_valid(inum);
+    static bool fill_stat(inum, const extent_protocol::attr &, struct stat &);
 
     // Private helper functions.
     int readdir_p(inum, std::list<dirent> &);
-    int writedir(inum, std::list<dirent> &);
-    int createitem(inum, const char *, mode_t, inum &, uint32_t);
+    int createitem(inum, const char *, mode_t, inum &, uint32_t, const char *content = NULL);
     bool istype(inum, uint32_t);
     bool isfile_p(inum);
     bool isdir_p(inum);
@@ -67,17 +114,21 @@ public:
     int getfile(inum, fileinfo &);
     int getdir(inum, dirinfo &);
     int getsymlink(inum, fileinfo &);
+    int stat(inum, struct stat &);
 
     int setattr(inum, size_t);
     int lookup(inum, const char *, bool &, inum &);
     int create(inum, const char *, mode_t, inum &);
     int readdir(inum, std::list<dirent> &);
+    int readdirplus(inum, std::list<direntplus> &);
+    void opendir(inum);
     int write(inum, size_t, off_t, const char *, size_t &);
     int read(inum, size_t, off_t, std::string &);
     int unlink(inum, const char *);
     int mkdir(inum, const char *, mode_t, inum &);
     int symlink(inum, const char *, const char *, inum &);
     int readlink(inum, std::string &);
+    int fsync(inum);
 
     int commit();
     int undo();